@@ -0,0 +1,325 @@
+#!/usr/bin/env python3
+"""Options() load test driver.
+
+Originates Local channels into the options-load context of extensions.conf at a fixed rate
+through AMI, then reports how long Options() took, how long each call took to get through it,
+the CPU used by Asterisk and the database queries run per call.
+
+Only needs the Python 3 standard library.
+"""
+
+import argparse
+import json
+import os
+import random
+import re
+import socket
+import sys
+import threading
+import time
+
+# Dialed numbers , as a national subscriber would dial them , and how often they are dialed
+DESTINATIONS = [
+    ("06", 8, 40),      # French mobile , 336... once normalized
+    ("01", 8, 30),      # French landline
+    ("0044", 10, 15),   # International
+    ("0899", 6, 10),    # Premium , blocked by every group
+    ("00881", 8, 5),    # Satellite , blocked by every group
+]
+
+
+class Ami:
+    """Minimal AMI client : one reader thread , responses matched on ActionID"""
+
+    def __init__(self, host, port, timeout):
+        self.sock = socket.create_connection((host, port), timeout=timeout)
+        self.sock.settimeout(None)
+        self.lock = threading.Lock()
+        self.pending = {}
+        self.handlers = []
+        self.next_id = 0
+        self.closed = False
+        self.banner = self._readline()
+        self.reader = threading.Thread(target=self._read_loop, daemon=True)
+
+    def _readline(self):
+        data = b""
+        while not data.endswith(b"\r\n"):
+            chunk = self.sock.recv(1)
+            if not chunk:
+                raise ConnectionError("AMI connection closed")
+            data += chunk
+        return data.decode(errors="replace").strip()
+
+    def start(self):
+        self.reader.start()
+
+    def _read_loop(self):
+        buffer = b""
+        while not self.closed:
+            try:
+                chunk = self.sock.recv(65536)
+            except OSError:
+                break
+            if not chunk:
+                break
+            buffer += chunk
+            while b"\r\n\r\n" in buffer:
+                block, buffer = buffer.split(b"\r\n\r\n", 1)
+                self._dispatch(block.decode(errors="replace"))
+        self.closed = True
+
+    def _dispatch(self, block):
+        message = {"_raw": block}
+        for line in block.split("\r\n"):
+            key, sep, value = line.partition(":")
+            if sep and key and " " not in key:
+                message.setdefault(key.strip(), value.strip())
+        action_id = message.get("ActionID")
+        if "Response" in message and action_id in self.pending:
+            slot = self.pending.pop(action_id)
+            slot["message"] = message
+            slot["event"].set()
+            return
+        for handler in self.handlers:
+            handler(message, time.monotonic())
+
+    def send(self, action, wait=True, timeout=10, **fields):
+        with self.lock:
+            self.next_id += 1
+            action_id = str(self.next_id)
+            slot = {"event": threading.Event(), "message": None}
+            if wait:
+                self.pending[action_id] = slot
+            lines = ["Action: %s" % action, "ActionID: %s" % action_id]
+            for key, value in fields.items():
+                if isinstance(value, (list, tuple)):
+                    lines.extend("%s: %s" % (key, item) for item in value)
+                else:
+                    lines.append("%s: %s" % (key, value))
+            self.sock.sendall(("\r\n".join(lines) + "\r\n\r\n").encode())
+        if not wait:
+            return None
+        if not slot["event"].wait(timeout):
+            self.pending.pop(action_id, None)
+            raise TimeoutError("No response to AMI action %s" % action)
+        return slot["message"]
+
+    def command(self, command):
+        return self.send("Command", Command=command)["_raw"]
+
+    def close(self):
+        self.closed = True
+        try:
+            self.send("Logoff", wait=False)
+        except OSError:
+            pass
+        self.sock.close()
+
+
+def connect(args):
+    """Wait for Asterisk to accept AMI logins"""
+    deadline = time.monotonic() + args.connect_timeout
+    while True:
+        try:
+            ami = Ami(args.host, args.port, 5)
+            ami.start()
+            response = ami.send("Login", Username=args.username, Secret=args.secret, Events="on")
+            if response.get("Response") != "Success":
+                sys.exit("AMI login refused : %s" % response.get("Message"))
+            return ami
+        except (OSError, ConnectionError):
+            if time.monotonic() > deadline:
+                sys.exit("Unable to reach AMI on %s:%d" % (args.host, args.port))
+            time.sleep(0.5)
+
+
+def cpu_seconds(pid):
+    """User and system CPU time of a process , from /proc"""
+    if not pid:
+        return None
+    try:
+        with open("/proc/%d/stat" % pid) as stat:
+            fields = stat.read().rsplit(")", 1)[1].split()
+    except OSError:
+        return None
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+def module_counters(ami):
+    """Queries run by app_options and cache counters , read from its CLI commands"""
+    counters = {}
+    patterns = {
+        "queries": (r"Queries\s*=\s*\[(\d+)\]", "options admission show"),
+        "shed": (r"Shed\s*=\s*\[(\d+)\]", "options admission show"),
+        "hits": (r"Hits\s*=\s*\[?(\d+)", "options cache show"),
+        "misses": (r"Misses\s*=\s*\[?(\d+)", "options cache show"),
+    }
+    outputs = {}
+    for name, (pattern, command) in patterns.items():
+        if command not in outputs:
+            try:
+                outputs[command] = ami.command(command)
+            except TimeoutError:
+                outputs[command] = ""
+        match = re.search(pattern, outputs[command])
+        counters[name] = int(match.group(1)) if match else None
+    return counters
+
+
+def percentiles(values):
+    if not values:
+        return None
+    values = sorted(values)
+    result = {}
+    for name, rank in (("p50", 0.50), ("p90", 0.90), ("p95", 0.95), ("p99", 0.99)):
+        result[name] = values[min(len(values) - 1, int(rank * len(values)))]
+    result["max"] = values[-1]
+    result["avg"] = sum(values) / len(values)
+    return result
+
+
+def destination(rng):
+    prefix, digits, _ = rng.choices(DESTINATIONS, weights=[d[2] for d in DESTINATIONS])[0]
+    return prefix + "".join(rng.choice("0123456789") for _ in range(digits))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Drive Options() through Local channels and report its capacity")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=5039)
+    parser.add_argument("--username", default="loadtest")
+    parser.add_argument("--secret", default="loadtest")
+    parser.add_argument("--context", default="options-load")
+    parser.add_argument("--rate", type=float, default=50, help="calls originated per second")
+    parser.add_argument("--calls", type=int, default=3000, help="calls to originate")
+    parser.add_argument("--hold", type=float, default=2, help="seconds a call stays up once through Options()")
+    parser.add_argument("--users", type=int, default=10000, help="accounts seeded by options_load_seed()")
+    parser.add_argument("--pidfile", help="Asterisk pid file , to measure its CPU use")
+    parser.add_argument("--seed", type=int, default=1, help="random seed , for repeatable runs")
+    parser.add_argument("--drain", type=float, default=30, help="seconds to wait for the last calls to end")
+    parser.add_argument("--connect-timeout", type=float, default=30)
+    parser.add_argument("--json", help="also write the report to this file")
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    ami = connect(args)
+    pid = None
+    if args.pidfile:
+        with open(args.pidfile) as pidfile:
+            pid = int(pidfile.read().strip())
+
+    lock = threading.Lock()
+    sent = {}
+    passed = {}
+    options_ms = []
+    setup_ms = []
+    ended = {}
+    failed = []
+
+    def on_event(message, received):
+        event = message.get("Event")
+        if event == "UserEvent" and message.get("UserEvent") == "OptionsLoad":
+            call = int(message.get("Id", -1))
+            with lock:
+                if call in sent and call not in passed:
+                    passed[call] = received
+                    setup_ms.append((received - sent[call]) * 1000)
+                    try:
+                        options_ms.append((float(message["T1"]) - float(message["T0"])) * 1000)
+                    except (KeyError, ValueError):
+                        pass
+        elif event == "UserEvent" and message.get("UserEvent") == "OptionsLoadEnd":
+            call = int(message.get("Id", -1))
+            with lock:
+                ended[call] = message.get("Cause", "")
+        elif event == "OriginateResponse" and message.get("Response") == "Failure":
+            with lock:
+                failed.append(message.get("ActionID"))
+
+    ami.handlers.append(on_event)
+    before = module_counters(ami)
+    cpu_before = cpu_seconds(pid)
+    start = time.monotonic()
+
+    for call in range(args.calls):
+        due = start + call / args.rate
+        delay = due - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+        account = rng.randint(1, args.users)
+        with lock:
+            sent[call] = time.monotonic()
+        ami.send("Originate", wait=False,
+                 Channel="Local/%s@%s/n" % (destination(rng), args.context),
+                 Application="Wait", Data=str(int(args.hold) + 30),
+                 Account=str(account), Async="true", Timeout="30000",
+                 Variable=["LOADTEST_ID=%d" % call, "LOADTEST_ACCOUNT=%d" % account,
+                           "LOADTEST_HOLD=%g" % args.hold])
+    originated = time.monotonic()
+
+    deadline = originated + args.hold + args.drain
+    while time.monotonic() < deadline:
+        with lock:
+            if len(ended) + len(failed) >= args.calls:
+                break
+        time.sleep(0.2)
+    elapsed = time.monotonic() - start
+    cpu_after = cpu_seconds(pid)
+    after = module_counters(ami)
+    ami.close()
+
+    with lock:
+        refused = sum(1 for call in ended if call not in passed)
+        report = {
+            "calls": args.calls,
+            "rate": args.rate,
+            "achieved_rate": args.calls / (originated - start) if originated > start else None,
+            "passed": len(passed),
+            "refused": refused,
+            "originate_failures": len(failed),
+            "unfinished": args.calls - len(ended) - len(failed),
+            "options_ms": percentiles(options_ms),
+            "setup_ms": percentiles(setup_ms),
+        }
+    if cpu_before is not None and cpu_after is not None:
+        report["cpu_percent"] = 100 * (cpu_after - cpu_before) / elapsed
+        report["cpu_ms_per_call"] = 1000 * (cpu_after - cpu_before) / args.calls
+    if before["queries"] is not None and after["queries"] is not None:
+        report["db_queries_per_call"] = (after["queries"] - before["queries"]) / args.calls
+    if None not in (before["hits"], after["hits"], before["misses"], after["misses"]):
+        hits = after["hits"] - before["hits"]
+        lookups = hits + after["misses"] - before["misses"]
+        report["cache_hit_ratio"] = hits / lookups if lookups else None
+    if before["shed"] is not None and after["shed"] is not None:
+        report["db_shed"] = after["shed"] - before["shed"]
+
+    print("  == Options() load test : %d calls at %g/s (achieved %.1f/s) , hold %gs"
+          % (args.calls, args.rate, report["achieved_rate"] or 0, args.hold))
+    print("\tPassed             = [%d]" % report["passed"])
+    print("\tRefused or blocked = [%d]" % report["refused"])
+    print("\tOriginate failures = [%d]" % report["originate_failures"])
+    print("\tUnfinished         = [%d]" % report["unfinished"])
+    for name, title in (("options_ms", "Options() time"), ("setup_ms", "Setup latency")):
+        stats = report[name]
+        if stats:
+            print("\t%-18s = [p50 %.2f , p90 %.2f , p95 %.2f , p99 %.2f , max %.2f ms]"
+                  % (title, stats["p50"], stats["p90"], stats["p95"], stats["p99"], stats["max"]))
+    if "cpu_percent" in report:
+        print("\tAsterisk CPU       = [%.1f %% of a core , %.3f ms per call]"
+              % (report["cpu_percent"], report["cpu_ms_per_call"]))
+    if "db_queries_per_call" in report:
+        print("\tDB queries / call  = [%.2f]" % report["db_queries_per_call"])
+    if report.get("cache_hit_ratio") is not None:
+        print("\tCache hit ratio    = [%.3f]" % report["cache_hit_ratio"])
+    if "db_shed" in report:
+        print("\tShed queries       = [%d]" % report["db_shed"])
+
+    if args.json:
+        with open(args.json, "w") as output:
+            json.dump(report, output, indent=2)
+    return 0 if report["unfinished"] == 0 else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,289 @@
+#!/usr/bin/env python3
+"""Options() capture replay.
+
+Reads a file written by "options capture start" and feeds every recorded call back through Options() , with its
+data , accountcode and caller id , by originating Local channels into the options-replay context of extensions.conf.
+Calls are replayed at their original pace , at maximum speed or N times faster , optionally several copies at once
+on their own threads. Reports throughput , Options() latency percentiles and verdicts , which can be saved and
+compared between two module builds:
+
+    replay.py run capture.bin --verdicts before.json
+    replay.py run capture.bin --verdicts after.json
+    replay.py diff before.json after.json
+
+Only needs the Python 3 standard library.
+"""
+
+import argparse
+import collections
+import json
+import struct
+import sys
+import threading
+import time
+
+from driver import connect, cpu_seconds, percentiles
+
+MAGIC = b"OPTCAP01"
+HEADER = struct.Struct("<Q4B")
+FIELDS = ("data", "account", "callerid", "channel")
+
+Record = collections.namedtuple("Record", ("time",) + FIELDS)
+
+
+def read_capture(path):
+    """Records of a capture file , see struct options_capture in app_options.h"""
+    records = []
+    with open(path, "rb") as capture:
+        if capture.read(len(MAGIC)) != MAGIC:
+            sys.exit("%s is not an Options() capture" % path)
+        while True:
+            header = capture.read(HEADER.size)
+            if len(header) < HEADER.size:
+                break
+            when, *lengths = HEADER.unpack(header)
+            values = [capture.read(length) for length in lengths]
+            # A capture still being written may end in the middle of a record
+            if [len(value) for value in values] != lengths:
+                break
+            records.append(Record(when / 1e6, *(value.decode(errors="replace") for value in values)))
+    return records
+
+
+def verdict_of(message):
+    """What Options() did to a call , as reported by the h extension of options-replay"""
+    return {
+        "passed": message.get("Passed") == "1",
+        "cause": message.get("Cause", ""),
+        "callerid": message.get("CallerID", ""),
+        "recorded": message.get("Recorded") == "1",
+    }
+
+
+def replay(args):
+    records = read_capture(args.capture)
+    if not records:
+        sys.exit("%s holds no call" % args.capture)
+    ami = connect(args)
+    pid = None
+    if args.pidfile:
+        with open(args.pidfile) as pidfile:
+            pid = int(pidfile.read().strip())
+
+    total = len(records) * args.copies
+    lock = threading.Lock()
+    slots = threading.Semaphore(args.outstanding)
+    sent = {}
+    ended = {}
+    failed = []
+    options_ms = []
+    setup_ms = []
+    last = [time.monotonic()]
+
+    def on_event(message, received):
+        event = message.get("Event")
+        if event == "UserEvent" and message.get("UserEvent") == "OptionsReplay":
+            call = int(message.get("Id", -1))
+            with lock:
+                if call not in sent or call in ended:
+                    return
+                ended[call] = verdict_of(message)
+                last[0] = received
+                setup_ms.append((received - sent[call]) * 1000)
+                try:
+                    options_ms.append((float(message["T1"]) - float(message["T0"])) * 1000)
+                except (KeyError, ValueError):
+                    pass
+            slots.release()
+        elif event == "OriginateResponse" and message.get("Response") == "Failure":
+            with lock:
+                failed.append(message.get("ActionID"))
+            slots.release()
+
+    def originate(copy, start):
+        """Replay every record once , keeping the recorded gaps unless --max-speed"""
+        first = records[0].time
+        for index, record in enumerate(records):
+            if not args.max_speed:
+                delay = start + (record.time - first) / args.speed - time.monotonic()
+                if delay > 0:
+                    time.sleep(delay)
+            slots.acquire()
+            call = copy * len(records) + index
+            with lock:
+                sent[call] = time.monotonic()
+            ami.send("Originate", wait=False,
+                     Channel="Local/replay@%s/n" % args.context,
+                     Application="Wait", Data="30", Async="true", Timeout="30000",
+                     Variable=["REPLAY_ID=%d" % call, "REPLAY_DATA=%s" % record.data,
+                               "REPLAY_ACCOUNT=%s" % record.account, "REPLAY_CALLERID=%s" % record.callerid])
+
+    ami.handlers.append(on_event)
+    cpu_before = cpu_seconds(pid)
+    start = time.monotonic()
+    threads = [threading.Thread(target=originate, args=(copy, start), daemon=True) for copy in range(args.copies)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    originated = time.monotonic()
+
+    deadline = originated + args.drain
+    while time.monotonic() < deadline:
+        with lock:
+            if len(ended) + len(failed) >= total:
+                break
+        time.sleep(0.2)
+    with lock:
+        elapsed = last[0] - start
+    cpu_after = cpu_seconds(pid)
+    ami.close()
+
+    with lock:
+        verdicts = dict(ended)
+        report = {
+            "capture": args.capture,
+            "records": len(records),
+            "copies": args.copies,
+            "pace": "max" if args.max_speed else "x%g" % args.speed,
+            "captured_seconds": records[-1].time - records[0].time,
+            "replay_seconds": elapsed,
+            "completed": len(verdicts),
+            "originate_failures": len(failed),
+            "unfinished": total - len(verdicts) - len(failed),
+            "throughput": len(verdicts) / elapsed if elapsed > 0 else None,
+            "options_ms": percentiles(options_ms),
+            "setup_ms": percentiles(setup_ms),
+            "passed": sum(1 for verdict in verdicts.values() if verdict["passed"]),
+            "recorded": sum(1 for verdict in verdicts.values() if verdict["recorded"]),
+            "causes": dict(collections.Counter(verdict["cause"] for verdict in verdicts.values()
+                                               if not verdict["passed"])),
+        }
+    if cpu_before is not None and cpu_after is not None and elapsed > 0:
+        report["cpu_percent"] = 100 * (cpu_after - cpu_before) / elapsed
+        report["cpu_ms_per_call"] = 1000 * (cpu_after - cpu_before) / max(1, len(verdicts))
+
+    print("  == Options() replay : %d calls x %d copies from %s , pace %s"
+          % (len(records), args.copies, args.capture, report["pace"]))
+    print("\tCaptured over      = [%.1f s]" % report["captured_seconds"])
+    print("\tReplayed in        = [%.1f s]" % report["replay_seconds"])
+    print("\tCompleted          = [%d]" % report["completed"])
+    print("\tOriginate failures = [%d]" % report["originate_failures"])
+    print("\tUnfinished         = [%d]" % report["unfinished"])
+    if report["throughput"] is not None:
+        print("\tThroughput         = [%.1f calls/s]" % report["throughput"])
+    for name, title in (("options_ms", "Options() time"), ("setup_ms", "Setup latency")):
+        stats = report[name]
+        if stats:
+            print("\t%-18s = [p50 %.2f , p90 %.2f , p95 %.2f , p99 %.2f , max %.2f ms]"
+                  % (title, stats["p50"], stats["p90"], stats["p95"], stats["p99"], stats["max"]))
+    print("\tPassed             = [%d]" % report["passed"])
+    print("\tRecorded           = [%d]" % report["recorded"])
+    for cause, count in sorted(report["causes"].items()):
+        print("\tHung up , cause %-3s = [%d]" % (cause, count))
+    if "cpu_percent" in report:
+        print("\tAsterisk CPU       = [%.1f %% of a core , %.3f ms per call]"
+              % (report["cpu_percent"], report["cpu_ms_per_call"]))
+
+    if args.json:
+        with open(args.json, "w") as output:
+            json.dump(report, output, indent=2)
+    if args.verdicts:
+        calls = []
+        for call, verdict in sorted(verdicts.items()):
+            record = records[call % len(records)]
+            calls.append(dict(record._asdict(), index=call % len(records), copy=call // len(records),
+                              verdict=verdict))
+        with open(args.verdicts, "w") as output:
+            json.dump({"capture": args.capture, "calls": calls}, output, indent=1)
+    return 0 if report["unfinished"] == 0 else 1
+
+
+def diff(args):
+    """Compare verdicts of the same capture replayed against two module builds"""
+    with open(args.before) as before, open(args.after) as after:
+        left = {(call["index"], call["copy"]): call for call in json.load(before)["calls"]}
+        right = {(call["index"], call["copy"]): call for call in json.load(after)["calls"]}
+    common = sorted(set(left) & set(right))
+    changed = [key for key in common if left[key]["verdict"] != right[key]["verdict"]]
+    kinds = collections.Counter()
+    for key in changed:
+        for name in ("passed", "cause", "callerid", "recorded"):
+            if left[key]["verdict"][name] != right[key]["verdict"][name]:
+                kinds[name] += 1
+
+    print("  == Options() verdicts : %s -> %s" % (args.before, args.after))
+    print("\tCompared           = [%d]" % len(common))
+    print("\tOnly in one run    = [%d]" % (len(set(left) ^ set(right))))
+    print("\tIdentical          = [%d]" % (len(common) - len(changed)))
+    print("\tDifferent          = [%d]" % len(changed))
+    for name in ("passed", "cause", "callerid", "recorded"):
+        if kinds[name]:
+            print("\t  %-16s = [%d]" % (name, kinds[name]))
+    for key in changed[:args.limit]:
+        call = left[key]
+        print("\t#%d.%d data=%s account=%s callerid=%s channel=%s"
+              % (key[0], key[1], call["data"], call["account"], call["callerid"], call["channel"]))
+        print("\t\t%s\n\t\t%s" % (json.dumps(call["verdict"], sort_keys=True),
+                                     json.dumps(right[key]["verdict"], sort_keys=True)))
+    return 1 if changed else 0
+
+
+def show(args):
+    """Summary of a capture file"""
+    records = read_capture(args.capture)
+    if not records:
+        print("%s holds no call" % args.capture)
+        return 0
+    span = records[-1].time - records[0].time
+    print("  == Options() capture %s" % args.capture)
+    print("\tCalls              = [%d]" % len(records))
+    print("\tFrom               = [%s]" % time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(records[0].time)))
+    print("\tDuration           = [%.1f s , %.1f calls/s]" % (span, len(records) / span if span else 0))
+    print("\tAccounts           = [%d]" % len({record.account for record in records}))
+    for record in records[:args.limit]:
+        print("\t%.6f data=%s account=%s callerid=%s channel=%s"
+              % (record.time, record.data, record.account, record.callerid, record.channel))
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Replay Options() calls recorded by \"options capture start\"")
+    commands = parser.add_subparsers(dest="command")
+    commands.required = True
+
+    run = commands.add_parser("run", help="replay a capture through Asterisk")
+    run.add_argument("capture")
+    run.add_argument("--host", default="127.0.0.1")
+    run.add_argument("--port", type=int, default=5039)
+    run.add_argument("--username", default="loadtest")
+    run.add_argument("--secret", default="loadtest")
+    run.add_argument("--context", default="options-replay")
+    run.add_argument("--speed", type=float, default=1, help="replay N times faster than captured")
+    run.add_argument("--max-speed", action="store_true", help="ignore captured times , send calls back to back")
+    run.add_argument("--copies", type=int, default=1, help="copies of the capture replayed at once , one thread each")
+    run.add_argument("--outstanding", type=int, default=500, help="calls in progress at most")
+    run.add_argument("--pidfile", help="Asterisk pid file , to measure its CPU use")
+    run.add_argument("--drain", type=float, default=30, help="seconds to wait for the last calls to end")
+    run.add_argument("--connect-timeout", type=float, default=30)
+    run.add_argument("--json", help="also write the report to this file")
+    run.add_argument("--verdicts", help="write the verdict of every call to this file , for replay.py diff")
+    run.set_defaults(handler=replay)
+
+    compare = commands.add_parser("diff", help="compare verdicts of two replays")
+    compare.add_argument("before")
+    compare.add_argument("after")
+    compare.add_argument("--limit", type=int, default=20, help="different calls listed")
+    compare.set_defaults(handler=diff)
+
+    summary = commands.add_parser("show", help="summarize a capture file")
+    summary.add_argument("capture")
+    summary.add_argument("--limit", type=int, default=10, help="calls listed")
+    summary.set_defaults(handler=show)
+
+    args = parser.parse_args()
+    return args.handler(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
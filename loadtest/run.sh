@@ -0,0 +1,49 @@
+#!/bin/sh
+# Options() load test : seed the database , start a sandboxed Asterisk and drive calls into it.
+# Needs a local MySQL/MariaDB , Asterisk with app_options installed and python3.
+# Extra arguments go to driver.py (--rate , --calls , --hold , --json ...).
+# "run.sh replay <capture> ..." replays a capture with replay.py instead , extra arguments go to "replay.py run".
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+RUN=${RUN:-$HERE/run}
+ASTERISK=${ASTERISK:-asterisk}
+MODDIR=${ASTERISK_MODDIR:-/usr/lib/asterisk/modules}
+MYSQL=${MYSQL:-mysql -uroot}
+NB_USERS=${NB_USERS:-10000}
+NB_TENANTS=${NB_TENANTS:-50}
+NB_GROUPS=${NB_GROUPS:-200}
+SEED=${SEED:-yes}
+
+if [ "$SEED" = yes ]; then
+    echo "  == Seeding options_load : $NB_USERS users , $NB_TENANTS tenants , $NB_GROUPS groups"
+    $MYSQL < "$HERE/schema.sql"
+    $MYSQL options_load -e "CALL options_load_seed($NB_USERS, $NB_TENANTS, $NB_GROUPS)"
+    $MYSQL options_load < "$HERE/../sql/prefix_indexes.sql"
+fi
+
+echo "  == Starting Asterisk in $RUN"
+rm -rf "$RUN"
+mkdir -p "$RUN/etc" "$RUN/lib" "$RUN/spool" "$RUN/run" "$RUN/log" "$RUN/monitor"
+for conf in "$HERE"/asterisk/*.conf; do
+    sed -e "s|@RUN@|$RUN|g" -e "s|@MODDIR@|$MODDIR|g" "$conf" > "$RUN/etc/$(basename "$conf")"
+done
+$ASTERISK -C "$RUN/etc/asterisk.conf"
+trap '$ASTERISK -C "$RUN/etc/asterisk.conf" -rx "core stop now" >/dev/null 2>&1 || true' EXIT INT TERM
+
+# Asterisk writes its pid file once started
+for i in $(seq 1 50); do
+    [ -s "$RUN/run/asterisk.pid" ] && break
+    sleep 0.2
+done
+$ASTERISK -C "$RUN/etc/asterisk.conf" -rx "core show application Options" | grep -q "Options" || {
+    echo "app_options is not loaded , see $RUN/log/messages" >&2
+    exit 1
+}
+
+if [ "$1" = replay ]; then
+    shift
+    python3 "$HERE/replay.py" run --pidfile "$RUN/run/asterisk.pid" "$@"
+else
+    python3 "$HERE/driver.py" --pidfile "$RUN/run/asterisk.pid" --users "$NB_USERS" "$@"
+fi
@@ -0,0 +1,128 @@
+-- Database of the Options() load test (MySQL 5.7+ / MariaDB 10.1+)
+-- Tables hold the columns app_options reads , then options_load_seed() fills them:
+--     mysql -uroot < schema.sql
+--     mysql -uroot options_load -e "CALL options_load_seed(10000, 50, 200)"
+
+CREATE DATABASE IF NOT EXISTS options_load;
+CREATE USER IF NOT EXISTS 'options_load'@'127.0.0.1' IDENTIFIED BY 'options_load';
+CREATE USER IF NOT EXISTS 'options_load'@'localhost' IDENTIFIED BY 'options_load';
+GRANT SELECT ON options_load.* TO 'options_load'@'127.0.0.1';
+GRANT SELECT ON options_load.* TO 'options_load'@'localhost';
+
+USE options_load;
+
+DROP TABLE IF EXISTS users, options, group_user, group_agent, blocked_prefix_user, blocked_prefix_group,
+    prefix_in, dids, didToUser;
+
+CREATE TABLE users (
+    UserID INT NOT NULL PRIMARY KEY,
+    TenantID INT NOT NULL,
+    KEY users_tenant (TenantID)
+) ENGINE = InnoDB;
+
+CREATE TABLE options (
+    UserID INT NOT NULL PRIMARY KEY,
+    cidIsAcode TINYINT NOT NULL DEFAULT 0,
+    Monitored TINYINT NOT NULL DEFAULT 0,
+    RCLI TINYINT NOT NULL DEFAULT 0
+) ENGINE = InnoDB;
+
+CREATE TABLE group_user (
+    GUID INT NOT NULL AUTO_INCREMENT PRIMARY KEY,
+    UserID INT NOT NULL,
+    GroupID INT NOT NULL
+) ENGINE = InnoDB;
+
+CREATE TABLE group_agent (
+    GAID INT NOT NULL AUTO_INCREMENT PRIMARY KEY,
+    GroupID INT NOT NULL,
+    monitored TINYINT NOT NULL DEFAULT 0,
+    KEY group_agent_group (GroupID)
+) ENGINE = InnoDB;
+
+CREATE TABLE blocked_prefix_user (
+    BPUID INT NOT NULL AUTO_INCREMENT PRIMARY KEY,
+    UserID INT NOT NULL,
+    prefix VARCHAR(25) NOT NULL
+) ENGINE = InnoDB;
+
+CREATE TABLE blocked_prefix_group (
+    BPGID INT NOT NULL AUTO_INCREMENT PRIMARY KEY,
+    GroupID INT NOT NULL,
+    prefix VARCHAR(25) NOT NULL
+) ENGINE = InnoDB;
+
+CREATE TABLE prefix_in (
+    PIID INT NOT NULL AUTO_INCREMENT PRIMARY KEY,
+    TenantID INT NOT NULL,
+    prefix VARCHAR(25) NOT NULL,
+    digit_delete INT NOT NULL DEFAULT 0,
+    new_prefix VARCHAR(25) NOT NULL DEFAULT ''
+) ENGINE = InnoDB;
+
+CREATE TABLE dids (
+    DIDID INT NOT NULL AUTO_INCREMENT PRIMARY KEY,
+    did VARCHAR(25) NOT NULL
+) ENGINE = InnoDB;
+
+-- Joined to dids with NATURAL JOIN : DIDID must be the only common column
+CREATE TABLE didToUser (
+    DIDID INT NOT NULL PRIMARY KEY,
+    userid INT NOT NULL,
+    KEY didToUser_user (userid)
+) ENGINE = InnoDB;
+
+DROP PROCEDURE IF EXISTS options_load_seed;
+
+DELIMITER //
+
+-- Accounts 1..nbUsers spread over nbTenants tenants and nbGroups groups
+--   every 20th account is recorded , every 4th has RCLI with a 01 and a 06 did ,
+--   every 3rd belongs to a second group , every 7th may not call French mobiles (336) ,
+--   every group blocks premium numbers (33899) and 881 , every 10th group is recorded.
+-- prefix_in turns national numbers (0...) into 33... and strips 00 of international ones.
+CREATE PROCEDURE options_load_seed(IN nbUsers INT, IN nbTenants INT, IN nbGroups INT)
+BEGIN
+    DECLARE i INT DEFAULT 1;
+
+    START TRANSACTION;
+    WHILE i <= nbTenants DO
+        INSERT INTO prefix_in (TenantID, prefix, digit_delete, new_prefix)
+        VALUES (i, '00', 2, ''), (i, '0', 1, '33'), (i, '+', 1, '');
+        SET i = i + 1;
+    END WHILE;
+
+    SET i = 1;
+    WHILE i <= nbGroups DO
+        INSERT INTO group_agent (GroupID, monitored) VALUES (i, i % 10 = 0);
+        INSERT INTO blocked_prefix_group (GroupID, prefix) VALUES (i, '33899'), (i, '881');
+        SET i = i + 1;
+    END WHILE;
+
+    SET i = 1;
+    WHILE i <= nbUsers DO
+        INSERT INTO users (UserID, TenantID) VALUES (i, 1 + i % nbTenants);
+        INSERT INTO options (UserID, cidIsAcode, Monitored, RCLI) VALUES (i, 0, i % 20 = 0, i % 4 = 0);
+        INSERT INTO group_user (UserID, GroupID) VALUES (i, 1 + i % nbGroups);
+        IF i % 3 = 0 THEN
+            INSERT INTO group_user (UserID, GroupID) VALUES (i, 1 + (i + 1) % nbGroups);
+        END IF;
+        IF i % 7 = 0 THEN
+            INSERT INTO blocked_prefix_user (UserID, prefix) VALUES (i, '336');
+        END IF;
+        IF i % 4 = 0 THEN
+            INSERT INTO dids (did) VALUES (CONCAT('01', LPAD(i, 8, '0')));
+            INSERT INTO didToUser (DIDID, userid) VALUES (LAST_INSERT_ID(), i);
+            INSERT INTO dids (did) VALUES (CONCAT('06', LPAD(i, 8, '0')));
+            INSERT INTO didToUser (DIDID, userid) VALUES (LAST_INSERT_ID(), i);
+        END IF;
+        IF i % 1000 = 0 THEN
+            COMMIT;
+            START TRANSACTION;
+        END IF;
+        SET i = i + 1;
+    END WHILE;
+    COMMIT;
+END //
+
+DELIMITER ;
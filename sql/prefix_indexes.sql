@@ -0,0 +1,22 @@
+-- Indexes used by prefix_lookup = candidates (options.conf , [general])
+--
+-- Without cache , prefix tables are searched with "prefix IN ('3','33','331',...)" : one
+-- entry per leading substring of the dialed number. Each lookup then reads at most 25 index
+-- entries instead of the whole table. The key column comes first so the same indexes also
+-- serve the cache loads (WHERE TenantID / GroupID / UserID = ...).
+--
+-- prefix must keep a binary or case insensitive collation on a VARCHAR (not TEXT) column to
+-- be indexable ; prefixes longer than 25 characters can never match a dialed number.
+
+ALTER TABLE prefix_in
+    ADD INDEX prefix_in_tenant_prefix (TenantID, prefix);
+
+ALTER TABLE blocked_prefix_group
+    ADD INDEX blocked_prefix_group_group_prefix (GroupID, prefix);
+
+ALTER TABLE blocked_prefix_user
+    ADD INDEX blocked_prefix_user_user_prefix (UserID, prefix);
+
+-- Join of blocked_prefix_group with the groups of the caller
+ALTER TABLE group_user
+    ADD INDEX group_user_user_group (UserID, GroupID);
@@ -10,6 +10,7 @@
 /*** MODULEINFO
         <depend>app_mixmonitor</depend>
         <depend>mysqlclient</depend>
+        <depend>sqlite3</depend>
         <support_level>extended</support_level>
         <defaultenabled>no</defaultenabled>
  ***/
@@ -23,6 +24,11 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 000001 $");
 #include "asterisk/channel.h"
 /** Pbx Functions **/
 #include "asterisk/pbx.h"
+/** CLI and AMI Functions **/
+#include "asterisk/cli.h"
+#include "asterisk/manager.h"
+/** Hangup causes **/
+#include "asterisk/causes.h"
 #include "asterisk/app_options.h"
 
 /*** DOCUMENTATION
@@ -63,6 +69,90 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 000001 $");
                                 <configOption name="port" default="3306">
                                         <synopsis>The database port</synopsis>
                                 </configOption>
+                                <configOption name="max_inflight" default="8">
+                                        <synopsis>Maximum number of concurrent database queries (1-64)</synopsis>
+                                        <description>
+                                                <para>Queries beyond this limit wait for a free slot. Waiting queries
+                                                are served in round robin between tenants.</para>
+                                        </description>
+                                </configOption>
+                                <configOption name="max_queue_wait" default="500">
+                                        <synopsis>Milliseconds a query may wait for a free slot</synopsis>
+                                </configOption>
+                                <configOption name="shed_verdict" default="allow">
+                                        <synopsis>What to do with a call whose query waited longer than max_queue_wait</synopsis>
+                                        <description>
+                                                <enumlist>
+                                                        <enum name="allow"><para>Skip remaining options and let the call continue , unless its
+                                                        blocked prefix check could not run : the call is then hung up.</para></enum>
+                                                        <enum name="hangup"><para>Hangup the call.</para></enum>
+                                                </enumlist>
+                                        </description>
+                                </configOption>
+                                <configOption name="replica">
+                                        <synopsis>A read replica , as host[:port][,weight]</synopsis>
+                                        <description>
+                                                <para>May be given up to 8 times. Replicas use the primary credentials over TCP.
+                                                Each lookup draws two healthy replicas , with chances proportional to their weight
+                                                (1 to 100 , default 1) , and goes to the one with the lowest latency divided by its
+                                                weight. Lookups fall back to the primary.</para>
+                                        </description>
+                                </configOption>
+                                <configOption name="replica_check_interval" default="5">
+                                        <synopsis>Seconds between two health checks of the replicas</synopsis>
+                                </configOption>
+                                <configOption name="storage" default="mysql">
+                                        <synopsis>Where lookups read their data from</synopsis>
+                                        <description>
+                                                <enumlist>
+                                                        <enum name="mysql"><para>Query MySQL (primary and replicas).</para></enum>
+                                                        <enum name="sqlite"><para>Query the local sqlite_file , copied from MySQL
+                                                        every sync_interval seconds. With cache_ttl set to 0 , lookups are cached until the next sync.</para></enum>
+                                                </enumlist>
+                                        </description>
+                                </configOption>
+                                <configOption name="sqlite_file" default="/var/lib/asterisk/options.sqlite3">
+                                        <synopsis>Local SQLite file used by storage sqlite</synopsis>
+                                </configOption>
+                                <configOption name="sync_interval" default="300">
+                                        <synopsis>Seconds between two copies of MySQL into sqlite_file , 0 to sync only on demand</synopsis>
+                                </configOption>
+                                <configOption name="prefix_lookup" default="like">
+                                        <synopsis>How prefix tables are searched when lookups are not cached</synopsis>
+                                        <description>
+                                                <para>Applies to prefix_in , blocked_prefix_group and blocked_prefix_user
+                                                with cache_ttl set to 0 and storage mysql.</para>
+                                                <enumlist>
+                                                        <enum name="like"><para>Match the number against each prefix with LIKE ,
+                                                        which reads the whole table.</para></enum>
+                                                        <enum name="candidates"><para>Look up every leading substring of the number
+                                                        (25 at most) with prefix IN (...) and keep the longest match. Needs the
+                                                        indexes of sql/prefix_indexes.sql.</para></enum>
+                                                </enumlist>
+                                        </description>
+                                </configOption>
+                                <configOption name="slow_query_threshold" default="100">
+                                        <synopsis>Milliseconds (waiting and running) over which a query is kept in the slow log , 0 for none</synopsis>
+                                        <description>
+                                                <para>The slow log is displayed with <literal>options show slowqueries</literal>.
+                                                Every statement sent to MySQL starts with a comment holding the uniqueid
+                                                of the call and the step of Options() that ran it.</para>
+                                        </description>
+                                </configOption>
+                                <configOption name="slow_query_sample" default="0">
+                                        <synopsis>Fraction (0 to 1) of faster queries also kept in the slow log</synopsis>
+                                </configOption>
+                                <configOption name="slow_query_log_size" default="100">
+                                        <synopsis>Number of queries kept in the slow log (0-10000)</synopsis>
+                                </configOption>
+                                <configOption name="coalesce_queries" default="yes">
+                                        <synopsis>Let identical concurrent lookups share one MySQL query</synopsis>
+                                        <description>
+                                                <para>A call about to send a statement another call is already running
+                                                waits for its rows instead. Rows are not kept once delivered. Counters are
+                                                shown by <literal>options coalescing show</literal>.</para>
+                                        </description>
+                                </configOption>
                         </configObject>
 
                         <configObject name="options">
@@ -76,9 +166,131 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 000001 $");
                                 <configOption name="extension">
                                         <synopsis>Extension of audio file to save</synopsis>
                                 </configOption>
+                                <configOption name="cache_ttl" default="300">
+                                        <synopsis>Lifetime in seconds of cached account and prefix data</synopsis>
+                                        <description>
+                                                <para>Set to 0 to query the database on every call. Cached data can be
+                                                dropped before it expires with <literal>options cache invalidate</literal>
+                                                or the <literal>OptionsCacheInvalidate</literal> AMI action.</para>
+                                        </description>
+                                </configOption>
+                                <configOption name="cache_refresh_ahead" default="80">
+                                        <synopsis>Percent of cache_ttl after which cached data still in use is reloaded in background</synopsis>
+                                        <description>
+                                                <para>The first call using an entry past this point queues its reload and goes on
+                                                with the cached data. Set to 0 to reload entries only once they expire.</para>
+                                        </description>
+                                </configOption>
+                                <configOption name="cache_stale_ttl" default="30">
+                                        <synopsis>Seconds expired data is still served while it is reloaded in background</synopsis>
+                                        <description>
+                                                <para>Set to 0 to load expired data on the call path.</para>
+                                        </description>
+                                </configOption>
+                                <configOption name="cache_ttl_jitter" default="10">
+                                        <synopsis>Percent cache lifetimes are randomly spread by , from 0 to 50</synopsis>
+                                        <description>
+                                                <para>Entries loaded together , after a reload or an invalidation , then do
+                                                not expire together.</para>
+                                        </description>
+                                </configOption>
+                                <configOption name="shadow_sample" default="0">
+                                        <synopsis>Fraction (0 to 1) of calls served from the cache checked again on MySQL in background</synopsis>
+                                        <description>
+                                                <para>Sampled calls are run again through the MySQL queries used without
+                                                cache , off the call path , and any decision that differs is logged with the
+                                                inputs of the call. Counters are shown by <literal>options shadow show</literal>
+                                                and the fraction can be changed with <literal>options shadow set</literal>.</para>
+                                        </description>
+                                </configOption>
+                                <configOption name="user_cps" default="0">
+                                        <synopsis>New calls per second allowed to each UserID , 0 for no limit</synopsis>
+                                        <description>
+                                                <para>Bursts of up to this many calls are accepted at once. Calls over
+                                                a limit are hung up before any database query. Limits can be changed
+                                                with <literal>options limits set</literal>.</para>
+                                        </description>
+                                </configOption>
+                                <configOption name="user_calls" default="0">
+                                        <synopsis>Calls in progress allowed to each UserID , 0 for no limit</synopsis>
+                                </configOption>
+                                <configOption name="tenant_cps" default="0">
+                                        <synopsis>New calls per second allowed to each TenantID , 0 for no limit</synopsis>
+                                        <description>
+                                                <para>The tenant of an account is only known once it has been cached :
+                                                the first call of an account is checked after its lookups.</para>
+                                        </description>
+                                </configOption>
+                                <configOption name="tenant_calls" default="0">
+                                        <synopsis>Calls in progress allowed to each TenantID , 0 for no limit</synopsis>
+                                </configOption>
+                                <configOption name="cache_partition" default="account">
+                                        <synopsis>How accounts missing from the cache are loaded</synopsis>
+                                        <description>
+                                                <enumlist>
+                                                        <enum name="account"><para>One account at a time , on its first
+                                                        call.</para></enum>
+                                                        <enum name="tenant"><para>Every account of its tenant at once , on the
+                                                        first call of the tenant. Calls of the tenant arriving during the load
+                                                        wait for it instead of querying the database.</para></enum>
+                                                </enumlist>
+                                                <para>Cached tenants are listed by <literal>options tenants show</literal>.</para>
+                                        </description>
+                                </configOption>
+                                <configOption name="cache_max_memory" default="0">
+                                        <synopsis>Megabytes cached accounts may hold , 0 for no ceiling</synopsis>
+                                        <description>
+                                                <para>Over this ceiling , the accounts of the least recently called tenants
+                                                are dropped from the cache.</para>
+                                        </description>
+                                </configOption>
                         </configObject>
                 </configFile>
         </configInfo>
+
+        <manager name="OptionsCacheInvalidate" language="en_US">
+                <synopsis>
+                        Drop cached Options data.
+                </synopsis>
+                <syntax>
+                        <xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+                        <parameter name="Scope" required="true">
+                                <enumlist>
+                                        <enum name="user" />
+                                        <enum name="tenant" />
+                                        <enum name="group" />
+                                        <enum name="table" />
+                                </enumlist>
+                        </parameter>
+                        <parameter name="Target" required="true">
+                                <para>The UserID, TenantID, GroupID or table name to invalidate.</para>
+                        </parameter>
+                </syntax>
+                <description>
+                        <para>Cached entries matching the target are dropped and reloaded from the database on next use.</para>
+                </description>
+        </manager>
+        <manager name="OptionsCacheRefresh" language="en_US">
+                <synopsis>
+                        Reload cached Options data from the database.
+                </synopsis>
+                <syntax>
+                        <xi:include xpointer="xpointer(/docs/manager[@name='OptionsCacheInvalidate']/syntax/parameter[@name='ActionID'])" />
+                        <xi:include xpointer="xpointer(/docs/manager[@name='OptionsCacheInvalidate']/syntax/parameter[@name='Scope'])" />
+                        <xi:include xpointer="xpointer(/docs/manager[@name='OptionsCacheInvalidate']/syntax/parameter[@name='Target'])" />
+                </syntax>
+                <description>
+                        <para>Cached entries matching the target are reloaded from the database immediately.</para>
+                </description>
+        </manager>
+        <manager name="OptionsCacheShow" language="en_US">
+                <synopsis>
+                        Show Options cache statistics.
+                </synopsis>
+                <syntax>
+                        <xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+                </syntax>
+        </manager>
  ***/
 
 
@@ -90,6 +302,11 @@ static void *dbCredentials_alloc(void) {
         ast_log(LOG_WARNING, "Memory Error , Allocation of dbCredentials failed!\n");
         return NULL;
     }
+    ast_mutex_init(&dbInfo->poolLock);
+    /** The primary is always usable as a last resort **/
+    dbInfo->endpoints[0].weight = 1;
+    dbInfo->endpoints[0].healthy = 1;
+    dbInfo->nbEndpoints = 1;
     if (ast_string_field_init(dbInfo, 128)) {
         ast_log(LOG_WARNING, "Memory Error , Allocation of dbCredentials failed!\n");
         ao2_ref(dbInfo, -1);
@@ -101,6 +318,25 @@ static void *dbCredentials_alloc(void) {
 /*! \brief free a database_configuration structure */
 static void dbCredentials_destructor(void *obj) {
     struct database_configuration *dbInfo = obj;
+    struct options_endpoint *endpoint;
+    int i, j;
+    /* Close DB Connections after checking if connection is still active*/
+    for (i = 0; i < dbInfo->nbEndpoints; i++) {
+        endpoint = &dbInfo->endpoints[i];
+        for (j = 0; j < OPTIONS_DB_POOL_SIZE; j++) {
+            if (endpoint->pool[j].conn) {
+                if (!mysql_ping(endpoint->pool[j].conn))
+                    mysql_close(endpoint->pool[j].conn);
+                ast_free(endpoint->pool[j].conn);
+            }
+        }
+        if (endpoint->healthConn) {
+            mysql_close(endpoint->healthConn);
+            ast_free(endpoint->healthConn);
+        }
+        ast_free(endpoint->hostname);
+    }
+    ast_mutex_destroy(&dbInfo->poolLock);
     ast_string_field_free_memory(dbInfo);
     return;
 }
@@ -150,9 +386,6 @@ static void *global_option_alloc(void) {
 /*! \brief free an global_option structure */
 static void global_option_destructor(void *obj) {
     struct option_global *global_option = obj;
-    /* Close DB Connection  after checking if connection is still active*/
-    if (!mysql_ping(&global_option->dbCredentials->conn))
-        mysql_close(&global_option->dbCredentials->conn);
     ao2_cleanup(global_option->dbCredentials);
     ao2_cleanup(global_option->options);
 }
@@ -201,23 +434,55 @@ static int dataSanityCheck(struct ast_channel *chan, const char *data) {
 static int is_trunked_asp_account(struct ast_channel *chan, struct database_configuration *dbInfo) {
     char queryString[512];
     int numRows = 0;
-    MYSQL_RES *myres = NULL;
+    struct options_rows *myres = NULL;
     MYSQL_ROW myrow;
     const char *accountCode = ast_channel_accountcode(chan);
 
+    if (options_use_cache()) {
+        struct options_account account;
+        struct options_account target;
+        char userId[16];
+        if (options_cache_account(accountCode, dbInfo, &account, 0) || !account.hasOptions) {
+            return 1;
+        }
+        if (!account.cidIsAcode) {
+            ast_log(LOG_DEBUG, "Option TrunkAsp is not enabled on accountCode[%s]\n", accountCode);
+            return 0;
+        }
+        ast_log(LOG_DEBUG, "Option Trunk ASP is enabled for user[%s]\n", accountCode);
+        const char *CallerIdNum = S_COR(ast_channel_caller(chan)->id.number.valid,
+                                        ast_channel_caller(chan)->id.number.str, "<Unknown>");
+        if (is_string_digits(CallerIdNum)) {
+            ast_log(LOG_WARNING,
+                    "Trunk ASP is enabled , CallerId should correspond to an accountCode but instead we got invalid CallerId[%s]\n",
+                    CallerIdNum);
+            return 1;
+        }
+        if (options_cache_account(CallerIdNum, dbInfo, &target, 0) || !target.found ||
+            target.tenantId != account.tenantId) {
+            ast_log(LOG_WARNING,
+                    "User table said that CallerID corresponds to an Accountcode in the Tenant. But there isn't accountcode for %s value on UserID %s.\n",
+                    CallerIdNum, accountCode
+            );
+            return 1;
+        }
+        snprintf(userId, sizeof(userId), "%d", target.userId);
+        ast_channel_accountcode_set(chan, userId);
+        return 0;
+    }
+
     sprintf(
             queryString,
             "SELECT options.cidIsAcode, users.TenantID FROM users INNER JOIN options USING(UserID) WHERE users.UserID='%s'",
             accountCode
     );
-    myres = MYSQL_query(myres, &numRows, queryString, dbInfo);
+    myres = options_query(myres, &numRows, queryString, dbInfo);
     /** Check if there is data or error **/
     if (numRows < 1) {
-        mysql_free_result(myres);
+        ao2_cleanup(myres);
         return 1;
     }
-    mysql_data_seek(myres, 0);
-    myrow = mysql_fetch_row(myres);
+    myrow = options_rows_fetch(myres, 0);
     if (atoi(myrow[0]) == 1) { /** Option is Enable for this user **/
         ast_log(LOG_DEBUG, "Option Trunk ASP is enabled for user[%s]\n", accountCode);
         /** Extract callerId **/
@@ -234,7 +499,7 @@ static int is_trunked_asp_account(struct ast_channel *chan, struct database_conf
         /** Let's find to wich accountid the callerid refers and modify it ! **/
         sprintf(queryString, "SELECT UserID FROM users WHERE (UserID=%s) AND (TenantID=%s)",
                 CallerIdNum, myrow[1]);
-        myres = MYSQL_query(myres, &numRows, queryString, dbInfo);
+        myres = options_query(myres, &numRows, queryString, dbInfo);
         if (numRows < 1) /** No Rows returned or error **/
         {
             ast_log(LOG_WARNING,
@@ -244,16 +509,15 @@ static int is_trunked_asp_account(struct ast_channel *chan, struct database_conf
             return 1;
         }
         /** Let's change accountId with callerIdNumber number **/
-        mysql_data_seek(myres, 0);
-        myrow = mysql_fetch_row(myres);
+        myrow = options_rows_fetch(myres, 0);
         /** Set new accountCode **/
         ast_channel_accountcode_set(chan, myrow[0]);
-        mysql_free_result(myres);
+        ao2_cleanup(myres);
         return 0;
     }
 
     ast_log(LOG_DEBUG, "Option TrunkAsp is not enabled on accountCode[%s]\n", ast_channel_accountcode(chan));
-    mysql_free_result(myres);
+    ao2_cleanup(myres);
     return 0;
 }
 
@@ -266,78 +530,151 @@ static int is_trunked_asp_account(struct ast_channel *chan, struct database_conf
  *  0 => prefix allowed
  */
 static int
-is_prefix_bloqued(struct ast_channel *chan, const char *formattedNumber, struct database_configuration *dbInfo) {
+is_prefix_bloqued(struct ast_channel *chan, const char *formattedNumber, const struct options_channel_memo *memo,
+                  struct database_configuration *dbInfo) {
     const char *accountCode = ast_channel_accountcode(chan);
-    char querystring[512];
+
+    if (options_use_cache()) {
+        struct options_account account;
+        RAII_VAR(struct options_account_extra *, extra, NULL, ao2_cleanup);
+        const struct options_prefix_rule *rule;
+        int blockedGroups = 0;
+        int i;
+        /** Groups and prohibitions of an earlier run on this channel , the account is not looked up again **/
+        if (memo && memo->groupCount >= 0 && memo->extra) {
+            account.groupCount = memo->groupCount;
+            extra = ao2_bump(memo->extra);
+        } else {
+            if (options_cache_account(accountCode, dbInfo, &account, 1)) {
+                account.groupCount = 0;
+            }
+            extra = account.extra;
+        }
+        if (!extra || !account.groupCount) {
+            ast_log(LOG_WARNING, "-- %s : UserID %s is not assigned on a group.\n", ast_channel_uniqueid(chan),
+                    accountCode);
+            return 1;
+        }
+        ast_log(LOG_DEBUG, "-- %s : UserID %s is assigned on %i group(s).\n", ast_channel_uniqueid(chan), accountCode,
+                account.groupCount);
+        for (i = 0; i < extra->nbGroups; i++) {
+            struct options_prefix_set *set = options_cache_group_prefixes(extra->groups[i], dbInfo);
+            if (!set) { /** Error on load , Block ! **/
+                return 1;
+            }
+            if (options_prefix_match(set->rules, set->count, formattedNumber)) {
+                blockedGroups++;
+            }
+            ao2_ref(set, -1);
+        }
+        if (blockedGroups == account.groupCount) {
+            ast_log(LOG_WARNING,
+                    "-- %s : UserID %s is not allowed to dial this prefix (each group have prohibition).\n",
+                    ast_channel_uniqueid(chan), accountCode);
+            return 1;
+        }
+        if ((rule = options_prefix_match(extra->blocked, extra->nbBlocked, formattedNumber))) {
+            ast_log(LOG_WARNING, "-- %s : UserID %s is not allowed to dial this prefix (prohibition with prefix %s).\n",
+                    ast_channel_uniqueid(chan), accountCode, rule->prefix);
+            return 1;
+        }
+        return 0;
+    }
+
+    return options_sql_prefix_blocked(ast_channel_uniqueid(chan), accountCode, formattedNumber, dbInfo) != 0;
+}
+
+/*! \brief Check on MySQL if prefix is bloqued , without the cache
+ * @return
+ *  1 => prefix bloqued
+ *  0 => prefix allowed
+ * -1 => database error
+ */
+static int options_sql_prefix_blocked(const char *uniqueid, const char *accountCode, const char *formattedNumber,
+                                      struct database_configuration *dbInfo) {
+    char querystring[1024];
+    char candidates[512];
     int numRows = 0;
-    MYSQL_RES *myres = NULL;
+    struct options_rows *myres = NULL;
     MYSQL_ROW myrow;
     int groupNumbers = 0;
 
     /** Now That number has been formated to international number , let's Check for groups **/
     // Check if users belong to a group
     sprintf(querystring, "SELECT count(GUID) FROM group_user WHERE group_user.UserID=%s", accountCode);
-    myres = MYSQL_query(myres, &numRows, querystring, dbInfo);
+    myres = options_query(myres, &numRows, querystring, dbInfo);
     if (numRows < 0) /** Error on query , Block ! **/
     {
-        mysql_free_result(myres);
-        return 1;
+        ao2_cleanup(myres);
+        return -1;
     } else { /** Got x group assigned to this user **/
-        mysql_data_seek(myres, 0);
-        myrow = mysql_fetch_row(myres);
+        myrow = options_rows_fetch(myres, 0);
         groupNumbers = atoi(myrow[0]);
         if (!groupNumbers) { /** Zero groups assigned to this user **/
-            ast_log(LOG_WARNING, "-- %s : UserID %s is not assigned on a group.\n", ast_channel_uniqueid(chan),
+            ast_log(LOG_WARNING, "-- %s : UserID %s is not assigned on a group.\n", uniqueid,
                     accountCode);
-            mysql_free_result(myres);
+            ao2_cleanup(myres);
             return 1;
         }
-        ast_log(LOG_DEBUG, "-- %s : UserID %s is assigned on %i group(s).\n", ast_channel_uniqueid(chan), accountCode,
+        ast_log(LOG_DEBUG, "-- %s : UserID %s is assigned on %i group(s).\n", uniqueid, accountCode,
                 groupNumbers);
     }
 
     /** How Many  groups are not allowed to dial this prefix **/
-    sprintf(querystring,
-            "SELECT COUNT(DISTINCT(blocked_prefix_group.GroupID)) FROM blocked_prefix_group INNER JOIN group_user USING(GroupID) WHERE (group_user.UserID=%s) AND (SELECT '%s' LIKE BINARY CONCAT(blocked_prefix_group.prefix,'%s'))",
-            accountCode, formattedNumber, "%");
-    myres = MYSQL_query(myres, &numRows, querystring, dbInfo);
+    if (dbInfo->prefixLookup == OPTIONS_PREFIX_CANDIDATES &&
+        options_prefix_candidates(formattedNumber, candidates, sizeof(candidates))) {
+        sprintf(querystring,
+                "SELECT COUNT(DISTINCT(blocked_prefix_group.GroupID)) FROM blocked_prefix_group INNER JOIN group_user USING(GroupID) WHERE (group_user.UserID=%s) AND (blocked_prefix_group.prefix IN (%s))",
+                accountCode, candidates);
+    } else {
+        candidates[0] = '\0';
+        sprintf(querystring,
+                "SELECT COUNT(DISTINCT(blocked_prefix_group.GroupID)) FROM blocked_prefix_group INNER JOIN group_user USING(GroupID) WHERE (group_user.UserID=%s) AND (SELECT '%s' LIKE BINARY CONCAT(blocked_prefix_group.prefix,'%s'))",
+                accountCode, formattedNumber, "%");
+    }
+    myres = options_query(myres, &numRows, querystring, dbInfo);
     if (numRows < 0) /** Errors on Query , block Call **/
     {
-        mysql_free_result(myres);
-        return 1;
+        ao2_cleanup(myres);
+        return -1;
     } else if (numRows) /** User belongs to a list of groups , let's count them **/
     {
-        mysql_data_seek(myres, 0);
-        myrow = mysql_fetch_row(myres);
+        myrow = options_rows_fetch(myres, 0);
         if (groupNumbers == atoi(myrow[0])) {
             ast_log(LOG_WARNING,
                     "-- %s : UserID %s is not allowed to dial this prefix (each group have prohibition).\n",
-                    ast_channel_uniqueid(chan), accountCode);
-            mysql_free_result(myres);
+                    uniqueid, accountCode);
+            ao2_cleanup(myres);
             return 1;
         }
     }
 
     /** Check for user's prohibitions **/
-    sprintf(querystring,
-            "SELECT blocked_prefix_user.prefix FROM blocked_prefix_user WHERE (blocked_prefix_user.UserID=%s) AND (SELECT '%s' LIKE BINARY CONCAT(blocked_prefix_user.prefix,'%s'))",
-            accountCode, formattedNumber, "%");
+    if (!ast_strlen_zero(candidates)) {
+        sprintf(querystring,
+                "SELECT blocked_prefix_user.prefix FROM blocked_prefix_user WHERE (blocked_prefix_user.UserID=%s) AND (blocked_prefix_user.prefix IN (%s))",
+                accountCode, candidates);
+    } else {
+        sprintf(querystring,
+                "SELECT blocked_prefix_user.prefix FROM blocked_prefix_user WHERE (blocked_prefix_user.UserID=%s) AND (SELECT '%s' LIKE BINARY CONCAT(blocked_prefix_user.prefix,'%s'))",
+                accountCode, formattedNumber, "%");
+    }
 
-    myres = MYSQL_query(myres, &numRows, querystring, dbInfo);
+    myres = options_query(myres, &numRows, querystring, dbInfo);
     if (numRows < 0) /** Error on Query , Force Hangyp **/
     {
-        mysql_free_result(myres);
-        return 1;
+        ao2_cleanup(myres);
+        return -1;
     } else if (numRows) {
-        mysql_data_seek(myres, 0);
-        myrow = mysql_fetch_row(myres);
+        /** Report the longest prohibition , as the cache does **/
+        myrow = options_prefix_longest_row(myres, 0);
         ast_log(LOG_WARNING, "-- %s : UserID %s is not allowed to dial this prefix (prohibition with prefix %s).\n",
-                ast_channel_uniqueid(chan), accountCode, myrow[0]);
-        mysql_free_result(myres);
+                uniqueid, accountCode, myrow[0]);
+        ao2_cleanup(myres);
         return 1;
     }
 
-    mysql_free_result(myres);
+    ao2_cleanup(myres);
     return 0;
 }
 
@@ -375,45 +712,80 @@ static int forceHangup(const char *channel_name) {
  * 0 Failure => Call won be recorded
  */
 static int isCallMonitored(struct ast_channel *chan, struct database_configuration *dbInfo) {
+    const char *accountCode = ast_channel_accountcode(chan);
+
+    if (options_use_cache()) {
+        struct options_account account;
+        if (options_cache_account(accountCode, dbInfo, &account, 0)) {
+            return 0;
+        }
+        if (account.groupMonitored > 0) {
+            ast_log(LOG_DEBUG, "UserID[%s] has group monitoring set to 1\n", accountCode);
+            return 1;
+        }
+        if (account.monitored > 0) {
+            ast_log(LOG_DEBUG, "UserID[%s] has calls monitoring options set to 1\n", accountCode);
+            return 1;
+        }
+        return 0;
+    }
+
+    return options_sql_call_monitored(accountCode, dbInfo) > 0;
+}
+
+/*! \brief Check on MySQL if users call should be recorded , without the cache
+ * @return
+ * 1 => Call Must Be recorded
+ * 0 => Call won be recorded
+ * -1 => database error
+ */
+static int options_sql_call_monitored(const char *accountCode, struct database_configuration *dbInfo) {
     char queryString[512];
     int numRows = 0;
-    MYSQL_RES *myres = NULL;
+    struct options_rows *myres = NULL;
     MYSQL_ROW myrow;
-    const char *accountCode = ast_channel_accountcode(chan);
+
     /** Check if the group is monitored **/
     sprintf(queryString,
             "SELECT COUNT(GUID) FROM group_user INNER JOIN group_agent USING(GroupID) WHERE (group_user.UserID=%s) AND (group_agent.monitored=1);",
             accountCode
     );
-    myres = MYSQL_query(myres, &numRows, queryString, dbInfo);
-    if (numRows > -1 && numRows) /** No errors on Query and query returned 1 row **/
+    myres = options_query(myres, &numRows, queryString, dbInfo);
+    if (numRows < 0) {
+        ao2_cleanup(myres);
+        return -1;
+    }
+    if (numRows) /** No errors on Query and query returned 1 row **/
     {
         /** If monitor option for group is set to 1 , force recording **/
-        mysql_data_seek(myres, 0);
-        myrow = mysql_fetch_row(myres);
+        myrow = options_rows_fetch(myres, 0);
         if (atoi(myrow[0]) > 0) /** Option monitor group is enabled **/
         {
             ast_log(LOG_DEBUG, "UserID[%s] has group monitoring set to 1\n", accountCode);
-            mysql_free_result(myres);
+            ao2_cleanup(myres);
             return 1;
         } else /** Let's Check if the users has recording option set to 1 **/
         {
             sprintf(queryString, "SELECT options.Monitored FROM options WHERE (options.UserId=%s);", accountCode);
-            myres = MYSQL_query(myres, &numRows, queryString, dbInfo);
-            if (numRows > -1 && numRows) /** No errors on Query  and query returned one row**/
+            myres = options_query(myres, &numRows, queryString, dbInfo);
+            if (numRows < 0) {
+                ao2_cleanup(myres);
+                return -1;
+            }
+            if (numRows) /** No errors on Query  and query returned one row**/
             {
-                mysql_data_seek(myres, 0);
-                myrow = mysql_fetch_row(myres);
+                myrow = options_rows_fetch(myres, 0);
                 if (atoi(myrow[0]) > 0) /** User monitoring is enabled **/
                 {
                     ast_log(LOG_DEBUG, "UserID[%s] has calls monitoring options set to 1\n", accountCode);
-                    mysql_free_result(myres);
+                    ao2_cleanup(myres);
                     return 1;
                 }
             }
         }
     }
 
+    ao2_cleanup(myres);
     return 0;
 }
 
@@ -446,27 +818,57 @@ static void recordCall(struct ast_channel *chan, struct option_configuration *co
 
 static void
 get_international_number(const char *destNumber, char *formattedNumber, struct database_configuration *dbInfo) {
-    char querystring[512];
-    MYSQL_RES *myres = NULL;
+    if (options_use_cache()) {
+        RAII_VAR(struct options_prefix_set *, set, options_cache_prefix_in(1, dbInfo), ao2_cleanup);
+        const struct options_prefix_rule *rule = set ? options_prefix_match(set->rules, set->count, destNumber) : NULL;
+        if (rule) {
+            int skip = MIN(rule->digitDelete, (int) strlen(destNumber));
+            snprintf(formattedNumber, 26, "%s%s", rule->newPrefix, destNumber + MAX(skip, 0));
+        } else {
+            snprintf(formattedNumber, 26, "%s", destNumber);
+        }
+        ast_log(LOG_DEBUG, "-- International number is %s.\n", formattedNumber);
+        return;
+    }
+
+    options_sql_international_number(destNumber, formattedNumber, dbInfo);
+}
+
+/*! \brief Format number to international number from prefix_in rows on MySQL , without the cache
+ * @return 0 on success , -1 on database error (number left as dialed)
+ */
+static int options_sql_international_number(const char *destNumber, char *formattedNumber,
+                                            struct database_configuration *dbInfo) {
+    char querystring[1024];
+    char candidates[512];
+    struct options_rows *myres = NULL;
     MYSQL_ROW myrow;
     int numRows;
     char buffer[26];
 
-    sprintf(querystring,
-            "SELECT prefix_in.digit_delete, prefix_in.new_prefix FROM prefix_in WHERE ((SELECT '%s' LIKE BINARY CONCAT(prefix_in.prefix,'%s') ) AND (prefix_in.TenantID=1)) ORDER BY CHAR_LENGTH(prefix_in.prefix) DESC LIMIT 1",
-            destNumber, "%"
-    );
-    myres = MYSQL_query(myres, &numRows, querystring, dbInfo); /** Let's try with another request to DB **/
+    if (dbInfo->prefixLookup == OPTIONS_PREFIX_CANDIDATES &&
+        options_prefix_candidates(destNumber, candidates, sizeof(candidates))) {
+        /** Longest of the matching prefixes is picked below **/
+        sprintf(querystring,
+                "SELECT prefix_in.digit_delete, prefix_in.new_prefix, prefix_in.prefix FROM prefix_in WHERE (prefix_in.TenantID=1) AND (prefix_in.prefix IN (%s))",
+                candidates
+        );
+    } else {
+        sprintf(querystring,
+                "SELECT prefix_in.digit_delete, prefix_in.new_prefix, prefix_in.prefix FROM prefix_in WHERE ((SELECT '%s' LIKE BINARY CONCAT(prefix_in.prefix,'%s') ) AND (prefix_in.TenantID=1)) ORDER BY CHAR_LENGTH(prefix_in.prefix) DESC LIMIT 1",
+                destNumber, "%"
+        );
+    }
+    myres = options_query(myres, &numRows, querystring, dbInfo); /** Let's try with another request to DB **/
     if (numRows < 0) {
         sprintf(formattedNumber, "%s", destNumber);
-        mysql_free_result(myres);
-        return;
+        ao2_cleanup(myres);
+        return -1;
     }
 
     if (numRows) /** Data returned **/
     {
-        mysql_data_seek(myres, 0);
-        myrow = mysql_fetch_row(myres);
+        myrow = options_prefix_longest_row(myres, 2);
         /** copy from i position , (sizeBuffer - number discarded) to buffer **/
         strncpy(buffer, destNumber + atoi(myrow[0]), 26 - atoi(myrow[0]));
         sprintf(formattedNumber, "%s%s", myrow[1], buffer);
@@ -475,43 +877,131 @@ get_international_number(const char *destNumber, char *formattedNumber, struct d
         sprintf(formattedNumber, "%s", destNumber);
         ast_log(LOG_DEBUG, "-- International number is %s.\n", formattedNumber);
     }
+    ao2_cleanup(myres);
+    return 0;
+}
+
+/*! \brief Build the quoted list of leading substrings of a number , for a "prefix IN (...)" lookup
+ * The empty prefix comes first : LIKE CONCAT('','%') matches every number
+ * @return number of candidates , 0 if the number holds characters that can't be sent unescaped
+ */
+static int options_prefix_candidates(const char *number, char *list, size_t size) {
+    size_t length = strlen(number), used = 0;
+    int i, written;
+
+    if (!length || length > 25 || strspn(number, "0123456789+*#") != length) {
+        return 0;
+    }
+    for (i = 0; i <= (int) length; i++) {
+        written = snprintf(list + used, size - used, "%s'%.*s'", i ? "," : "", i, number);
+        if (written < 0 || (size_t) written >= size - used) {
+            return 0;
+        }
+        used += written;
+    }
+    return (int) length + 1;
+}
+
+/*! \brief Row of a result whose prefix column is the longest */
+static MYSQL_ROW options_prefix_longest_row(struct options_rows *res, int column) {
+    MYSQL_ROW row, longest = NULL;
+    size_t best = 0;
+    int i;
+
+    for (i = 0; i < res->count; i++) {
+        row = options_rows_fetch(res, i);
+        if (!longest || (row[column] && strlen(row[column]) > best)) {
+            longest = row;
+            best = row[column] ? strlen(row[column]) : 0;
+        }
+    }
+    return longest;
+}
+
+/*! \brief Parse prefix_lookup option */
+static int prefix_lookup_handler(const struct aco_option *opt, struct ast_variable *var, void *obj) {
+    struct database_configuration *dbInfo = obj;
+
+    if (!strcasecmp(var->value, "like")) {
+        dbInfo->prefixLookup = OPTIONS_PREFIX_LIKE;
+    } else if (!strcasecmp(var->value, "candidates")) {
+        dbInfo->prefixLookup = OPTIONS_PREFIX_CANDIDATES;
+    } else {
+        ast_log(LOG_ERROR, "Invalid prefix_lookup '%s' , expected like or candidates\n", var->value);
+        return -1;
+    }
+    return 0;
+}
+
+/*! \brief Parse cache_partition option */
+static int cache_partition_handler(const struct aco_option *opt, struct ast_variable *var, void *obj) {
+    struct option_configuration *conf = obj;
+
+    if (!strcasecmp(var->value, "account")) {
+        conf->cachePartition = OPTIONS_PARTITION_ACCOUNT;
+    } else if (!strcasecmp(var->value, "tenant")) {
+        conf->cachePartition = OPTIONS_PARTITION_TENANT;
+    } else {
+        ast_log(LOG_ERROR, "Invalid cache_partition '%s' , expected account or tenant\n", var->value);
+        return -1;
+    }
+    return 0;
 }
 
 /*! \brief Check if Dynamic display of numbers is enabled **/
 static int isRcliOnCountryEnabled(struct ast_channel *chan, struct database_configuration *dbInfo) {
+    const char *accountCode = ast_channel_accountcode(chan);//UserID
+
+    if (options_use_cache()) {
+        struct options_account account;
+        if (!options_cache_account(accountCode, dbInfo, &account, 0) && account.hasOptions && account.rcli) {
+            ast_log(LOG_DEBUG, "User[%s] has RcliOnCountry Enabled!\n", accountCode);
+            return 1;
+        }
+        return 0;
+    }
+
+    return options_sql_rcli_enabled(accountCode, dbInfo) > 0;
+}
+
+/*! \brief Check on MySQL if Dynamic display of numbers is enabled , without the cache
+ * @return 1 if enabled , 0 if not , -1 on database error
+ */
+static int options_sql_rcli_enabled(const char *accountCode, struct database_configuration *dbInfo) {
     char queryString[512];
-    MYSQL_RES *myres = NULL;
+    struct options_rows *myres = NULL;
     MYSQL_ROW myrow;
     int numRows;
-    const char *accountCode = ast_channel_accountcode(chan);//UserID
 
     sprintf(queryString,
             "SELECT options.RCLI, users.TenantID FROM users INNER JOIN options USING(UserID) WHERE users.UserID='%s'",
             accountCode
     );
 
-    myres = MYSQL_query(myres, &numRows, queryString, dbInfo);
+    myres = options_query(myres, &numRows, queryString, dbInfo);
     /** Check if there is data or error **/
     if (numRows < 1) {
-        mysql_free_result(myres);
-        return 0;
+        ao2_cleanup(myres);
+        return numRows < 0 ? -1 : 0;
     }
-    mysql_data_seek(myres, 0);
-    myrow = mysql_fetch_row(myres);
+    myrow = options_rows_fetch(myres, 0);
 
     if (atoi(myrow[0])) {
         ast_log(LOG_DEBUG, "User[%s] has RcliOnCountry Enabled!\n", accountCode);
+        ao2_cleanup(myres);
         return 1;
     }
 
+    ao2_cleanup(myres);
     return 0;
 }
 
-/** Start RcliOnCountry logic **/
-static void startRcliOnCountry(struct ast_channel *chan, const char *formattedNumber, struct database_configuration *dbInfo) {
+/** Start RcliOnCountry logic
+ * @return Sda set as caller id , NULL if none
+ **/
+static const char *startRcliOnCountry(struct ast_channel *chan, const char *formattedNumber, struct database_configuration *dbInfo) {
     const char* accountCode = ast_channel_accountcode(chan);
-    char queryString[512];
-    MYSQL_RES *myres = NULL;
+    struct options_rows *myres = NULL;
     MYSQL_ROW myrow;
     int numRows;
     int prefix = 0;
@@ -521,15 +1011,38 @@ static void startRcliOnCountry(struct ast_channel *chan, const char *formattedNu
     if( !strncmp(formattedNumber , "33" , 2)){
         prefix = formattedNumber[2] - '0' ;
         ast_log(LOG_DEBUG, "French Number Detected[%s] and prefix is %d\n", formattedNumber, prefix);
+        if (options_use_cache()) {
+            struct options_account account;
+            RAII_VAR(struct options_account_extra *, extra, NULL, ao2_cleanup);
+            char didPrefix[3] = {'0', formattedNumber[2], '\0'};
+            int i;
+            if (!options_cache_account(accountCode, dbInfo, &account, 1)) {
+                extra = account.extra;
+            }
+            const char *candidates[extra ? extra->nbDids + 1 : 1];
+            numRows = 0;
+            for (i = 0; extra && i < extra->nbDids; i++) {
+                if (!strncmp(extra->dids[i], didPrefix, 2)) {
+                    candidates[numRows++] = extra->dids[i];
+                }
+            }
+            if (numRows < 1) {
+                ast_log(LOG_WARNING , "RcliOnCountry is Enabled but user[%s] have no Sda assigned for prefix[0%d]\n" , accountCode , prefix);
+                return NULL;
+            }
+            ast_log(LOG_DEBUG , "User[%s] has %d sda assigned to it\n" , accountCode , numRows);
+            const char *sda = candidates[ast_random() % numRows];
+            ast_log(LOG_DEBUG , "Number[%s] has been chosen\n" , sda);
+            ast_channel_caller(chan)->id.number.str = ast_strdup(sda);
+            ast_channel_caller(chan)->id.name.str = ast_strdup(sda);
+            return ast_channel_caller(chan)->id.number.str;
+        }
         /** Let's search for all Sda that belongs to this prefix **/
-        sprintf(queryString , "select did from dids NATURAL JOIN didToUser WHERe didToUser.userid = %s AND dids.did LIKE '0%d%%'"
-                , accountCode , prefix );
-        /** Let's Query **/
-        myres = MYSQL_query(myres , &numRows , queryString , dbInfo);
+        myres = options_sql_rcli_sdas(accountCode, prefix, &numRows, dbInfo);
         if(numRows < 1 ){
             ast_log(LOG_WARNING , "RcliOnCountry is Enabled but user[%s] have no Sda assigned for prefix[0%d]\n" , accountCode , prefix);
-            mysql_free_result(myres);
-            return ;
+            ao2_cleanup(myres);
+            return NULL;
         }
 
         ast_log(LOG_DEBUG , "User[%s] has %d sda assigned to it\n" , accountCode , numRows);
@@ -537,89 +1050,3853 @@ static void startRcliOnCountry(struct ast_channel *chan, const char *formattedNu
         time_t t;
         srand((unsigned)time(&t));
         int sdaToChoosePrefix = rand() % numRows ;
-        mysql_data_seek(myres, sdaToChoosePrefix);
-        myrow = mysql_fetch_row(myres);
+        myrow = options_rows_fetch(myres, sdaToChoosePrefix);
         /** We Got Our Sda , Let's modify it **/
         ast_log(LOG_DEBUG , "Number[%s] has been chosen\n" , myrow[0]);
         ast_channel_caller(chan)->id.number.str = ast_strdup(myrow[0]);
         ast_channel_caller(chan)->id.name.str = ast_strdup(myrow[0]);
-        mysql_free_result(myres);
+        ao2_cleanup(myres);
+        return ast_channel_caller(chan)->id.number.str;
     } else {
         ast_log(LOG_DEBUG, "RcliOnCountry Enabled but destnumber[%s] is not a french destination\n", formattedNumber);
-        return;
+        return NULL;
     }
 
 }
 
+/*! \brief All Sda of an account for a french prefix (01 to 09) , from MySQL
+ * @param numRows rows returned , -1 on error
+ */
+static struct options_rows *options_sql_rcli_sdas(const char *accountCode, int prefix, int *numRows,
+                                                  struct database_configuration *dbInfo) {
+    char queryString[512];
 
-/*! \brief main function , executed everytime our application is executed */
-static int app_exec(struct ast_channel *chan, const char *data) {
-    char formattedNumber[26];
-    if (dataSanityCheck(chan, data)) {
-        ast_log(LOG_DEBUG, "Sanity Check Has failed [ABORTING]!\n");
-        return -1;
-    }
-    /** Get global Configuration **/
+    sprintf(queryString , "select did from dids NATURAL JOIN didToUser WHERe didToUser.userid = %s AND dids.did LIKE '0%d%%'"
+            , accountCode , prefix );
+    return options_query(NULL , numRows , queryString , dbInfo);
+}
+
+
+/*! \brief Pick up cache lifetime , refresh and partitions , shadow sampling , call limits , admission limits , storage , slow log and coalescing settings from the configuration that has just been applied */
+static void options_post_apply_config(void) {
     RAII_VAR(struct option_global *, cfg, ao2_global_obj_ref(options_globals), ao2_cleanup);
-    /** Format Number to international number **/
-    get_international_number(data, formattedNumber, cfg->dbCredentials);
-    /** Check for option trunkASP **/
-    is_trunked_asp_account(chan, cfg->dbCredentials);
-    /** Check if prefix is bloqued **/
-    if (is_prefix_bloqued(chan, formattedNumber, cfg->dbCredentials))
-        forceHangup(ast_channel_name(chan));
-    /** Check if Call should be monitored/recorded in our case **/
-    if (isCallMonitored(chan, cfg->dbCredentials))
-        recordCall(chan, cfg->options);
-    /** Check if Option RcliOnCountry is enabled **/
-    if (isRcliOnCountryEnabled(chan, cfg->dbCredentials))
-        startRcliOnCountry(chan, formattedNumber, cfg->dbCredentials);
+    if (cfg && cfg->options) {
+        optionsCache.ttl = cfg->options->cacheTtl;
+        optionsCache.refreshAhead = cfg->options->cacheRefreshAhead;
+        optionsCache.staleTtl = cfg->options->cacheStaleTtl;
+        optionsCache.jitter = cfg->options->cacheTtlJitter;
+        __atomic_store_n(&optionsShadow.sample, (unsigned int) (cfg->options->shadowSample * OPTIONS_SHADOW_SCALE + 0.5),
+                         __ATOMIC_RELAXED);
+        /** Read by call threads without lock **/
+        __atomic_store_n(&optionsLimits.userCps, cfg->options->userCps, __ATOMIC_RELAXED);
+        __atomic_store_n(&optionsLimits.userCalls, cfg->options->userCalls, __ATOMIC_RELAXED);
+        __atomic_store_n(&optionsLimits.tenantCps, cfg->options->tenantCps, __ATOMIC_RELAXED);
+        __atomic_store_n(&optionsLimits.tenantCalls, cfg->options->tenantCalls, __ATOMIC_RELAXED);
+        /** Keys seen before the reload no longer hold slots they don't use **/
+        options_limit_table_reset(&optionsLimits.users);
+        options_limit_table_reset(&optionsLimits.tenants);
+        optionsTenants.partition = cfg->options->cachePartition;
+        optionsTenants.maxMemory = cfg->options->cacheMaxMemory * 1024 * 1024;
+        options_tenant_enforce(-1);
+    }
+    if (cfg && cfg->dbCredentials) {
+        options_admission_configure(cfg->dbCredentials->maxInflight, cfg->dbCredentials->maxQueueWait,
+                                    cfg->dbCredentials->shedVerdict);
+        options_storage_configure(cfg->dbCredentials);
+        options_slow_log_configure(cfg->dbCredentials->slowQueryThreshold, cfg->dbCredentials->slowQuerySample,
+                                   cfg->dbCredentials->slowQueryLogSize);
+        optionsFlights.enabled = cfg->dbCredentials->coalesceQueries;
+    }
+    /** New replicas are unknown until checked , do not wait for the next period **/
+    ast_mutex_lock(&optionsHealth.lock);
+    if (optionsHealth.thread != AST_PTHREADT_NULL) {
+        ast_cond_signal(&optionsHealth.cond);
+    }
+    ast_mutex_unlock(&optionsHealth.lock);
+}
 
-    return 0;
+/*! \brief Hash prefix sets on their integer key (TenantID or GroupID) */
+static int options_cache_hash_fn(const void *obj, int flags) {
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            return *(const int *) obj;
+        case OBJ_SEARCH_OBJECT:
+            return ((const struct options_prefix_set *) obj)->id;
+        default:
+            ast_assert(0);
+            return 0;
+    }
+}
+
+/*! \brief Compare prefix sets on their integer key */
+static int options_cache_cmp_fn(void *obj, void *arg, int flags) {
+    int left = ((struct options_prefix_set *) obj)->id;
+    int right = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_OBJECT ? ((struct options_prefix_set *) arg)->id : *(int *) arg;
+    return left == right ? CMP_MATCH : 0;
 }
 
+/*! \brief Hash interned strings */
+static int options_intern_hash_fn(const void *obj, int flags) {
+    return ast_str_hash(obj);
+}
 
-/*! \internal \brief reload handler
- * \retval AST_MODULE_LOAD_SUCCESS on success
- * \retval AST_MODULE_LOAD_DECLINE on failure
+/*! \brief Compare interned strings */
+static int options_intern_cmp_fn(void *obj, void *arg, int flags) {
+    return strcmp(obj, arg) ? 0 : CMP_MATCH;
+}
+
+/*! \brief Get the shared copy of a string , every cache entry holding the same prefix or did points to it
+ * @return a reference to release with options_intern_release , NULL on memory error
  */
-static int reload_module(void) {
-    ast_unregister_application(app);
-    if (aco_process_config(&cfg_info, 1) || ast_register_application_xml(app, app_exec)) {
-        ast_log(LOG_WARNING, "Error While reloading application %s\n", app);
-        return AST_MODULE_LOAD_DECLINE;
+static const char *options_intern(const char *str) {
+    char *interned;
+
+    str = S_OR(str, "");
+    if ((interned = ao2_find(optionsCache.strings, str, OBJ_SEARCH_KEY))) {
+        return interned;
     }
-    return AST_MODULE_LOAD_SUCCESS;
+    ao2_wrlock(optionsCache.strings);
+    if (!(interned = ao2_find(optionsCache.strings, str, OBJ_SEARCH_KEY | OBJ_NOLOCK))) {
+        if ((interned = ao2_alloc_options(strlen(str) + 1, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+            strcpy(interned, str);
+            ao2_link_flags(optionsCache.strings, interned, OBJ_NOLOCK);
+        }
+    }
+    ao2_unlock(optionsCache.strings);
+    return interned;
 }
 
-/*! \internal \brief unload handler */
-static int unload_module(void) {
-    ast_unregister_application(app);
-    aco_info_destroy(&cfg_info);
-    return 0;
+/*! \brief Release a string obtained from options_intern */
+static void options_intern_release(const char *str) {
+    ao2_cleanup((void *) str);
 }
 
-/*! \internal \brief load handler
- * \retval AST_MODULE_LOAD_SUCCESS on success
- * \retval AST_MODULE_LOAD_DECLINE on failure
+/*! \brief ao2 callback matching interned strings only referenced by the pool */
+static int options_intern_unused_cb(void *obj, void *arg, int flags) {
+    return ao2_ref(obj, 0) == 1 ? CMP_MATCH : 0;
+}
+
+/*! \brief Forget interned strings no cache entry uses anymore */
+static void options_intern_sweep(void) {
+    ao2_callback(optionsCache.strings, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE, options_intern_unused_cb, NULL);
+}
+
+/*! \brief Stripe and slot an UserID hashes to */
+static unsigned int options_account_hash(int userId) {
+    return (unsigned int) userId * 2654435761u;
+}
+
+/*! \brief Allocate an empty slot array , aligned on a cache line */
+static int options_account_stripe_alloc(struct options_account_stripe *stripe, unsigned int size) {
+    unsigned int i;
+    char *mem;
+
+    if (!(mem = ast_calloc(1, size * sizeof(struct options_account) + OPTIONS_CACHE_LINE))) {
+        return -1;
+    }
+    stripe->mem = mem;
+    stripe->slots = (struct options_account *) (((uintptr_t) mem + OPTIONS_CACHE_LINE - 1) &
+                                                ~((uintptr_t) OPTIONS_CACHE_LINE - 1));
+    stripe->size = size;
+    stripe->used = 0;
+    stripe->count = 0;
+    for (i = 0; i < size; i++) {
+        stripe->slots[i].userId = OPTIONS_SLOT_FREE;
+    }
+    return 0;
+}
+
+/*! \brief Allocate an account table */
+static struct options_account_table *options_account_table_alloc(void) {
+    struct options_account_table *table;
+    char *mem;
+    int i;
+
+    if (!(mem = ast_calloc(1, sizeof(*table) + OPTIONS_CACHE_LINE))) {
+        return NULL;
+    }
+    table = (struct options_account_table *) (((uintptr_t) mem + OPTIONS_CACHE_LINE - 1) &
+                                              ~((uintptr_t) OPTIONS_CACHE_LINE - 1));
+    table->mem = mem;
+    /** Every lock is initialized before a failure can free the table **/
+    for (i = 0; i < OPTIONS_ACCOUNT_STRIPES; i++) {
+        ast_rwlock_init(&table->stripes[i].lock);
+    }
+    for (i = 0; i < OPTIONS_ACCOUNT_STRIPES; i++) {
+        if (options_account_stripe_alloc(&table->stripes[i], 16)) {
+            options_account_table_free(table);
+            return NULL;
+        }
+    }
+    return table;
+}
+
+/*! \brief Free an account table and release every account it holds */
+static void options_account_table_free(struct options_account_table *table) {
+    unsigned int i, j;
+
+    if (!table) {
+        return;
+    }
+    for (i = 0; i < OPTIONS_ACCOUNT_STRIPES; i++) {
+        struct options_account_stripe *stripe = &table->stripes[i];
+        for (j = 0; stripe->slots && j < stripe->size; j++) {
+            if (stripe->slots[j].userId >= 0) {
+                ao2_cleanup(stripe->slots[j].extra);
+            }
+        }
+        ast_free(stripe->mem);
+        ast_rwlock_destroy(&stripe->lock);
+    }
+    ast_free(table->mem);
+}
+
+/*! \brief Find the slot of an UserID , stripe must be locked
+ * @return NULL if not in the table
+ */
+static struct options_account *options_account_stripe_find(struct options_account_stripe *stripe, int userId,
+                                                           unsigned int hash) {
+    unsigned int mask = stripe->size - 1;
+    unsigned int i = hash & mask;
+    unsigned int probes;
+
+    for (probes = 0; probes < stripe->size; probes++, i = (i + 1) & mask) {
+        if (stripe->slots[i].userId == userId) {
+            return &stripe->slots[i];
+        }
+        if (stripe->slots[i].userId == OPTIONS_SLOT_FREE) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*! \brief Copy an account out of the table
+ * @param withExtra also take a reference on groups , blocked prefixes and dids
+ * @return 0 if a fresh entry , or an expired one still within cache_stale_ttl , was found , -1 otherwise
+ */
+static int options_account_table_get(struct options_account_table *table, int userId, struct options_account *account,
+                                     int withExtra) {
+    unsigned int hash = options_account_hash(userId);
+    struct options_account_stripe *stripe = &table->stripes[hash >> OPTIONS_ACCOUNT_STRIPE_SHIFT];
+    struct options_account *slot;
+    int res = -1;
+
+    ast_rwlock_rdlock(&stripe->lock);
+    if ((slot = options_account_stripe_find(stripe, userId, hash)) && options_cache_usable(slot->expires, time(NULL))) {
+        *account = *slot;
+        account->extra = withExtra ? ao2_bump(slot->extra) : NULL;
+        res = 0;
+    }
+    ast_rwlock_unlock(&stripe->lock);
+    return res;
+}
+
+/*! \brief Take the background refresh of an account , so only one call queues it
+ * @param refresh refresh date of the copy the caller got
+ * @return 0 if the caller has to queue the refresh , -1 if another call already did
+ */
+static int options_account_table_claim(struct options_account_table *table, int userId, time_t refresh) {
+    unsigned int hash = options_account_hash(userId);
+    struct options_account_stripe *stripe = &table->stripes[hash >> OPTIONS_ACCOUNT_STRIPE_SHIFT];
+    struct options_account *slot;
+    int res = -1;
+
+    ast_rwlock_wrlock(&stripe->lock);
+    if ((slot = options_account_stripe_find(stripe, userId, hash)) && slot->refresh == refresh) {
+        /** Past this date the entry is not served anymore , so it is never claimed twice **/
+        slot->refresh = slot->expires + optionsCache.staleTtl;
+        res = 0;
+    }
+    ast_rwlock_unlock(&stripe->lock);
+    return res;
+}
+
+/*! \brief Grow or compact a stripe once live and deleted slots fill 3/4 of it , stripe must be write locked */
+static void options_account_stripe_rehash(struct options_account_stripe *stripe) {
+    struct options_account_stripe fresh;
+    unsigned int size = stripe->count * 2 >= stripe->size ? stripe->size * 2 : stripe->size;
+    unsigned int i;
+
+    if (options_account_stripe_alloc(&fresh, size)) {
+        return;
+    }
+    for (i = 0; i < stripe->size; i++) {
+        struct options_account *slot = &stripe->slots[i];
+        unsigned int j;
+        if (slot->userId < 0) {
+            continue;
+        }
+        for (j = options_account_hash(slot->userId) & (size - 1); fresh.slots[j].userId != OPTIONS_SLOT_FREE;
+             j = (j + 1) & (size - 1));
+        fresh.slots[j] = *slot;
+        fresh.used++;
+        fresh.count++;
+    }
+    ast_free(stripe->mem);
+    stripe->mem = fresh.mem;
+    stripe->slots = fresh.slots;
+    stripe->size = fresh.size;
+    stripe->used = fresh.used;
+    stripe->count = fresh.count;
+}
+
+/*! \brief Store a copy of an account in the table , replacing any previous entry for this UserID
+ * The table takes its own reference on account->extra
+ * @param generation cache generation the account was read at : it is not stored in the cache if an invalidation
+ * happened since , checked under the stripe lock the invalidation removes entries with
+ */
+static void options_account_table_put(struct options_account_table *table, const struct options_account *account,
+                                      int generation) {
+    unsigned int hash = options_account_hash(account->userId);
+    struct options_account_stripe *stripe = &table->stripes[hash >> OPTIONS_ACCOUNT_STRIPE_SHIFT];
+    struct options_account *slot;
+    unsigned int mask;
+    unsigned int i;
+
+    ast_rwlock_wrlock(&stripe->lock);
+    if (table == optionsCache.accounts && generation != optionsCache.generation) {
+        ast_rwlock_unlock(&stripe->lock);
+        return;
+    }
+    if ((slot = options_account_stripe_find(stripe, account->userId, hash))) {
+        if (table == optionsCache.accounts) {
+            options_tenant_charge(slot->tenantId, -options_account_memory(slot), -1);
+        }
+        ao2_cleanup(slot->extra);
+    } else {
+        if ((stripe->used + 1) * 4 > stripe->size * 3) {
+            options_account_stripe_rehash(stripe);
+        }
+        mask = stripe->size - 1;
+        for (i = hash & mask; stripe->slots[i].userId >= 0; i = (i + 1) & mask);
+        slot = &stripe->slots[i];
+        if (slot->userId == OPTIONS_SLOT_FREE) {
+            stripe->used++;
+        }
+        stripe->count++;
+    }
+    *slot = *account;
+    slot->extra = ao2_bump(account->extra);
+    /** Memory of cached accounts is accounted to the partition of their tenant **/
+    if (table == optionsCache.accounts) {
+        options_tenant_charge(slot->tenantId, options_account_memory(slot), 1);
+    }
+    ast_rwlock_unlock(&stripe->lock);
+}
+
+/*! \brief Remove accounts from the table
+ * @param match NULL to remove everything
+ * @param ids if not NULL , receives an allocated array of removed UserIDs
+ * @return number of accounts removed
+ */
+static int options_account_table_remove(struct options_account_table *table, options_account_match_fn match, void *arg,
+                                        int **ids) {
+    int removed = 0;
+    int allocated = 0;
+    unsigned int i, j;
+
+    if (ids) {
+        *ids = NULL;
+    }
+    for (i = 0; i < OPTIONS_ACCOUNT_STRIPES; i++) {
+        struct options_account_stripe *stripe = &table->stripes[i];
+        ast_rwlock_wrlock(&stripe->lock);
+        for (j = 0; j < stripe->size; j++) {
+            struct options_account *slot = &stripe->slots[j];
+            if (slot->userId < 0 || (match && !match(slot, arg))) {
+                continue;
+            }
+            if (ids) {
+                if (removed == allocated) {
+                    int *grown = ast_realloc(*ids, (allocated = allocated * 2 + 16) * sizeof(**ids));
+                    if (!grown) {
+                        ast_rwlock_unlock(&stripe->lock);
+                        return removed;
+                    }
+                    *ids = grown;
+                }
+                (*ids)[removed] = slot->userId;
+            }
+            if (table == optionsCache.accounts) {
+                options_tenant_charge(slot->tenantId, -options_account_memory(slot), -1);
+            }
+            ao2_cleanup(slot->extra);
+            slot->extra = NULL;
+            slot->userId = OPTIONS_SLOT_DELETED;
+            stripe->count--;
+            removed++;
+        }
+        ast_rwlock_unlock(&stripe->lock);
+    }
+    return removed;
+}
+
+/*! \brief Number of accounts in the table */
+static int options_account_table_count(struct options_account_table *table) {
+    int count = 0;
+    int i;
+
+    for (i = 0; i < OPTIONS_ACCOUNT_STRIPES; i++) {
+        ast_rwlock_rdlock(&table->stripes[i].lock);
+        count += table->stripes[i].count;
+        ast_rwlock_unlock(&table->stripes[i].lock);
+    }
+    return count;
+}
+
+/*! \brief Allocate cache containers */
+static int options_cache_init(void) {
+    optionsCache.accounts = options_account_table_alloc();
+    optionsCache.strings = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, AO2_CONTAINER_ALLOC_OPT_DUPS_REJECT,
+                                                    1021, options_intern_hash_fn, NULL, options_intern_cmp_fn);
+    optionsCache.prefixIn = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, AO2_CONTAINER_ALLOC_OPT_DUPS_REPLACE,
+                                                     17, options_cache_hash_fn, NULL, options_cache_cmp_fn);
+    optionsCache.groupPrefixes = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK,
+                                                          AO2_CONTAINER_ALLOC_OPT_DUPS_REPLACE, 257,
+                                                          options_cache_hash_fn, NULL, options_cache_cmp_fn);
+    optionsTenants.partitions = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK,
+                                                         AO2_CONTAINER_ALLOC_OPT_DUPS_REJECT, 127,
+                                                         options_cache_hash_fn, NULL, options_cache_cmp_fn);
+    ast_cond_init(&optionsTenants.cond, NULL);
+    if (!optionsCache.accounts || !optionsCache.strings || !optionsCache.prefixIn || !optionsCache.groupPrefixes
+        || !optionsTenants.partitions) {
+        ast_log(LOG_WARNING, "Memory Error , Allocation of cache containers failed!\n");
+        options_cache_destroy();
+        return -1;
+    }
+    return 0;
+}
+
+/*! \brief Release cache containers and everything they hold */
+static void options_cache_destroy(void) {
+    options_account_table_free(optionsCache.accounts);
+    optionsCache.accounts = NULL;
+    ao2_cleanup(optionsTenants.partitions);
+    optionsTenants.partitions = NULL;
+    optionsTenants.memory = 0;
+    ast_cond_destroy(&optionsTenants.cond);
+    ao2_cleanup(optionsCache.prefixIn);
+    optionsCache.prefixIn = NULL;
+    ao2_cleanup(optionsCache.groupPrefixes);
+    optionsCache.groupPrefixes = NULL;
+    ao2_cleanup(optionsCache.strings);
+    optionsCache.strings = NULL;
+}
+
+/*! \brief Expiry and refresh dates of an entry loaded now
+ * Lifetimes are spread by cache_ttl_jitter percent so entries loaded together do not expire together.
+ * With cache_ttl 0 , entries read from SQLite live until the next sync drops them.
+ */
+static void options_cache_lifetime(time_t *expires, time_t *refresh) {
+    time_t now = time(NULL);
+    unsigned int ttl = optionsCache.ttl;
+
+    if (!ttl && options_storage_backend() != &options_mysql_backend) {
+        ttl = OPTIONS_STORAGE_CACHE_TTL;
+    }
+    unsigned int spread = (uint64_t) ttl * optionsCache.jitter / 100;
+
+    if (spread) {
+        ttl = ttl - spread + ast_random() % (2 * spread + 1);
+    }
+    *expires = now + ttl;
+    *refresh = optionsCache.refreshAhead ? now + (uint64_t) ttl * optionsCache.refreshAhead / 100 : *expires;
+}
+
+/*! \brief Whether an entry expiring at expires may still be served , fresh or within cache_stale_ttl */
+static int options_cache_usable(time_t expires, time_t now) {
+    return expires > now || (optionsCache.ttl && expires + (time_t) optionsCache.staleTtl > now);
+}
+
+/*! \brief Link a freshly loaded entry unless the cache has been invalidated while it was loading */
+static void options_cache_link(struct ao2_container *container, void *obj, int generation) {
+    ao2_wrlock(container);
+    if (generation == optionsCache.generation) {
+        ao2_link_flags(container, obj, OBJ_NOLOCK);
+    }
+    ao2_unlock(container);
+}
+
+/*! \brief Return a cached prefix set if it is still fresh , or expired within cache_stale_ttl
+ * A set used past its refresh date is reloaded in background by the first call that sees it
+ */
+static struct options_prefix_set *options_cache_find(struct ao2_container *container, int key) {
+    struct options_prefix_set *set = ao2_find(container, &key, OBJ_SEARCH_KEY);
+    time_t now = time(NULL);
+    int claimed = 0;
+
+    if (!set) {
+        ast_atomic_fetchadd_int(&optionsCache.misses, 1);
+        return NULL;
+    }
+    if (!options_cache_usable(set->expires, now)) {
+        ast_atomic_fetchadd_int(&optionsCache.misses, 1);
+        ao2_ref(set, -1);
+        return NULL;
+    }
+    ast_atomic_fetchadd_int(&optionsCache.hits, 1);
+    if (set->expires <= now) {
+        ast_atomic_fetchadd_int(&optionsCache.staleHits, 1);
+    }
+    if (set->refresh <= now) {
+        ao2_wrlock(container);
+        if (set->refresh <= now) {
+            set->refresh = set->expires + optionsCache.staleTtl;
+            claimed = 1;
+        }
+        ao2_unlock(container);
+    }
+    if (claimed) {
+        options_refresh_queue(container == optionsCache.prefixIn ? OPTIONS_CACHE_PREFIX_IN
+                                                                 : OPTIONS_CACHE_GROUP_PREFIXES, key);
+    }
+    return set;
+}
+
+/*! \brief Release interned strings of prefix rules */
+static void options_prefix_rules_release(struct options_prefix_rule *rules, int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        options_intern_release(rules[i].prefix);
+        options_intern_release(rules[i].newPrefix);
+    }
+}
+
+/*! \brief free an options_account_extra structure */
+static void options_account_extra_destructor(void *obj) {
+    struct options_account_extra *extra = obj;
+    int i;
+
+    ast_free(extra->groups);
+    if (extra->blocked) {
+        options_prefix_rules_release(extra->blocked, extra->nbBlocked);
+        ast_free(extra->blocked);
+    }
+    for (i = 0; i < extra->nbDids; i++) {
+        options_intern_release(extra->dids[i]);
+    }
+    ast_free(extra->dids);
+}
+
+/*! \brief Load every per-account table for one UserID from the storage backend
+ * @return 0 on success , -1 on database error
+ */
+static int options_account_load(int userId, struct options_account *account, struct database_configuration *dbInfo) {
+    const struct options_backend *backend = options_storage_backend();
+
+    memset(account, 0, sizeof(*account));
+    if (!(account->extra = ao2_alloc_options(sizeof(*account->extra), options_account_extra_destructor,
+                                             AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+        ast_log(LOG_WARNING, "Memory Error , Allocation of cached account failed!\n");
+        return -1;
+    }
+    account->userId = userId;
+    if (backend->account_options(userId, account, dbInfo)
+        || backend->group_membership(userId, account, dbInfo)
+        || backend->blocked_prefixes(userId, account, dbInfo)
+        || backend->dids(userId, account, dbInfo)) {
+        ao2_cleanup(account->extra);
+        account->extra = NULL;
+        return -1;
+    }
+    options_cache_lifetime(&account->expires, &account->refresh);
+    return 0;
+}
+
+/*! \brief Get cached data of an account , loading it from database when missing or expired
+ * @param withExtra also fill account->extra (groups , blocked prefixes , dids) , to release with ao2_cleanup
+ * @return 0 on success , -1 if accountCode is not a UserID or on database error
+ */
+static int options_cache_account(const char *accountCode, struct database_configuration *dbInfo,
+                                 struct options_account *account, int withExtra) {
+    int generation = optionsCache.generation;
+    struct options_call_state *state;
+    int userId;
+
+    account->extra = NULL;
+    if (is_string_digits(accountCode) || strlen(accountCode) > 9) {
+        return -1;
+    }
+    userId = atoi(accountCode);
+    if (!options_account_table_get(optionsCache.accounts, userId, account, withExtra)) {
+        time_t now = time(NULL);
+        ast_atomic_fetchadd_int(&optionsCache.hits, 1);
+        if (account->expires <= now) {
+            ast_atomic_fetchadd_int(&optionsCache.staleHits, 1);
+        }
+        /** Hot accounts are reloaded before they expire , off the call path **/
+        if (account->refresh <= now && !options_account_table_claim(optionsCache.accounts, userId, account->refresh)) {
+            options_refresh_queue(OPTIONS_CACHE_ACCOUNTS, userId);
+        }
+        options_tenant_touch(account->tenantId);
+        return 0;
+    }
+    ast_atomic_fetchadd_int(&optionsCache.misses, 1);
+    if (optionsTenants.partition != OPTIONS_PARTITION_TENANT
+        || options_tenant_account(userId, dbInfo, account, withExtra)) {
+        if (options_account_load(userId, account, dbInfo)) {
+            return -1;
+        }
+        /** Don't store data read before an invalidation **/
+        options_account_table_put(optionsCache.accounts, account, generation);
+        options_tenant_touch(account->tenantId);
+        options_tenant_enforce(account->tenantId);
+        if (!withExtra) {
+            ao2_cleanup(account->extra);
+            account->extra = NULL;
+        }
+    }
+    /** Next queries of this call are queued with its tenant **/
+    if (account->found && (state = options_call_state_get()) && state->active && !state->tenantId) {
+        state->tenantId = account->tenantId;
+    }
+    return 0;
+}
+
+/*! \brief Estimate of the memory a cached account holds , interned strings included */
+static int options_account_memory(const struct options_account *account) {
+    const struct options_account_extra *extra = account->extra;
+    int memory = sizeof(*account);
+    int i;
+
+    if (!extra) {
+        return memory;
+    }
+    memory += sizeof(*extra) + extra->nbGroups * sizeof(*extra->groups) + extra->nbBlocked * sizeof(*extra->blocked)
+              + extra->nbDids * sizeof(*extra->dids);
+    for (i = 0; i < extra->nbBlocked; i++) {
+        memory += strlen(extra->blocked[i].prefix) + 1;
+    }
+    for (i = 0; i < extra->nbDids; i++) {
+        memory += strlen(extra->dids[i]) + 1;
+    }
+    return memory;
+}
+
+/*! \brief Find the partition of a tenant
+ * @param create allocate it when missing
+ * @return a reference to release with ao2_ref , NULL if missing
+ */
+static struct options_tenant *options_tenant_get(int tenantId, int create) {
+    struct options_tenant *tenant;
+
+    if (!optionsTenants.partitions) {
+        return NULL;
+    }
+    if ((tenant = ao2_find(optionsTenants.partitions, &tenantId, OBJ_SEARCH_KEY)) || !create) {
+        return tenant;
+    }
+    ao2_wrlock(optionsTenants.partitions);
+    if (!(tenant = ao2_find(optionsTenants.partitions, &tenantId, OBJ_SEARCH_KEY | OBJ_NOLOCK))
+        && (tenant = ao2_alloc_options(sizeof(*tenant), NULL, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+        tenant->id = tenantId;
+        ao2_link_flags(optionsTenants.partitions, tenant, OBJ_NOLOCK);
+    }
+    ao2_unlock(optionsTenants.partitions);
+    return tenant;
+}
+
+/*! \brief Account for accounts entering (positive) or leaving (negative) the cache
+ * Called with the stripe of the account locked : only takes the partitions container lock
+ */
+static void options_tenant_charge(int tenantId, int memory, int accounts) {
+    struct options_tenant *tenant;
+
+    ast_atomic_fetchadd_int(&optionsTenants.memory, memory);
+    if ((tenant = options_tenant_get(tenantId, accounts > 0))) {
+        ast_atomic_fetchadd_int(&tenant->memory, memory);
+        ast_atomic_fetchadd_int(&tenant->accounts, accounts);
+        ao2_ref(tenant, -1);
+    }
+}
+
+/*! \brief Remember a tenant has just been looked up
+ * Dates are kept by hash of TenantID , outside partitions , so cache hits don't take any lock
+ */
+static void options_tenant_touch(int tenantId) {
+    unsigned int clock = options_account_hash(tenantId) >> OPTIONS_TENANT_CLOCK_SHIFT;
+    time_t now = time(NULL);
+
+    if (optionsTenants.lastUsed[clock] != now) {
+        optionsTenants.lastUsed[clock] = now;
+    }
+}
+
+/*! \brief Date of the last lookup of a tenant , or of a tenant sharing its hash */
+static time_t options_tenant_last_used(int tenantId) {
+    return optionsTenants.lastUsed[options_account_hash(tenantId) >> OPTIONS_TENANT_CLOCK_SHIFT];
+}
+
+/*! \brief Add one row of a tenant load to the batch of accounts being built
+ * @param part enum options_tenant_part the row comes from , row[0] is its UserID
+ * @return 0 on success , -1 on memory error
+ */
+static int options_tenant_row(struct options_account_table *batch, int tenantId, int part, const char **row) {
+    int userId = atoi(S_OR(row[0], "0"));
+    unsigned int hash = options_account_hash(userId);
+    struct options_account *account;
+    struct options_account_extra *extra;
+    void *grown;
+    int j;
+
+    if (userId <= 0) {
+        return 0;
+    }
+    if (part == OPTIONS_TENANT_USERS) {
+        struct options_account fresh;
+        memset(&fresh, 0, sizeof(fresh));
+        if (!(fresh.extra = ao2_alloc_options(sizeof(*fresh.extra), options_account_extra_destructor,
+                                              AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+            ast_log(LOG_WARNING, "Memory Error , Allocation of cached account failed!\n");
+            return -1;
+        }
+        fresh.userId = userId;
+        fresh.tenantId = tenantId;
+        fresh.found = 1;
+        fresh.hasOptions = row[1] != NULL;
+        fresh.cidIsAcode = atoi(S_OR(row[2], "0"));
+        fresh.monitored = atoi(S_OR(row[3], "0"));
+        fresh.rcli = atoi(S_OR(row[4], "0"));
+        options_account_table_put(batch, &fresh, optionsCache.generation);
+        ao2_ref(fresh.extra, -1);
+        return 0;
+    }
+    /** Rows of accounts created after the users query are ignored **/
+    if (!(account = options_account_stripe_find(&batch->stripes[hash >> OPTIONS_ACCOUNT_STRIPE_SHIFT], userId, hash))) {
+        return 0;
+    }
+    extra = account->extra;
+    switch (part) {
+        case OPTIONS_TENANT_GROUPS:
+            account->groupCount++;
+            for (j = 0; j < extra->nbGroups && extra->groups[j] != atoi(S_OR(row[1], "0")); j++);
+            if (j < extra->nbGroups) {
+                break;
+            }
+            if (!(grown = ast_realloc(extra->groups, (extra->nbGroups + 1) * sizeof(*extra->groups)))) {
+                return -1;
+            }
+            extra->groups = grown;
+            extra->groups[extra->nbGroups++] = atoi(S_OR(row[1], "0"));
+            break;
+        case OPTIONS_TENANT_MONITORED:
+            account->groupMonitored = atoi(S_OR(row[1], "0"));
+            break;
+        case OPTIONS_TENANT_BLOCKED:
+            /** An empty prefix blocks every number , as LIKE CONCAT('','%') matches all **/
+            if (!row[1]) {
+                break;
+            }
+            if (!(grown = ast_realloc(extra->blocked, (extra->nbBlocked + 1) * sizeof(*extra->blocked)))) {
+                return -1;
+            }
+            extra->blocked = grown;
+            if (options_prefix_rule_init(&extra->blocked[extra->nbBlocked], row[1], 0, NULL)) {
+                return -1;
+            }
+            extra->nbBlocked++;
+            break;
+        case OPTIONS_TENANT_DIDS:
+            if (!row[1]) {
+                break;
+            }
+            if (!(grown = ast_realloc(extra->dids, (extra->nbDids + 1) * sizeof(*extra->dids)))) {
+                return -1;
+            }
+            extra->dids = grown;
+            if (!(extra->dids[extra->nbDids] = options_intern(row[1]))) {
+                return -1;
+            }
+            extra->nbDids++;
+            break;
+    }
+    return 0;
+}
+
+/*! \brief Read every account of a tenant from the storage backend and store them in the cache
+ * Normalization rules of the tenant are loaded along
+ * @return number of accounts stored , -1 on database error or if the cache was invalidated meanwhile
+ */
+static int options_tenant_fetch(int tenantId, struct database_configuration *dbInfo) {
+    int generation = optionsCache.generation;
+    struct options_account_table *batch;
+    struct options_prefix_set *set;
+    int loaded = 0;
+    unsigned int i, j;
+
+    if (!(batch = options_account_table_alloc())) {
+        return -1;
+    }
+    if (options_storage_backend()->tenant_accounts(tenantId, batch, dbInfo)) {
+        options_account_table_free(batch);
+        return -1;
+    }
+    for (i = 0; i < OPTIONS_ACCOUNT_STRIPES && generation == optionsCache.generation; i++) {
+        struct options_account_stripe *stripe = &batch->stripes[i];
+        for (j = 0; j < stripe->size; j++) {
+            if (stripe->slots[j].userId < 0) {
+                continue;
+            }
+            options_cache_lifetime(&stripe->slots[j].expires, &stripe->slots[j].refresh);
+            options_account_table_put(optionsCache.accounts, &stripe->slots[j], generation);
+            loaded++;
+        }
+    }
+    options_account_table_free(batch);
+    if ((set = options_cache_prefix_in(tenantId, dbInfo))) {
+        ao2_ref(set, -1);
+    }
+    return generation == optionsCache.generation ? loaded : -1;
+}
+
+/*! \brief Load every account of a tenant unless it is already loaded
+ * Only one call loads a tenant , the others arriving meanwhile wait for it to end
+ * @return 0 when the tenant is loaded , -1 on error
+ */
+static int options_tenant_load(int tenantId, struct database_configuration *dbInfo) {
+    struct options_tenant *tenant;
+    uint64_t start;
+    int64_t loadTime;
+    time_t refresh;
+    int res;
+
+    if (!(tenant = options_tenant_get(tenantId, 1))) {
+        return -1;
+    }
+    ast_mutex_lock(&optionsTenants.lock);
+    /** Accounts loaded during an eviction of the tenant would be dropped along **/
+    while (tenant->state == OPTIONS_TENANT_EVICTING) {
+        ast_cond_wait(&optionsTenants.cond, &optionsTenants.lock);
+    }
+    if (tenant->state == OPTIONS_TENANT_LOADING) {
+        tenant->waits++;
+        while (tenant->state == OPTIONS_TENANT_LOADING) {
+            ast_cond_wait(&optionsTenants.cond, &optionsTenants.lock);
+        }
+        res = tenant->state == OPTIONS_TENANT_LOADED ? 0 : -1;
+        ast_mutex_unlock(&optionsTenants.lock);
+        ao2_ref(tenant, -1);
+        return res;
+    }
+    if (tenant->state == OPTIONS_TENANT_LOADED && tenant->expires > time(NULL)) {
+        ast_mutex_unlock(&optionsTenants.lock);
+        ao2_ref(tenant, -1);
+        return 0;
+    }
+    tenant->state = OPTIONS_TENANT_LOADING;
+    ast_mutex_unlock(&optionsTenants.lock);
+
+    start = options_monotonic_us();
+    res = options_tenant_fetch(tenantId, dbInfo);
+    loadTime = (options_monotonic_us() - start) / 1000;
+
+    ast_mutex_lock(&optionsTenants.lock);
+    tenant->state = res < 0 ? OPTIONS_TENANT_PARTIAL : OPTIONS_TENANT_LOADED;
+    options_cache_lifetime(&tenant->expires, &refresh);
+    tenant->loads++;
+    tenant->loadTime = loadTime;
+    tenant->maxLoadTime = MAX(tenant->maxLoadTime, loadTime);
+    ast_cond_broadcast(&optionsTenants.cond);
+    ast_mutex_unlock(&optionsTenants.lock);
+    ao2_ref(tenant, -1);
+
+    ast_log(LOG_DEBUG, "Tenant %d : %d accounts loaded in %ld ms\n", tenantId, res, (long) loadTime);
+    options_tenant_enforce(tenantId);
+    return res < 0 ? -1 : 0;
+}
+
+/*! \brief Load the partition of the tenant of an account , then read the account from cache
+ * The tenant is the one of the call when known , otherwise it is read from the users table
+ * @return 0 if the account is now cached , -1 if it has to be loaded alone
+ */
+static int options_tenant_account(int userId, struct database_configuration *dbInfo, struct options_account *account,
+                                  int withExtra) {
+    struct options_call_state *state = options_call_state_get();
+    int tenantId = state && state->active ? state->tenantId : 0;
+
+    if (!tenantId) {
+        struct options_account probe;
+        memset(&probe, 0, sizeof(probe));
+        if (options_storage_backend()->account_options(userId, &probe, dbInfo) || !probe.found) {
+            return -1;
+        }
+        tenantId = probe.tenantId;
+    }
+    options_tenant_touch(tenantId);
+    if (options_tenant_load(tenantId, dbInfo)) {
+        return -1;
+    }
+    return options_account_table_get(optionsCache.accounts, userId, account, withExtra);
+}
+
+/*! \brief Forget a tenant (every tenant if -1) has been loaded , its accounts are loaded again on next miss */
+static int options_tenant_reset_cb(void *obj, void *arg, int flags) {
+    struct options_tenant *tenant = obj;
+
+    if (tenant->state == OPTIONS_TENANT_LOADED && (*(int *) arg < 0 || tenant->id == *(int *) arg)) {
+        tenant->state = OPTIONS_TENANT_PARTIAL;
+    }
+    return 0;
+}
+
+/*! \brief Mark loaded partitions of a tenant (every tenant if -1) as partial after an invalidation */
+static void options_tenant_reset(int tenantId) {
+    ast_mutex_lock(&optionsTenants.lock);
+    ao2_callback(optionsTenants.partitions, OBJ_NODATA | OBJ_MULTIPLE, options_tenant_reset_cb, &tenantId);
+    ast_mutex_unlock(&optionsTenants.lock);
+}
+
+/*! \brief Keep the least recently used partition an eviction may drop */
+static int options_tenant_coldest_cb(void *obj, void *arg, int flags) {
+    struct options_tenant *tenant = obj;
+    struct options_tenant_victim *victim = arg;
+    time_t lastUsed = options_tenant_last_used(tenant->id);
+
+    if (tenant->id == victim->keep || !tenant->accounts || tenant->state == OPTIONS_TENANT_LOADING
+        || tenant->state == OPTIONS_TENANT_EVICTING || (victim->tenant && lastUsed >= victim->lastUsed)) {
+        return 0;
+    }
+    ao2_cleanup(victim->tenant);
+    victim->tenant = ao2_bump(tenant);
+    victim->lastUsed = lastUsed;
+    return 0;
+}
+
+/*! \brief Evict the least recently used partitions until cached accounts fit in cache_max_memory
+ * An evicted partition stays linked , empty , so accounts cached meanwhile are still charged to it
+ * @param keep TenantID just loaded , never evicted , -1 for none
+ */
+static void options_tenant_enforce(int keep) {
+    struct options_tenant_victim victim;
+    int evicted;
+
+    while (optionsTenants.maxMemory && optionsTenants.partitions && optionsTenants.memory > optionsTenants.maxMemory) {
+        memset(&victim, 0, sizeof(victim));
+        victim.keep = keep;
+        ao2_callback(optionsTenants.partitions, OBJ_NODATA | OBJ_MULTIPLE, options_tenant_coldest_cb, &victim);
+        if (!victim.tenant) {
+            break;
+        }
+        /** A load or another eviction may have started since the partition was picked **/
+        ast_mutex_lock(&optionsTenants.lock);
+        if (victim.tenant->state == OPTIONS_TENANT_LOADING || victim.tenant->state == OPTIONS_TENANT_EVICTING) {
+            ast_mutex_unlock(&optionsTenants.lock);
+            ao2_ref(victim.tenant, -1);
+            continue;
+        }
+        victim.tenant->state = OPTIONS_TENANT_EVICTING;
+        ast_mutex_unlock(&optionsTenants.lock);
+
+        evicted = options_account_table_remove(optionsCache.accounts, options_account_tenant_match, &victim.tenant->id,
+                                               NULL);
+        ao2_find(optionsCache.prefixIn, &victim.tenant->id, OBJ_SEARCH_KEY | OBJ_UNLINK | OBJ_NODATA);
+
+        ast_mutex_lock(&optionsTenants.lock);
+        victim.tenant->state = OPTIONS_TENANT_PARTIAL;
+        ast_cond_broadcast(&optionsTenants.cond);
+        ast_mutex_unlock(&optionsTenants.lock);
+        ast_atomic_fetchadd_int(&optionsTenants.evictions, 1);
+        ast_log(LOG_DEBUG, "Tenant %d evicted : %d accounts dropped , %d bytes cached\n", victim.tenant->id, evicted,
+                optionsTenants.memory);
+        ao2_ref(victim.tenant, -1);
+    }
+}
+
+/*! \brief free an options_prefix_set structure */
+static void options_prefix_set_destructor(void *obj) {
+    struct options_prefix_set *set = obj;
+    options_prefix_rules_release(set->rules, set->count);
+}
+
+/*! \brief Allocate an empty prefix set able to hold count rules */
+static struct options_prefix_set *options_prefix_set_alloc(int id, int count) {
+    struct options_prefix_set *set;
+
+    if (!(set = ao2_alloc_options(sizeof(*set) + count * sizeof(set->rules[0]), options_prefix_set_destructor,
+                                  AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+        ast_log(LOG_WARNING, "Memory Error , Allocation of cached prefixes failed!\n");
+        return NULL;
+    }
+    set->id = id;
+    return set;
+}
+
+/*! \brief Fill a prefix rule with interned strings
+ * @return 0 on success , -1 on memory error (rule left empty)
+ */
+static int options_prefix_rule_init(struct options_prefix_rule *rule, const char *prefix, int digitDelete,
+                                    const char *newPrefix) {
+    rule->prefix = options_intern(prefix);
+    rule->newPrefix = options_intern(S_OR(newPrefix, ""));
+    rule->digitDelete = digitDelete;
+    if (!rule->prefix || !rule->newPrefix) {
+        options_intern_release(rule->prefix);
+        options_intern_release(rule->newPrefix);
+        rule->prefix = rule->newPrefix = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*! \brief Append a rule to a prefix set , NULL or oversized prefixes are ignored
+ * An empty prefix is kept : it matches every number , any longer matching prefix wins over it
+ * @return 0 on success , -1 on memory error
+ */
+static int options_prefix_set_add(struct options_prefix_set *set, const char *prefix, int digitDelete,
+                                  const char *newPrefix) {
+    if (!prefix || strlen(prefix) > 25) {
+        return 0;
+    }
+    if (options_prefix_rule_init(&set->rules[set->count], prefix, digitDelete, newPrefix)) {
+        return -1;
+    }
+    set->count++;
+    return 0;
+}
+
+/*! \brief Get prefix_in rules of a tenant , loading them from storage when missing or expired */
+static struct options_prefix_set *options_cache_prefix_in(int tenantId, struct database_configuration *dbInfo) {
+    struct options_prefix_set *set;
+    int generation = optionsCache.generation;
+
+    if ((set = options_cache_find(optionsCache.prefixIn, tenantId))) {
+        return set;
+    }
+    if ((set = options_storage_backend()->normalization(tenantId, dbInfo))) {
+        options_cache_lifetime(&set->expires, &set->refresh);
+        options_cache_link(optionsCache.prefixIn, set, generation);
+    }
+    return set;
+}
+
+/*! \brief Get blocked_prefix_group rules of a group , loading them from storage when missing or expired */
+static struct options_prefix_set *options_cache_group_prefixes(int groupId, struct database_configuration *dbInfo) {
+    struct options_prefix_set *set;
+    int generation = optionsCache.generation;
+
+    if ((set = options_cache_find(optionsCache.groupPrefixes, groupId))) {
+        return set;
+    }
+    if ((set = options_storage_backend()->group_prefixes(groupId, dbInfo))) {
+        options_cache_lifetime(&set->expires, &set->refresh);
+        options_cache_link(optionsCache.groupPrefixes, set, generation);
+    }
+    return set;
+}
+
+/*! \brief Queue a background reload of a cached entry , dropped when the queue is full */
+static void options_refresh_queue(enum options_cache_kind kind, int id) {
+    struct options_refresh_job *job;
+
+    ast_mutex_lock(&optionsRefresh.lock);
+    if (optionsRefresh.thread == AST_PTHREADT_NULL || optionsRefresh.stop
+        || optionsRefresh.pending >= OPTIONS_REFRESH_QUEUE || !(job = ast_calloc(1, sizeof(*job)))) {
+        /** The entry is loaded again on the call path once it expires **/
+        optionsRefresh.dropped++;
+        ast_mutex_unlock(&optionsRefresh.lock);
+        return;
+    }
+    job->kind = kind;
+    job->id = id;
+    job->generation = optionsCache.generation;
+    AST_LIST_INSERT_TAIL(&optionsRefresh.jobs, job, list);
+    optionsRefresh.pending++;
+    optionsRefresh.queued++;
+    ast_cond_signal(&optionsRefresh.cond);
+    ast_mutex_unlock(&optionsRefresh.lock);
+}
+
+/*! \brief Reload a cached entry and replace it , unless the cache was invalidated meanwhile
+ * @return 0 on success , -1 on database error
+ */
+static int options_refresh_run(const struct options_refresh_job *job, struct database_configuration *dbInfo) {
+    int generation = optionsCache.generation;
+    struct options_account account;
+    struct options_prefix_set *set;
+    struct ao2_container *container;
+
+    /** Invalidated since queued : the entry is gone , the next call loads it **/
+    if (job->generation != generation) {
+        return 0;
+    }
+    if (job->kind == OPTIONS_CACHE_ACCOUNTS) {
+        if (options_account_load(job->id, &account, dbInfo)) {
+            return -1;
+        }
+        options_account_table_put(optionsCache.accounts, &account, generation);
+        ao2_cleanup(account.extra);
+        options_tenant_enforce(account.tenantId);
+        return 0;
+    }
+    if (job->kind == OPTIONS_CACHE_PREFIX_IN) {
+        container = optionsCache.prefixIn;
+        set = options_storage_backend()->normalization(job->id, dbInfo);
+    } else {
+        container = optionsCache.groupPrefixes;
+        set = options_storage_backend()->group_prefixes(job->id, dbInfo);
+    }
+    if (!set) {
+        return -1;
+    }
+    options_cache_lifetime(&set->expires, &set->refresh);
+    options_cache_link(container, set, generation);
+    ao2_ref(set, -1);
+    return 0;
+}
+
+/*! \brief Run queued background refreshes one at a time , and sweep unused interned strings every
+ * OPTIONS_INTERN_SWEEP_INTERVAL seconds
+ */
+static void *options_refresh_thread(void *data) {
+    struct options_refresh_job *job;
+    struct option_global *cfg;
+    struct timespec wakeup;
+    time_t sweep = time(NULL) + OPTIONS_INTERN_SWEEP_INTERVAL;
+    int res;
+
+    ast_mutex_lock(&optionsRefresh.lock);
+    while (!optionsRefresh.stop) {
+        if (time(NULL) >= sweep) {
+            /** Strings of replaced or evicted entries are otherwise kept until the next invalidation **/
+            ast_mutex_unlock(&optionsRefresh.lock);
+            options_intern_sweep();
+            sweep = time(NULL) + OPTIONS_INTERN_SWEEP_INTERVAL;
+            ast_mutex_lock(&optionsRefresh.lock);
+            continue;
+        }
+        if (!(job = AST_LIST_REMOVE_HEAD(&optionsRefresh.jobs, list))) {
+            wakeup.tv_sec = sweep;
+            wakeup.tv_nsec = 0;
+            ast_cond_timedwait(&optionsRefresh.cond, &optionsRefresh.lock, &wakeup);
+            continue;
+        }
+        optionsRefresh.pending--;
+        ast_mutex_unlock(&optionsRefresh.lock);
+        res = -1;
+        if ((cfg = ao2_global_obj_ref(options_globals))) {
+            if (cfg->dbCredentials) {
+                res = options_refresh_run(job, cfg->dbCredentials);
+            }
+            ao2_ref(cfg, -1);
+        }
+        if (res) {
+            ast_log(LOG_DEBUG, "Background refresh of %s %d failed , it is loaded again once expired\n",
+                    job->kind == OPTIONS_CACHE_ACCOUNTS ? "UserID" : job->kind == OPTIONS_CACHE_PREFIX_IN
+                                                                    ? "prefix_in of TenantID" : "GroupID", job->id);
+        }
+        ast_free(job);
+        ast_mutex_lock(&optionsRefresh.lock);
+        if (res) {
+            optionsRefresh.failed++;
+        } else {
+            optionsRefresh.refreshed++;
+        }
+    }
+    while ((job = AST_LIST_REMOVE_HEAD(&optionsRefresh.jobs, list))) {
+        ast_free(job);
+    }
+    optionsRefresh.pending = 0;
+    ast_mutex_unlock(&optionsRefresh.lock);
+    return NULL;
+}
+
+/*! \brief Start the background refresh job */
+static int options_refresh_start(void) {
+    ast_cond_init(&optionsRefresh.cond, NULL);
+    optionsRefresh.stop = 0;
+    if (ast_pthread_create_background(&optionsRefresh.thread, NULL, options_refresh_thread, NULL)) {
+        ast_log(LOG_ERROR, "Unable to start background cache refresh\n");
+        optionsRefresh.thread = AST_PTHREADT_NULL;
+        ast_cond_destroy(&optionsRefresh.cond);
+        return -1;
+    }
+    return 0;
+}
+
+/*! \brief Stop the background refresh job , if running , and drop the refreshes it did not run */
+static void options_refresh_stop(void) {
+    pthread_t thread;
+
+    ast_mutex_lock(&optionsRefresh.lock);
+    thread = optionsRefresh.thread;
+    optionsRefresh.stop = 1;
+    if (thread != AST_PTHREADT_NULL) {
+        ast_cond_signal(&optionsRefresh.cond);
+    }
+    ast_mutex_unlock(&optionsRefresh.lock);
+    if (thread == AST_PTHREADT_NULL) {
+        return;
+    }
+    pthread_join(thread, NULL);
+    ast_mutex_lock(&optionsRefresh.lock);
+    optionsRefresh.thread = AST_PTHREADT_NULL;
+    ast_mutex_unlock(&optionsRefresh.lock);
+    ast_cond_destroy(&optionsRefresh.cond);
+}
+
+/*! \brief Find the longest rule whose prefix starts number
+ * @return NULL if no rule matches
+ */
+static const struct options_prefix_rule *options_prefix_match(const struct options_prefix_rule *rules, int count,
+                                                              const char *number) {
+    const struct options_prefix_rule *best = NULL;
+    size_t bestLength = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        size_t length = strlen(rules[i].prefix);
+        if (length >= bestLength && !strncmp(number, rules[i].prefix, length)) {
+            best = &rules[i];
+            bestLength = length;
+        }
+    }
+    return best;
+}
+
+/*! \brief Match accounts of a tenant */
+static int options_account_tenant_match(const struct options_account *account, void *arg) {
+    return account->tenantId == *(int *) arg;
+}
+
+/*! \brief Match accounts assigned on a group */
+static int options_account_group_match(const struct options_account *account, void *arg) {
+    int i;
+    for (i = 0; account->extra && i < account->extra->nbGroups; i++) {
+        if (account->extra->groups[i] == *(int *) arg) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*! \brief Match one UserID */
+static int options_account_id_match(const struct options_account *account, void *arg) {
+    return account->userId == *(int *) arg;
+}
+
+/*! \brief Remove matching accounts from cache , reloading them if asked
+ * @return number of accounts dropped
+ */
+static int options_account_drop(options_account_match_fn match, void *arg, int refresh,
+                                struct database_configuration *dbInfo) {
+    int generation = optionsCache.generation;
+    int *ids = NULL;
+    int dropped;
+    int i;
+
+    dropped = options_account_table_remove(optionsCache.accounts, match, arg, refresh && dbInfo ? &ids : NULL);
+    for (i = 0; ids && i < dropped; i++) {
+        struct options_account account;
+        if (!options_account_load(ids[i], &account, dbInfo)) {
+            options_account_table_put(optionsCache.accounts, &account, generation);
+            ao2_cleanup(account.extra);
+        }
+    }
+    ast_free(ids);
+    return dropped;
+}
+
+/*! \brief Unlink matching prefix sets from a cache container , reloading them if asked
+ * @return number of entries dropped
+ */
+static int options_cache_drop(struct ao2_container *container, ao2_callback_fn *match, void *arg, int refresh,
+                              struct database_configuration *dbInfo) {
+    struct ao2_iterator *iter;
+    struct options_prefix_set *set;
+    int dropped = 0;
+
+    if (!(iter = ao2_callback(container, OBJ_MULTIPLE | OBJ_UNLINK, match, arg))) {
+        return 0;
+    }
+    while ((set = ao2_iterator_next(iter))) {
+        struct options_prefix_set *fresh = NULL;
+        dropped++;
+        if (refresh && dbInfo) {
+            if (container == optionsCache.prefixIn) {
+                fresh = options_storage_backend()->normalization(set->id, dbInfo);
+            } else {
+                fresh = options_storage_backend()->group_prefixes(set->id, dbInfo);
+            }
+            if (fresh) {
+                options_cache_lifetime(&fresh->expires, &fresh->refresh);
+                ao2_link(container, fresh);
+                ao2_ref(fresh, -1);
+            }
+        }
+        ao2_ref(set, -1);
+    }
+    ao2_iterator_destroy(iter);
+    return dropped;
+}
+
+/*! \brief Drop (and optionally reload) cached data of a UserID, TenantID, GroupID or table
+ * @return number of entries dropped , -1 if target is invalid
+ */
+static int options_cache_invalidate(enum options_cache_scope scope, const char *target, int refresh) {
+    RAII_VAR(struct option_global *, cfg, ao2_global_obj_ref(options_globals), ao2_cleanup);
+    struct database_configuration *dbInfo = cfg ? cfg->dbCredentials : NULL;
+    int caches = 0;
+    int id = 0;
+    int dropped = 0;
+    int i;
+
+    if (ast_strlen_zero(target)) {
+        return -1;
+    }
+    if (scope == OPTIONS_CACHE_SCOPE_TABLE) {
+        for (i = 0; i < ARRAY_LEN(options_cache_tables); i++) {
+            if (!strcasecmp(options_cache_tables[i].name, target)) {
+                caches = options_cache_tables[i].caches;
+            }
+        }
+        if (!caches) {
+            return -1;
+        }
+    } else if (is_string_digits(target) || strlen(target) > 9) {
+        return -1;
+    } else {
+        id = atoi(target);
+    }
+
+    ast_atomic_fetchadd_int(&optionsCache.generation, 1);
+    ast_atomic_fetchadd_int(&optionsCache.invalidations, 1);
+
+    switch (scope) {
+        case OPTIONS_CACHE_SCOPE_USER:
+            dropped = options_account_drop(options_account_id_match, &id, refresh, dbInfo);
+            break;
+        case OPTIONS_CACHE_SCOPE_TENANT:
+            dropped = options_account_drop(options_account_tenant_match, &id, refresh, dbInfo);
+            dropped += options_cache_drop(optionsCache.prefixIn, options_cache_cmp_fn, &id, refresh, dbInfo);
+            break;
+        case OPTIONS_CACHE_SCOPE_GROUP:
+            dropped = options_account_drop(options_account_group_match, &id, refresh, dbInfo);
+            dropped += options_cache_drop(optionsCache.groupPrefixes, options_cache_cmp_fn, &id, refresh, dbInfo);
+            break;
+        case OPTIONS_CACHE_SCOPE_TABLE:
+            if (caches & OPTIONS_CACHE_ACCOUNTS) {
+                dropped += options_account_drop(NULL, NULL, refresh, dbInfo);
+            }
+            if (caches & OPTIONS_CACHE_PREFIX_IN) {
+                dropped += options_cache_drop(optionsCache.prefixIn, NULL, NULL, refresh, dbInfo);
+            }
+            if (caches & OPTIONS_CACHE_GROUP_PREFIXES) {
+                dropped += options_cache_drop(optionsCache.groupPrefixes, NULL, NULL, refresh, dbInfo);
+            }
+            break;
+    }
+    /** Whole tenants are loaded again once their accounts have been dropped **/
+    if (scope == OPTIONS_CACHE_SCOPE_TENANT) {
+        options_tenant_reset(id);
+    } else if (scope == OPTIONS_CACHE_SCOPE_TABLE && (caches & OPTIONS_CACHE_ACCOUNTS)) {
+        options_tenant_reset(-1);
+    }
+    options_intern_sweep();
+
+    ast_log(LOG_DEBUG, "Cache %s of %s[%s] dropped %d entries\n", refresh ? "refresh" : "invalidation",
+            options_cache_scope_name(scope), target, dropped);
+    return dropped;
+}
+
+/*! \brief Drop every cached entry , without reloading : the next calls read them from storage again */
+static void options_cache_flush(void) {
+    int dropped;
+
+    ast_atomic_fetchadd_int(&optionsCache.generation, 1);
+    dropped = options_account_drop(NULL, NULL, 0, NULL);
+    dropped += options_cache_drop(optionsCache.prefixIn, NULL, NULL, 0, NULL);
+    dropped += options_cache_drop(optionsCache.groupPrefixes, NULL, NULL, 0, NULL);
+    options_tenant_reset(-1);
+    options_intern_sweep();
+    ast_log(LOG_DEBUG, "Cache flushed , %d entries dropped\n", dropped);
+}
+
+/*! \brief Convert a scope name as given on CLI or AMI
+ * @return -1 if unknown
+ */
+static int options_cache_scope_from_str(const char *name) {
+    if (ast_strlen_zero(name)) {
+        return -1;
+    } else if (!strcasecmp(name, "user")) {
+        return OPTIONS_CACHE_SCOPE_USER;
+    } else if (!strcasecmp(name, "tenant")) {
+        return OPTIONS_CACHE_SCOPE_TENANT;
+    } else if (!strcasecmp(name, "group")) {
+        return OPTIONS_CACHE_SCOPE_GROUP;
+    } else if (!strcasecmp(name, "table")) {
+        return OPTIONS_CACHE_SCOPE_TABLE;
+    }
+    return -1;
+}
+
+/*! \brief Name of a scope for display */
+static const char *options_cache_scope_name(enum options_cache_scope scope) {
+    switch (scope) {
+        case OPTIONS_CACHE_SCOPE_USER:
+            return "user";
+        case OPTIONS_CACHE_SCOPE_TENANT:
+            return "tenant";
+        case OPTIONS_CACHE_SCOPE_GROUP:
+            return "group";
+        case OPTIONS_CACHE_SCOPE_TABLE:
+            return "table";
+    }
+    return "unknown";
+}
+
+/*! \brief Complete scope and table names for cache CLI commands */
+static char *options_cache_complete(struct ast_cli_args *a) {
+    static const char * const scopes[] = {"user", "tenant", "group", "table", NULL};
+    int i, which = 0;
+
+    if (a->pos == 3) {
+        return ast_cli_complete(a->word, scopes, a->n);
+    }
+    if (a->pos == 4 && !strcasecmp(a->argv[3], "table")) {
+        for (i = 0; i < ARRAY_LEN(options_cache_tables); i++) {
+            if (!strncasecmp(a->word, options_cache_tables[i].name, strlen(a->word)) && ++which > a->n) {
+                return ast_strdup(options_cache_tables[i].name);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*! \brief Shared body of "options cache invalidate|refresh" */
+static char *options_cache_cli_exec(struct ast_cli_args *a, int refresh) {
+    int scope;
+    int dropped;
+
+    if (a->argc != 5 || (scope = options_cache_scope_from_str(a->argv[3])) < 0) {
+        return CLI_SHOWUSAGE;
+    }
+    if ((dropped = options_cache_invalidate(scope, a->argv[4], refresh)) < 0) {
+        ast_cli(a->fd, "Invalid %s '%s'\n", a->argv[3], a->argv[4]);
+        return CLI_FAILURE;
+    }
+    ast_cli(a->fd, "%s %d cached entries for %s %s\n", refresh ? "Refreshed" : "Invalidated", dropped,
+            a->argv[3], a->argv[4]);
+    return CLI_SUCCESS;
+}
+
+/*! \brief CLI command "options cache invalidate" */
+static char *handle_cli_cache_invalidate(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options cache invalidate";
+            e->usage =
+                    "Usage: options cache invalidate {user|tenant|group|table} <id|table>\n"
+                    "       Drop cached data of a UserID, TenantID, GroupID or database table.\n"
+                    "       It will be loaded again from database on next call.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return options_cache_complete(a);
+    }
+    return options_cache_cli_exec(a, 0);
+}
+
+/*! \brief CLI command "options cache refresh" */
+static char *handle_cli_cache_refresh(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options cache refresh";
+            e->usage =
+                    "Usage: options cache refresh {user|tenant|group|table} <id|table>\n"
+                    "       Reload cached data of a UserID, TenantID, GroupID or database table now.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return options_cache_complete(a);
+    }
+    return options_cache_cli_exec(a, 1);
+}
+
+/*! \brief CLI command "options cache show" */
+static char *handle_cli_cache_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options cache show";
+            e->usage =
+                    "Usage: options cache show\n"
+                    "       Display cache lifetime , size and statistics.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 3) {
+        return CLI_SHOWUSAGE;
+    }
+    ast_cli(a->fd, "  == Options Cache:\n"
+                   "\tTTL            = [%u]%s\n"
+                   "\tAccounts       = [%d]\n"
+                   "\tPrefixIn       = [%d]\n"
+                   "\tGroupPrefixes  = [%d]\n"
+                   "\tRefreshAhead   = [%u%%]\n"
+                   "\tStaleTTL       = [%u]\n"
+                   "\tTTLJitter      = [%u%%]\n"
+                   "\tHits           = [%d]\n"
+                   "\tStaleHits      = [%d]\n"
+                   "\tMisses         = [%d]\n"
+                   "\tInvalidations  = [%d]\n"
+                   "\tRefreshes      = [%d queued , %d pending , %d done , %d failed , %d dropped]\n",
+            optionsCache.ttl, optionsCache.ttl ? "" : " (disabled)",
+            options_account_table_count(optionsCache.accounts), ao2_container_count(optionsCache.prefixIn),
+            ao2_container_count(optionsCache.groupPrefixes), optionsCache.refreshAhead, optionsCache.staleTtl,
+            optionsCache.jitter, optionsCache.hits, optionsCache.staleHits, optionsCache.misses,
+            optionsCache.invalidations, optionsRefresh.queued, optionsRefresh.pending, optionsRefresh.refreshed,
+            optionsRefresh.failed, optionsRefresh.dropped);
+    return CLI_SUCCESS;
+}
+
+/*! \brief Order partitions from the most to the least recently used */
+static int options_tenant_recent_cmp(const void *a, const void *b) {
+    time_t left = options_tenant_last_used((*(struct options_tenant * const *) a)->id);
+    time_t right = options_tenant_last_used((*(struct options_tenant * const *) b)->id);
+    return left < right ? 1 : left > right ? -1 : 0;
+}
+
+/*! \brief CLI command "options tenants show" */
+static char *handle_cli_tenants_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    static const char *states[] = {"partial", "loading", "loaded", "evicting"};
+    struct options_tenant **tenants;
+    struct options_tenant *tenant;
+    struct ao2_iterator iter;
+    time_t now = time(NULL);
+    int count = 0, total, i;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options tenants show";
+            e->usage =
+                    "Usage: options tenants show\n"
+                    "       Display cached tenants , most recently used first , with the memory\n"
+                    "       their accounts hold and how long loading them took.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 3) {
+        return CLI_SHOWUSAGE;
+    }
+    total = ao2_container_count(optionsTenants.partitions);
+    if (!(tenants = ast_calloc(total + 1, sizeof(*tenants)))) {
+        return CLI_FAILURE;
+    }
+    iter = ao2_iterator_init(optionsTenants.partitions, 0);
+    while ((tenant = ao2_iterator_next(&iter))) {
+        if (count > total) {
+            ao2_ref(tenant, -1);
+            continue;
+        }
+        tenants[count++] = tenant;
+    }
+    ao2_iterator_destroy(&iter);
+    qsort(tenants, count, sizeof(*tenants), options_tenant_recent_cmp);
+
+    ast_cli(a->fd, "  == Options Tenants:\n"
+                   "\tPartition      = [%s]\n"
+                   "\tMax memory     = [%d KB]%s\n"
+                   "\tMemory         = [%d KB]\n"
+                   "\tTenants        = [%d]\n"
+                   "\tEvictions      = [%d]\n",
+            optionsTenants.partition == OPTIONS_PARTITION_TENANT ? "tenant" : "account",
+            optionsTenants.maxMemory / 1024, optionsTenants.maxMemory ? "" : " (no ceiling)",
+            optionsTenants.memory / 1024, count, optionsTenants.evictions);
+    ast_cli(a->fd, "%-10s %-8s %9s %11s %6s %6s %10s %10s %8s\n", "TenantID", "State", "Accounts", "Memory(KB)",
+            "Loads", "Waits", "Load(ms)", "Max(ms)", "Idle(s)");
+    for (i = 0; i < count; i++) {
+        tenant = tenants[i];
+        ast_cli(a->fd, "%-10d %-8s %9d %11d %6u %6u %10ld %10ld %8ld\n", tenant->id, states[tenant->state],
+                tenant->accounts, tenant->memory / 1024, tenant->loads, tenant->waits, (long) tenant->loadTime,
+                (long) tenant->maxLoadTime, (long) (now - options_tenant_last_used(tenant->id)));
+        ao2_ref(tenant, -1);
+    }
+    ast_free(tenants);
+    return CLI_SUCCESS;
+}
+
+/*! \brief Reader thread of "options cache benchmark" */
+static void *options_bench_thread(void *data) {
+    struct options_bench_worker *worker = data;
+    struct options_account account;
+    unsigned int seed = (unsigned int) (uintptr_t) worker | 1;
+    unsigned long long lookups = 0;
+
+    while (!*worker->stop) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        options_account_table_get(worker->table, (int) (seed % worker->accounts) + 1, &account, 0);
+        lookups++;
+    }
+    worker->lookups = lookups;
+    return NULL;
+}
+
+/*! \brief Run concurrent lookups on a private account table and return lookups per second */
+static double options_bench_run(struct options_account_table *table, int accounts, int threads, int seconds) {
+    struct options_bench_worker *workers;
+    volatile int stop = 0;
+    unsigned long long total = 0;
+    struct timeval start;
+    int64_t elapsed;
+    int i;
+
+    if (!(workers = ast_calloc(threads, sizeof(*workers)))) {
+        return 0;
+    }
+    start = ast_tvnow();
+    for (i = 0; i < threads; i++) {
+        workers[i].table = table;
+        workers[i].accounts = accounts;
+        workers[i].stop = &stop;
+        if (ast_pthread_create_background(&workers[i].thread, NULL, options_bench_thread, &workers[i])) {
+            workers[i].thread = AST_PTHREADT_NULL;
+        }
+    }
+    sleep(seconds);
+    stop = 1;
+    for (i = 0; i < threads; i++) {
+        if (workers[i].thread != AST_PTHREADT_NULL) {
+            pthread_join(workers[i].thread, NULL);
+            total += workers[i].lookups;
+        }
+    }
+    elapsed = ast_tvdiff_ms(ast_tvnow(), start);
+    ast_free(workers);
+    return elapsed > 0 ? total * 1000.0 / elapsed : 0;
+}
+
+/*! \brief CLI command "options cache benchmark" */
+static char *handle_cli_cache_benchmark(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    struct options_account_table *table;
+    struct options_account account;
+    int threads, seconds = 2, accounts = 100000;
+    double single = 0;
+    int i, n;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options cache benchmark";
+            e->usage =
+                    "Usage: options cache benchmark <threads> [seconds]\n"
+                    "       Measure account lookup throughput on a private table of 100000\n"
+                    "       synthetic accounts with 1, 2, 4 ... <threads> concurrent readers.\n"
+                    "       The live cache is not touched.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc < 4 || a->argc > 5 || ast_parse_arg(a->argv[3], PARSE_INT32 | PARSE_IN_RANGE, &threads, 1, 1024) ||
+        (a->argc == 5 && ast_parse_arg(a->argv[4], PARSE_INT32 | PARSE_IN_RANGE, &seconds, 1, 60))) {
+        return CLI_SHOWUSAGE;
+    }
+    if (!(table = options_account_table_alloc())) {
+        return CLI_FAILURE;
+    }
+    memset(&account, 0, sizeof(account));
+    account.found = 1;
+    account.hasOptions = 1;
+    account.expires = time(NULL) + 86400;
+    account.refresh = account.expires;
+    for (i = 1; i <= accounts; i++) {
+        account.userId = i;
+        account.tenantId = i % 100;
+        options_account_table_put(table, &account, 0);
+    }
+    for (n = 1; n <= threads; n = (n < threads && n * 2 > threads) ? threads : n * 2) {
+        double rate = options_bench_run(table, accounts, n, seconds);
+        if (n == 1) {
+            single = rate;
+        }
+        ast_cli(a->fd, "Threads %4d : %12.0f lookups/s (x%.2f)\n", n, rate, single > 0 ? rate / single : 0);
+        if (n == threads) {
+            break;
+        }
+    }
+    options_account_table_free(table);
+    return CLI_SUCCESS;
+}
+
+/*! \brief Get the state of the Options() execution running on this thread */
+static struct options_call_state *options_call_state_get(void) {
+    return ast_threadstorage_get(&options_call_storage, sizeof(struct options_call_state));
+}
+
+/*! \brief Hand a free slot to the next waiting tenant , admission lock must be held
+ * @return 0 if a waiter took the slot , -1 if nobody was waiting
+ */
+static int options_admission_grant(void) {
+    struct options_admission_tenant *tenant;
+    struct options_admission_waiter *waiter;
+
+    if (!(tenant = AST_LIST_REMOVE_HEAD(&optionsAdmission.tenants, list))) {
+        return -1;
+    }
+    waiter = AST_LIST_REMOVE_HEAD(&tenant->waiters, list);
+    waiter->granted = 1;
+    optionsAdmission.queued--;
+    ast_cond_signal(&waiter->cond);
+    /** Served tenant goes back to the end of the line **/
+    if (AST_LIST_EMPTY(&tenant->waiters)) {
+        ast_free(tenant);
+    } else {
+        AST_LIST_INSERT_TAIL(&optionsAdmission.tenants, tenant, list);
+    }
+    return 0;
+}
+
+/*! \brief Date a wait started at start gives up , max_queue_wait later */
+static void options_admission_deadline(struct timeval start, struct timespec *deadline) {
+    deadline->tv_sec = start.tv_sec + optionsAdmission.maxQueueWait / 1000;
+    deadline->tv_nsec = (start.tv_usec + (optionsAdmission.maxQueueWait % 1000) * 1000) * 1000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/*! \brief Wait for a database slot
+ * Queries of the same tenant are served in order , tenants are served in round robin
+ * @return 0 once a slot is held , -1 if max_queue_wait elapsed first
+ */
+static int options_admission_acquire(struct options_call_state *state) {
+    struct options_admission_tenant *tenant;
+    struct options_admission_waiter waiter = {.granted = 0};
+    struct timeval start = ast_tvnow();
+    struct timespec deadline;
+    int tenantId = state ? state->tenantId : 0;
+    int64_t waited;
+
+    /** This call already gave up on the database , don't queue it again **/
+    if (state && state->active && state->shed) {
+        return -1;
+    }
+
+    ast_mutex_lock(&optionsAdmission.lock);
+    optionsAdmission.queries++;
+    if (optionsAdmission.inflight < optionsAdmission.maxInflight && AST_LIST_EMPTY(&optionsAdmission.tenants)) {
+        optionsAdmission.inflight++;
+        ast_mutex_unlock(&optionsAdmission.lock);
+        return 0;
+    }
+
+    AST_LIST_TRAVERSE(&optionsAdmission.tenants, tenant, list) {
+        if (tenant->tenantId == tenantId) {
+            break;
+        }
+    }
+    if (!tenant) {
+        if (!(tenant = ast_calloc(1, sizeof(*tenant)))) {
+            ast_mutex_unlock(&optionsAdmission.lock);
+            return -1;
+        }
+        tenant->tenantId = tenantId;
+        AST_LIST_INSERT_TAIL(&optionsAdmission.tenants, tenant, list);
+    }
+    ast_cond_init(&waiter.cond, NULL);
+    AST_LIST_INSERT_TAIL(&tenant->waiters, &waiter, list);
+    optionsAdmission.queued++;
+    optionsAdmission.waited++;
+
+    /** Deadline follows max_queue_wait , waiters are woken up when it is changed **/
+    while (!waiter.granted) {
+        options_admission_deadline(start, &deadline);
+        if (ast_cond_timedwait(&waiter.cond, &optionsAdmission.lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    waited = ast_tvdiff_us(ast_tvnow(), start);
+    optionsAdmission.queueTime += waited;
+    optionsAdmission.queueTimeMax = MAX(optionsAdmission.queueTimeMax, (uint64_t) waited);
+    if (!waiter.granted) {
+        /** Timed out : leave the queue **/
+        AST_LIST_REMOVE(&tenant->waiters, &waiter, list);
+        if (AST_LIST_EMPTY(&tenant->waiters)) {
+            AST_LIST_REMOVE(&optionsAdmission.tenants, tenant, list);
+            ast_free(tenant);
+        }
+        optionsAdmission.queued--;
+        optionsAdmission.shed++;
+        if (state && state->active) {
+            state->shed = 1;
+        }
+    }
+    ast_mutex_unlock(&optionsAdmission.lock);
+    ast_cond_destroy(&waiter.cond);
+
+    if (!waiter.granted) {
+        ast_log(LOG_WARNING, "Database query of tenant %d shed after waiting %ld ms for a slot\n", tenantId,
+                (long) (waited / 1000));
+        return -1;
+    }
+    return 0;
+}
+
+/*! \brief Give back a database slot
+ * @param queryTime microseconds spent running the query
+ */
+static void options_admission_release(int64_t queryTime) {
+    ast_mutex_lock(&optionsAdmission.lock);
+    optionsAdmission.queryTime += queryTime;
+    optionsAdmission.queryTimeMax = MAX(optionsAdmission.queryTimeMax, (uint64_t) queryTime);
+    /** Slot goes straight to a waiter unless limit has been lowered meanwhile **/
+    if (optionsAdmission.inflight > optionsAdmission.maxInflight || options_admission_grant()) {
+        optionsAdmission.inflight--;
+    }
+    ast_mutex_unlock(&optionsAdmission.lock);
+}
+
+/*! \brief Apply new limits , admission lock must be held
+ * Free slots go to waiters , the others are woken up to check their deadline against the new max_queue_wait
+ */
+static void options_admission_apply(unsigned int maxInflight, unsigned int maxQueueWait, int shedVerdict) {
+    struct options_admission_tenant *tenant;
+    struct options_admission_waiter *waiter;
+
+    optionsAdmission.maxInflight = maxInflight;
+    optionsAdmission.maxQueueWait = maxQueueWait;
+    optionsAdmission.shedVerdict = shedVerdict;
+    while (optionsAdmission.inflight < optionsAdmission.maxInflight && !options_admission_grant()) {
+        optionsAdmission.inflight++;
+    }
+    AST_LIST_TRAVERSE(&optionsAdmission.tenants, tenant, list) {
+        AST_LIST_TRAVERSE(&tenant->waiters, waiter, list) {
+            ast_cond_signal(&waiter->cond);
+        }
+    }
+}
+
+/*! \brief Apply new limits , waking up waiters if more slots are available */
+static void options_admission_configure(unsigned int maxInflight, unsigned int maxQueueWait, int shedVerdict) {
+    ast_mutex_lock(&optionsAdmission.lock);
+    options_admission_apply(maxInflight, maxQueueWait, shedVerdict);
+    ast_mutex_unlock(&optionsAdmission.lock);
+}
+
+/*! \brief Handle a call whose lookups were shed by admission control */
+static int options_admission_shed(struct ast_channel *chan) {
+    if (optionsAdmission.shedVerdict == OPTIONS_SHED_HANGUP) {
+        ast_log(LOG_WARNING, "-- %s : Database overloaded , hanging up call\n", ast_channel_uniqueid(chan));
+        forceHangup(ast_channel_name(chan));
+    } else {
+        ast_log(LOG_WARNING, "-- %s : Database overloaded , call continues without options\n",
+                ast_channel_uniqueid(chan));
+    }
+    return 0;
+}
+
+/*! \brief Parse shed_verdict option */
+static int shed_verdict_handler(const struct aco_option *opt, struct ast_variable *var, void *obj) {
+    struct database_configuration *dbInfo = obj;
+
+    if (!strcasecmp(var->value, "allow")) {
+        dbInfo->shedVerdict = OPTIONS_SHED_ALLOW;
+    } else if (!strcasecmp(var->value, "hangup")) {
+        dbInfo->shedVerdict = OPTIONS_SHED_HANGUP;
+    } else {
+        ast_log(LOG_WARNING, "Invalid shed_verdict '%s' , must be allow or hangup\n", var->value);
+        return -1;
+    }
+    return 0;
+}
+
+/*! \brief CLI command "options admission show" */
+static char *handle_cli_admission_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    struct options_admission stats;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options admission show";
+            e->usage =
+                    "Usage: options admission show\n"
+                    "       Display database admission limits , queue and query times.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 3) {
+        return CLI_SHOWUSAGE;
+    }
+    ast_mutex_lock(&optionsAdmission.lock);
+    stats = optionsAdmission;
+    ast_mutex_unlock(&optionsAdmission.lock);
+
+    ast_cli(a->fd, "  == Options Admission:\n"
+                   "\tMaxInflight    = [%u]\n"
+                   "\tMaxQueueWait   = [%u ms]\n"
+                   "\tShedVerdict    = [%s]\n"
+                   "\tInflight       = [%u]\n"
+                   "\tQueued         = [%u]\n"
+                   "\tQueries        = [%lu]\n"
+                   "\tQueuedQueries  = [%lu]\n"
+                   "\tShed           = [%lu]\n"
+                   "\tQueueTime      = [avg %lu us , max %lu us]\n"
+                   "\tQueryTime      = [avg %lu us , max %lu us]\n",
+            stats.maxInflight, stats.maxQueueWait, stats.shedVerdict == OPTIONS_SHED_HANGUP ? "hangup" : "allow",
+            stats.inflight, stats.queued, (unsigned long) stats.queries, (unsigned long) stats.waited,
+            (unsigned long) stats.shed,
+            (unsigned long) (stats.waited ? stats.queueTime / stats.waited : 0), (unsigned long) stats.queueTimeMax,
+            (unsigned long) (stats.queries ? stats.queryTime / stats.queries : 0), (unsigned long) stats.queryTimeMax);
+    return CLI_SUCCESS;
+}
+
+/*! \brief CLI command "options admission set" */
+static char *handle_cli_admission_set(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    static const char * const settings[] = {"maxinflight", "maxwait", "verdict", NULL};
+    static const char * const verdicts[] = {"allow", "hangup", NULL};
+    unsigned int maxInflight = 0, maxQueueWait = 0;
+    int shedVerdict = -1;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options admission set";
+            e->usage =
+                    "Usage: options admission set {maxinflight|maxwait|verdict} <value>\n"
+                    "       Change a database admission limit until next reload.\n"
+                    "       maxinflight : concurrent queries (1-64)\n"
+                    "       maxwait     : milliseconds a query may wait for a slot\n"
+                    "       verdict     : allow|hangup , applied to calls waiting longer\n";
+            return NULL;
+        case CLI_GENERATE:
+            if (a->pos == 3) {
+                return ast_cli_complete(a->word, settings, a->n);
+            }
+            if (a->pos == 4 && !strcasecmp(a->argv[3], "verdict")) {
+                return ast_cli_complete(a->word, verdicts, a->n);
+            }
+            return NULL;
+    }
+    if (a->argc != 5) {
+        return CLI_SHOWUSAGE;
+    }
+    if (!strcasecmp(a->argv[3], "maxinflight")) {
+        if (ast_parse_arg(a->argv[4], PARSE_UINT32 | PARSE_IN_RANGE, &maxInflight, 1, OPTIONS_DB_MAX_CONNECTIONS)) {
+            return CLI_SHOWUSAGE;
+        }
+    } else if (!strcasecmp(a->argv[3], "maxwait")) {
+        if (ast_parse_arg(a->argv[4], PARSE_UINT32, &maxQueueWait)) {
+            return CLI_SHOWUSAGE;
+        }
+    } else if (!strcasecmp(a->argv[3], "verdict")) {
+        if (!strcasecmp(a->argv[4], "allow")) {
+            shedVerdict = OPTIONS_SHED_ALLOW;
+        } else if (!strcasecmp(a->argv[4], "hangup")) {
+            shedVerdict = OPTIONS_SHED_HANGUP;
+        } else {
+            return CLI_SHOWUSAGE;
+        }
+    } else {
+        return CLI_SHOWUSAGE;
+    }
+    /** Other limits are kept as they are when the lock is taken **/
+    ast_mutex_lock(&optionsAdmission.lock);
+    options_admission_apply(maxInflight ? maxInflight : optionsAdmission.maxInflight,
+                            !strcasecmp(a->argv[3], "maxwait") ? maxQueueWait : optionsAdmission.maxQueueWait,
+                            shedVerdict >= 0 ? shedVerdict : optionsAdmission.shedVerdict);
+    ast_mutex_unlock(&optionsAdmission.lock);
+    ast_cli(a->fd, "Admission %s set to %s\n", a->argv[3], a->argv[4]);
+    return CLI_SUCCESS;
+}
+
+/*! \brief Lookups go through the cache and the storage backend , unless cache_ttl is 0 with MySQL storage */
+static int options_use_cache(void) {
+    return optionsCache.ttl || options_storage_backend() != &options_mysql_backend;
+}
+
+/*! \brief Storage backend lookups are currently sent to */
+static const struct options_backend *options_storage_backend(void) {
+    const struct options_backend *backend = optionsStorage.backend;
+    return backend ? backend : &options_mysql_backend;
+}
+
+/*! \brief MySQL backend : users and options rows of an account */
+static int options_mysql_account_options(int userId, struct options_account *account,
+                                         struct database_configuration *dbInfo) {
+    char queryString[512];
+    int numRows = 0;
+    struct options_rows *myres = NULL;
+    MYSQL_ROW myrow;
+
+    sprintf(queryString,
+            "SELECT users.TenantID, options.UserID, options.cidIsAcode, options.Monitored, options.RCLI FROM users LEFT JOIN options USING(UserID) WHERE users.UserID=%d",
+            userId);
+    myres = options_query(myres, &numRows, queryString, dbInfo);
+    if (numRows < 0) {
+        return -1;
+    }
+    if (numRows) {
+        myrow = options_rows_fetch(myres, 0);
+        account->found = 1;
+        account->tenantId = atoi(S_OR(myrow[0], "0"));
+        account->hasOptions = myrow[1] != NULL;
+        account->cidIsAcode = atoi(S_OR(myrow[2], "0"));
+        account->monitored = atoi(S_OR(myrow[3], "0"));
+        account->rcli = atoi(S_OR(myrow[4], "0"));
+    }
+    ao2_cleanup(myres);
+    return 0;
+}
+
+/*! \brief MySQL backend : groups of an account and how many of them are monitored */
+static int options_mysql_group_membership(int userId, struct options_account *account,
+                                          struct database_configuration *dbInfo) {
+    struct options_account_extra *extra = account->extra;
+    char queryString[512];
+    int numRows = 0;
+    struct options_rows *myres = NULL;
+    MYSQL_ROW myrow;
+    int i, j, groupId;
+
+    sprintf(queryString, "SELECT group_user.GroupID FROM group_user WHERE group_user.UserID=%d", userId);
+    myres = options_query(myres, &numRows, queryString, dbInfo);
+    if (numRows < 0) {
+        return -1;
+    }
+    account->groupCount = numRows;
+    if (numRows && !(extra->groups = ast_calloc(numRows, sizeof(*extra->groups)))) {
+        ao2_cleanup(myres);
+        return -1;
+    }
+    for (i = 0; i < numRows; i++) {
+        myrow = options_rows_fetch(myres, i);
+        groupId = atoi(S_OR(myrow[0], "0"));
+        for (j = 0; j < extra->nbGroups && extra->groups[j] != groupId; j++);
+        if (j == extra->nbGroups) {
+            extra->groups[extra->nbGroups++] = groupId;
+        }
+    }
+
+    sprintf(queryString,
+            "SELECT COUNT(GUID) FROM group_user INNER JOIN group_agent USING(GroupID) WHERE (group_user.UserID=%d) AND (group_agent.monitored=1)",
+            userId);
+    myres = options_query(myres, &numRows, queryString, dbInfo);
+    if (numRows < 0) {
+        return -1;
+    }
+    if (numRows) {
+        myrow = options_rows_fetch(myres, 0);
+        account->groupMonitored = atoi(S_OR(myrow[0], "0"));
+    }
+    ao2_cleanup(myres);
+    return 0;
+}
+
+/*! \brief MySQL backend : prefixes an account is not allowed to dial */
+static int options_mysql_blocked_prefixes(int userId, struct options_account *account,
+                                          struct database_configuration *dbInfo) {
+    struct options_account_extra *extra = account->extra;
+    char queryString[512];
+    int numRows = 0;
+    struct options_rows *myres = NULL;
+    MYSQL_ROW myrow;
+    int i;
+
+    sprintf(queryString,
+            "SELECT blocked_prefix_user.prefix FROM blocked_prefix_user WHERE blocked_prefix_user.UserID=%d", userId);
+    myres = options_query(myres, &numRows, queryString, dbInfo);
+    if (numRows < 0) {
+        return -1;
+    }
+    if (numRows && !(extra->blocked = ast_calloc(numRows, sizeof(*extra->blocked)))) {
+        ao2_cleanup(myres);
+        return -1;
+    }
+    for (i = 0; i < numRows; i++) {
+        struct options_prefix_rule *rule = &extra->blocked[extra->nbBlocked];
+        myrow = options_rows_fetch(myres, i);
+        if (!myrow[0]) {
+            continue;
+        }
+        if (options_prefix_rule_init(rule, myrow[0], 0, NULL)) {
+            ao2_cleanup(myres);
+            return -1;
+        }
+        extra->nbBlocked++;
+    }
+    ao2_cleanup(myres);
+    return 0;
+}
+
+/*! \brief MySQL backend : dids assigned to an account */
+static int options_mysql_dids(int userId, struct options_account *account, struct database_configuration *dbInfo) {
+    struct options_account_extra *extra = account->extra;
+    char queryString[512];
+    int numRows = 0;
+    struct options_rows *myres = NULL;
+    MYSQL_ROW myrow;
+    int i;
+
+    sprintf(queryString, "SELECT did FROM dids NATURAL JOIN didToUser WHERE didToUser.userid = %d", userId);
+    myres = options_query(myres, &numRows, queryString, dbInfo);
+    if (numRows < 0) {
+        return -1;
+    }
+    if (numRows && !(extra->dids = ast_calloc(numRows, sizeof(*extra->dids)))) {
+        ao2_cleanup(myres);
+        return -1;
+    }
+    for (i = 0; i < numRows; i++) {
+        myrow = options_rows_fetch(myres, i);
+        if (!(extra->dids[extra->nbDids] = options_intern(myrow[0]))) {
+            ao2_cleanup(myres);
+            return -1;
+        }
+        extra->nbDids++;
+    }
+    ao2_cleanup(myres);
+    return 0;
+}
+
+/*! \brief MySQL backend : prefix rules from a query returning prefix[, digit_delete, new_prefix] rows */
+static struct options_prefix_set *options_mysql_prefix_set(int id, const char *queryString,
+                                                           struct database_configuration *dbInfo) {
+    int numRows = 0;
+    struct options_rows *myres = NULL;
+    MYSQL_ROW myrow;
+    struct options_prefix_set *set;
+    int i;
+
+    myres = options_query(myres, &numRows, (char *) queryString, dbInfo);
+    if (numRows < 0) {
+        return NULL;
+    }
+    if (!(set = options_prefix_set_alloc(id, numRows))) {
+        ao2_cleanup(myres);
+        return NULL;
+    }
+    for (i = 0; i < numRows; i++) {
+        myrow = options_rows_fetch(myres, i);
+        if (options_prefix_set_add(set, myrow[0], myres->columns > 2 ? atoi(S_OR(myrow[1], "0")) : 0,
+                                   myres->columns > 2 ? myrow[2] : NULL)) {
+            ao2_cleanup(myres);
+            ao2_ref(set, -1);
+            return NULL;
+        }
+    }
+    ao2_cleanup(myres);
+    return set;
+}
+
+/*! \brief MySQL backend : number normalization rules of a tenant */
+static struct options_prefix_set *options_mysql_normalization(int tenantId, struct database_configuration *dbInfo) {
+    char queryString[512];
+
+    sprintf(queryString,
+            "SELECT prefix_in.prefix, prefix_in.digit_delete, prefix_in.new_prefix FROM prefix_in WHERE prefix_in.TenantID=%d",
+            tenantId);
+    return options_mysql_prefix_set(tenantId, queryString, dbInfo);
+}
+
+/*! \brief MySQL backend : prefixes a group is not allowed to dial */
+static struct options_prefix_set *options_mysql_group_prefixes(int groupId, struct database_configuration *dbInfo) {
+    char queryString[512];
+
+    sprintf(queryString,
+            "SELECT blocked_prefix_group.prefix FROM blocked_prefix_group WHERE blocked_prefix_group.GroupID=%d",
+            groupId);
+    return options_mysql_prefix_set(groupId, queryString, dbInfo);
+}
+
+/*! \brief MySQL backend : every account of a tenant , one query per options_tenant_queries entry */
+static int options_mysql_tenant_accounts(int tenantId, struct options_account_table *batch,
+                                         struct database_configuration *dbInfo) {
+    char queryString[512];
+    int numRows;
+    struct options_rows *myres;
+    MYSQL_ROW myrow;
+    int part, i;
+
+    for (part = 0; part < ARRAY_LEN(options_tenant_queries); part++) {
+        numRows = 0;
+        myres = NULL;
+        snprintf(queryString, sizeof(queryString), options_tenant_queries[part].mysql, tenantId);
+        myres = options_query(myres, &numRows, queryString, dbInfo);
+        if (numRows < 0) {
+            return -1;
+        }
+        for (i = 0; i < numRows; i++) {
+            myrow = options_rows_fetch(myres, i);
+            if (options_tenant_row(batch, tenantId, part, (const char **) myrow)) {
+                ao2_cleanup(myres);
+                return -1;
+            }
+        }
+        ao2_cleanup(myres);
+    }
+    return 0;
+}
+
+/*! \brief Prepare a lookup on the local SQLite file , binding key to its only parameter
+ * The file can't be swapped by the sync job until options_sqlite_done() is called
+ * @return NULL on error
+ */
+static sqlite3_stmt *options_sqlite_prepare(const char *sql, int key) {
+    sqlite3_stmt *stmt = NULL;
+
+    ast_rwlock_rdlock(&optionsStorage.lock);
+    if (!optionsStorage.db) {
+        ast_log(LOG_WARNING, "Local storage is not available , sync has not completed yet\n");
+        ast_rwlock_unlock(&optionsStorage.lock);
+        return NULL;
+    }
+    if (sqlite3_prepare_v2(optionsStorage.db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        ast_log(LOG_ERROR, "SQLite return an Error : %s on query:\n[%s]\n", sqlite3_errmsg(optionsStorage.db), sql);
+        sqlite3_finalize(stmt);
+        ast_rwlock_unlock(&optionsStorage.lock);
+        return NULL;
+    }
+    sqlite3_bind_int(stmt, 1, key);
+    return stmt;
+}
+
+/*! \brief Release a lookup started by options_sqlite_prepare() */
+static void options_sqlite_done(sqlite3_stmt *stmt) {
+    sqlite3_finalize(stmt);
+    ast_rwlock_unlock(&optionsStorage.lock);
+}
+
+/*! \brief Count rows of a lookup , then rewind it
+ * @return -1 on error
+ */
+static int options_sqlite_count(sqlite3_stmt *stmt) {
+    int count = 0;
+    int res;
+
+    while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+        count++;
+    }
+    if (res != SQLITE_DONE) {
+        ast_log(LOG_ERROR, "SQLite return an Error : %s\n", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+        return -1;
+    }
+    sqlite3_reset(stmt);
+    return count;
+}
+
+/*! \brief SQLite backend : users and options rows of an account */
+static int options_sqlite_account_options(int userId, struct options_account *account,
+                                          struct database_configuration *dbInfo) {
+    sqlite3_stmt *stmt;
+    int res;
+
+    if (!(stmt = options_sqlite_prepare(
+            "SELECT users.TenantID, options.UserID, options.cidIsAcode, options.Monitored, options.RCLI FROM users LEFT JOIN options USING(UserID) WHERE users.UserID=?",
+            userId))) {
+        return -1;
+    }
+    if ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+        account->found = 1;
+        account->tenantId = sqlite3_column_int(stmt, 0);
+        account->hasOptions = sqlite3_column_type(stmt, 1) != SQLITE_NULL;
+        account->cidIsAcode = sqlite3_column_int(stmt, 2);
+        account->monitored = sqlite3_column_int(stmt, 3);
+        account->rcli = sqlite3_column_int(stmt, 4);
+    }
+    options_sqlite_done(stmt);
+    return res == SQLITE_ROW || res == SQLITE_DONE ? 0 : -1;
+}
+
+/*! \brief SQLite backend : groups of an account and how many of them are monitored */
+static int options_sqlite_group_membership(int userId, struct options_account *account,
+                                           struct database_configuration *dbInfo) {
+    struct options_account_extra *extra = account->extra;
+    sqlite3_stmt *stmt;
+    int numRows, groupId, j;
+
+    if (!(stmt = options_sqlite_prepare("SELECT GroupID FROM group_user WHERE UserID=?", userId))) {
+        return -1;
+    }
+    if ((numRows = options_sqlite_count(stmt)) < 0
+        || (numRows && !(extra->groups = ast_calloc(numRows, sizeof(*extra->groups))))) {
+        options_sqlite_done(stmt);
+        return -1;
+    }
+    account->groupCount = numRows;
+    while (sqlite3_step(stmt) == SQLITE_ROW && extra->nbGroups < numRows) {
+        groupId = sqlite3_column_int(stmt, 0);
+        for (j = 0; j < extra->nbGroups && extra->groups[j] != groupId; j++);
+        if (j == extra->nbGroups) {
+            extra->groups[extra->nbGroups++] = groupId;
+        }
+    }
+    options_sqlite_done(stmt);
+
+    if (!(stmt = options_sqlite_prepare(
+            "SELECT COUNT(*) FROM group_user INNER JOIN group_agent USING(GroupID) WHERE (group_user.UserID=?) AND (group_agent.monitored=1)",
+            userId))) {
+        return -1;
+    }
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+        options_sqlite_done(stmt);
+        return -1;
+    }
+    account->groupMonitored = sqlite3_column_int(stmt, 0);
+    options_sqlite_done(stmt);
+    return 0;
+}
+
+/*! \brief SQLite backend : prefixes an account is not allowed to dial */
+static int options_sqlite_blocked_prefixes(int userId, struct options_account *account,
+                                           struct database_configuration *dbInfo) {
+    struct options_account_extra *extra = account->extra;
+    sqlite3_stmt *stmt;
+    const char *prefix;
+    int numRows;
+
+    if (!(stmt = options_sqlite_prepare("SELECT prefix FROM blocked_prefix_user WHERE UserID=?", userId))) {
+        return -1;
+    }
+    if ((numRows = options_sqlite_count(stmt)) < 0
+        || (numRows && !(extra->blocked = ast_calloc(numRows, sizeof(*extra->blocked))))) {
+        options_sqlite_done(stmt);
+        return -1;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW && extra->nbBlocked < numRows) {
+        if (!(prefix = (const char *) sqlite3_column_text(stmt, 0))) {
+            continue;
+        }
+        if (options_prefix_rule_init(&extra->blocked[extra->nbBlocked], prefix, 0, NULL)) {
+            options_sqlite_done(stmt);
+            return -1;
+        }
+        extra->nbBlocked++;
+    }
+    options_sqlite_done(stmt);
+    return 0;
+}
+
+/*! \brief SQLite backend : dids assigned to an account */
+static int options_sqlite_dids(int userId, struct options_account *account, struct database_configuration *dbInfo) {
+    struct options_account_extra *extra = account->extra;
+    sqlite3_stmt *stmt;
+    int numRows;
+
+    if (!(stmt = options_sqlite_prepare("SELECT did FROM user_dids WHERE UserID=?", userId))) {
+        return -1;
+    }
+    if ((numRows = options_sqlite_count(stmt)) < 0
+        || (numRows && !(extra->dids = ast_calloc(numRows, sizeof(*extra->dids))))) {
+        options_sqlite_done(stmt);
+        return -1;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW && extra->nbDids < numRows) {
+        if (!(extra->dids[extra->nbDids] = options_intern((const char *) sqlite3_column_text(stmt, 0)))) {
+            options_sqlite_done(stmt);
+            return -1;
+        }
+        extra->nbDids++;
+    }
+    options_sqlite_done(stmt);
+    return 0;
+}
+
+/*! \brief SQLite backend : prefix rules from a query returning prefix[, digit_delete, new_prefix] rows */
+static struct options_prefix_set *options_sqlite_prefix_set(int id, const char *sql) {
+    struct options_prefix_set *set;
+    sqlite3_stmt *stmt;
+    int numRows;
+
+    if (!(stmt = options_sqlite_prepare(sql, id))) {
+        return NULL;
+    }
+    if ((numRows = options_sqlite_count(stmt)) < 0 || !(set = options_prefix_set_alloc(id, numRows))) {
+        options_sqlite_done(stmt);
+        return NULL;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW && set->count < numRows) {
+        if (options_prefix_set_add(set, (const char *) sqlite3_column_text(stmt, 0),
+                                   sqlite3_column_count(stmt) > 2 ? sqlite3_column_int(stmt, 1) : 0,
+                                   sqlite3_column_count(stmt) > 2 ? (const char *) sqlite3_column_text(stmt, 2)
+                                                                  : NULL)) {
+            options_sqlite_done(stmt);
+            ao2_ref(set, -1);
+            return NULL;
+        }
+    }
+    options_sqlite_done(stmt);
+    return set;
+}
+
+/*! \brief SQLite backend : number normalization rules of a tenant */
+static struct options_prefix_set *options_sqlite_normalization(int tenantId, struct database_configuration *dbInfo) {
+    return options_sqlite_prefix_set(tenantId,
+                                     "SELECT prefix, digit_delete, new_prefix FROM prefix_in WHERE TenantID=?");
+}
+
+/*! \brief SQLite backend : prefixes a group is not allowed to dial */
+static struct options_prefix_set *options_sqlite_group_prefixes(int groupId, struct database_configuration *dbInfo) {
+    return options_sqlite_prefix_set(groupId, "SELECT prefix FROM blocked_prefix_group WHERE GroupID=?");
+}
+
+/*! \brief SQLite backend : every account of a tenant , one query per options_tenant_queries entry */
+static int options_sqlite_tenant_accounts(int tenantId, struct options_account_table *batch,
+                                          struct database_configuration *dbInfo) {
+    sqlite3_stmt *stmt;
+    const char *row[5];
+    int part, i, res;
+
+    for (part = 0; part < ARRAY_LEN(options_tenant_queries); part++) {
+        if (!(stmt = options_sqlite_prepare(options_tenant_queries[part].sqlite, tenantId))) {
+            return -1;
+        }
+        while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+            for (i = 0; i < ARRAY_LEN(row); i++) {
+                row[i] = i < sqlite3_column_count(stmt) ? (const char *) sqlite3_column_text(stmt, i) : NULL;
+            }
+            if (options_tenant_row(batch, tenantId, part, row)) {
+                res = SQLITE_NOMEM;
+                break;
+            }
+        }
+        if (res != SQLITE_DONE) {
+            ast_log(LOG_ERROR, "SQLite return an Error : %s\n", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+        }
+        options_sqlite_done(stmt);
+        if (res != SQLITE_DONE) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*! \brief Open the local SQLite file read only and make it the one lookups use
+ * @return 0 on success , -1 if the file can't be opened
+ */
+static int options_storage_open(const char *file) {
+    sqlite3 *db = NULL;
+    sqlite3 *old;
+
+    if (sqlite3_open_v2(file, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_FULLMUTEX, NULL) != SQLITE_OK) {
+        ast_log(LOG_WARNING, "Unable to open local storage %s : %s\n", file, db ? sqlite3_errmsg(db) : "no memory");
+        sqlite3_close(db);
+        return -1;
+    }
+    ast_rwlock_wrlock(&optionsStorage.lock);
+    old = optionsStorage.db;
+    optionsStorage.db = db;
+    ast_copy_string(optionsStorage.file, file, sizeof(optionsStorage.file));
+    ast_rwlock_unlock(&optionsStorage.lock);
+    /** No lookup can still be using the previous file **/
+    sqlite3_close(old);
+    /** Without cache_ttl , entries read from the previous file are only valid until now **/
+    if (!optionsCache.ttl && optionsCache.accounts) {
+        options_cache_flush();
+    }
+    return 0;
+}
+
+/*! \brief Close the local SQLite file */
+static void options_storage_close(void) {
+    sqlite3 *old;
+
+    ast_rwlock_wrlock(&optionsStorage.lock);
+    old = optionsStorage.db;
+    optionsStorage.db = NULL;
+    optionsStorage.file[0] = '\0';
+    ast_rwlock_unlock(&optionsStorage.lock);
+    sqlite3_close(old);
+}
+
+/*! \brief Switch lookups to the storage selected by the configuration that has just been applied */
+static void options_storage_configure(struct database_configuration *dbInfo) {
+    int reopen;
+
+    if (dbInfo->storage == OPTIONS_STORAGE_SQLITE) {
+        ast_rwlock_rdlock(&optionsStorage.lock);
+        reopen = !optionsStorage.db || strcmp(optionsStorage.file, dbInfo->sqliteFile);
+        ast_rwlock_unlock(&optionsStorage.lock);
+        /** A missing file is created by the first sync **/
+        if (reopen && !options_storage_open(dbInfo->sqliteFile)) {
+            ast_mutex_lock(&optionsStorage.syncLock);
+            optionsStorage.lastAttempt = time(NULL);
+            ast_mutex_unlock(&optionsStorage.syncLock);
+        }
+        optionsStorage.backend = &options_sqlite_backend;
+    } else {
+        optionsStorage.backend = &options_mysql_backend;
+        options_storage_close();
+    }
+    /** Sync schedule may have changed **/
+    ast_mutex_lock(&optionsStorage.jobLock);
+    if (optionsStorage.thread != AST_PTHREADT_NULL) {
+        ast_cond_signal(&optionsStorage.jobCond);
+    }
+    ast_mutex_unlock(&optionsStorage.jobLock);
+}
+
+/*! \brief Copy lookup tables from MySQL into a new local SQLite file , then switch lookups to it
+ * The file is built aside and renamed over the previous one , lookups never see a partial copy
+ * @return 0 on success , -1 on failure
+ */
+static int options_storage_sync(struct database_configuration *dbInfo) {
+    char tmpFile[PATH_MAX];
+    char insert[256];
+    sqlite3 *db = NULL;
+    sqlite3_stmt *stmt = NULL;
+    MYSQL_RES *myres = NULL;
+    MYSQL_ROW myrow;
+    struct timeval start = ast_tvnow();
+    struct options_call_state *state = options_call_state_get();
+    unsigned int rows = 0;
+    int numRows = 0;
+    int i, j, k;
+
+    if (state) {
+        state->stage = "sync";
+    }
+    ast_mutex_lock(&optionsStorage.syncLock);
+    optionsStorage.lastAttempt = time(NULL);
+    snprintf(tmpFile, sizeof(tmpFile), "%s.sync", dbInfo->sqliteFile);
+    unlink(tmpFile);
+    if (sqlite3_open_v2(tmpFile, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK
+        || sqlite3_exec(db, "PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF; BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+        goto error;
+    }
+    for (i = 0; i < ARRAY_LEN(options_sync_tables); i++) {
+        if (sqlite3_exec(db, options_sync_tables[i].create, NULL, NULL, NULL) != SQLITE_OK) {
+            goto error;
+        }
+        myres = MYSQL_query(myres, &numRows, (char *) options_sync_tables[i].select, dbInfo);
+        if (numRows < 0) {
+            goto error;
+        }
+        snprintf(insert, sizeof(insert), "INSERT OR REPLACE INTO %s VALUES (?", options_sync_tables[i].name);
+        for (j = 1; j < options_sync_tables[i].columns; j++) {
+            strncat(insert, ",?", sizeof(insert) - strlen(insert) - 1);
+        }
+        strncat(insert, ")", sizeof(insert) - strlen(insert) - 1);
+        if (sqlite3_prepare_v2(db, insert, -1, &stmt, NULL) != SQLITE_OK) {
+            goto error;
+        }
+        for (k = 0; k < numRows; k++) {
+            mysql_data_seek(myres, k);
+            myrow = mysql_fetch_row(myres);
+            for (j = 0; j < options_sync_tables[i].columns; j++) {
+                if (myrow[j]) {
+                    sqlite3_bind_text(stmt, j + 1, myrow[j], -1, SQLITE_TRANSIENT);
+                } else {
+                    sqlite3_bind_null(stmt, j + 1);
+                }
+            }
+            if (sqlite3_step(stmt) != SQLITE_DONE) {
+                goto error;
+            }
+            sqlite3_reset(stmt);
+        }
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+        /** Indexes are cheaper to build once the table is filled **/
+        if (options_sync_tables[i].index
+            && sqlite3_exec(db, options_sync_tables[i].index, NULL, NULL, NULL) != SQLITE_OK) {
+            goto error;
+        }
+        rows += numRows;
+    }
+    mysql_free_result(myres);
+    myres = NULL;
+    if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+        goto error;
+    }
+    sqlite3_close(db);
+    db = NULL;
+    if (rename(tmpFile, dbInfo->sqliteFile)) {
+        ast_log(LOG_ERROR, "Unable to replace local storage %s : %s\n", dbInfo->sqliteFile, strerror(errno));
+        goto error;
+    }
+    if (options_storage_open(dbInfo->sqliteFile)) {
+        goto error;
+    }
+    optionsStorage.lastSync = time(NULL);
+    optionsStorage.syncs++;
+    optionsStorage.rows = rows;
+    optionsStorage.syncTime = ast_tvdiff_ms(ast_tvnow(), start);
+    ast_mutex_unlock(&optionsStorage.syncLock);
+    if (state) {
+        state->stage = NULL;
+    }
+    ast_verb(3, "  == Local storage %s synced : %u rows in %ld ms\n", dbInfo->sqliteFile, rows,
+             (long) optionsStorage.syncTime);
+    return 0;
+
+    error:
+    if (db) {
+        ast_log(LOG_ERROR, "Sync of local storage %s failed : %s\n", dbInfo->sqliteFile, sqlite3_errmsg(db));
+    } else {
+        ast_log(LOG_ERROR, "Sync of local storage %s failed\n", dbInfo->sqliteFile);
+    }
+    mysql_free_result(myres);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    unlink(tmpFile);
+    optionsStorage.syncFailures++;
+    ast_mutex_unlock(&optionsStorage.syncLock);
+    if (state) {
+        state->stage = NULL;
+    }
+    return -1;
+}
+
+/*! \brief Sync the local SQLite file every sync_interval seconds */
+static void *options_storage_thread(void *data) {
+    struct option_global *cfg;
+    struct timespec wake;
+    time_t next = 0;
+
+    ast_mutex_lock(&optionsStorage.jobLock);
+    while (!optionsStorage.stop) {
+        cfg = ao2_global_obj_ref(options_globals);
+        if (cfg && cfg->dbCredentials && cfg->dbCredentials->storage == OPTIONS_STORAGE_SQLITE
+            && cfg->dbCredentials->syncInterval) {
+            ast_mutex_lock(&optionsStorage.syncLock);
+            next = optionsStorage.lastAttempt + cfg->dbCredentials->syncInterval;
+            ast_mutex_unlock(&optionsStorage.syncLock);
+            if (next <= time(NULL)) {
+                ast_mutex_unlock(&optionsStorage.jobLock);
+                options_storage_sync(cfg->dbCredentials);
+                ao2_ref(cfg, -1);
+                ast_mutex_lock(&optionsStorage.jobLock);
+                continue;
+            }
+        } else {
+            next = 0;
+        }
+        ao2_cleanup(cfg);
+        if (next) {
+            wake.tv_sec = next;
+            wake.tv_nsec = 0;
+            ast_cond_timedwait(&optionsStorage.jobCond, &optionsStorage.jobLock, &wake);
+        } else {
+            ast_cond_wait(&optionsStorage.jobCond, &optionsStorage.jobLock);
+        }
+    }
+    ast_mutex_unlock(&optionsStorage.jobLock);
+    return NULL;
+}
+
+/*! \brief Start the local storage sync job */
+static int options_storage_start(void) {
+    ast_cond_init(&optionsStorage.jobCond, NULL);
+    optionsStorage.stop = 0;
+    if (ast_pthread_create_background(&optionsStorage.thread, NULL, options_storage_thread, NULL)) {
+        ast_log(LOG_ERROR, "Unable to start local storage sync job\n");
+        optionsStorage.thread = AST_PTHREADT_NULL;
+        ast_cond_destroy(&optionsStorage.jobCond);
+        return -1;
+    }
+    return 0;
+}
+
+/*! \brief Stop the local storage sync job , if running , and close the local file */
+static void options_storage_stop(void) {
+    pthread_t thread;
+
+    ast_mutex_lock(&optionsStorage.jobLock);
+    thread = optionsStorage.thread;
+    optionsStorage.stop = 1;
+    if (thread != AST_PTHREADT_NULL) {
+        ast_cond_signal(&optionsStorage.jobCond);
+    }
+    ast_mutex_unlock(&optionsStorage.jobLock);
+    if (thread != AST_PTHREADT_NULL) {
+        pthread_join(thread, NULL);
+        ast_mutex_lock(&optionsStorage.jobLock);
+        optionsStorage.thread = AST_PTHREADT_NULL;
+        ast_mutex_unlock(&optionsStorage.jobLock);
+        ast_cond_destroy(&optionsStorage.jobCond);
+    }
+    optionsStorage.backend = NULL;
+    options_storage_close();
+}
+
+/*! \brief Parse storage option value */
+static int storage_handler(const struct aco_option *opt, struct ast_variable *var, void *obj) {
+    struct database_configuration *dbInfo = obj;
+
+    if (!strcasecmp(var->value, "mysql")) {
+        dbInfo->storage = OPTIONS_STORAGE_MYSQL;
+    } else if (!strcasecmp(var->value, "sqlite")) {
+        dbInfo->storage = OPTIONS_STORAGE_SQLITE;
+    } else {
+        ast_log(LOG_ERROR, "Invalid storage '%s' , expected mysql or sqlite\n", var->value);
+        return -1;
+    }
+    return 0;
+}
+
+/*! \brief CLI command "options storage show" */
+static char *handle_cli_storage_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    char file[PATH_MAX];
+    char lastSync[32] = "never";
+    struct tm tm;
+    time_t when;
+    unsigned int syncs, syncFailures, rows;
+    int64_t syncTime;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options storage show";
+            e->usage =
+                    "Usage: options storage show\n"
+                    "       Display the storage lookups read from and local storage sync statistics.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 3) {
+        return CLI_SHOWUSAGE;
+    }
+    ast_rwlock_rdlock(&optionsStorage.lock);
+    ast_copy_string(file, optionsStorage.db ? optionsStorage.file : "(not open)", sizeof(file));
+    ast_rwlock_unlock(&optionsStorage.lock);
+    ast_mutex_lock(&optionsStorage.syncLock);
+    when = optionsStorage.lastSync;
+    syncs = optionsStorage.syncs;
+    syncFailures = optionsStorage.syncFailures;
+    rows = optionsStorage.rows;
+    syncTime = optionsStorage.syncTime;
+    ast_mutex_unlock(&optionsStorage.syncLock);
+    if (when) {
+        strftime(lastSync, sizeof(lastSync), "%Y-%m-%d %H:%M:%S", localtime_r(&when, &tm));
+    }
+
+    ast_cli(a->fd, "  == Options Storage:\n"
+                   "\tBackend        = [%s]\n"
+                   "\tLocalFile      = [%s]\n"
+                   "\tLastSync       = [%s]\n"
+                   "\tSyncs          = [%u]\n"
+                   "\tSyncFailures   = [%u]\n"
+                   "\tRows           = [%u]\n"
+                   "\tSyncTime       = [%ld ms]\n",
+            options_storage_backend()->name, file, lastSync, syncs, syncFailures, rows, (long) syncTime);
+    return CLI_SUCCESS;
+}
+
+/*! \brief CLI command "options storage sync" */
+static char *handle_cli_storage_sync(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    RAII_VAR(struct option_global *, cfg, NULL, ao2_cleanup);
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options storage sync";
+            e->usage =
+                    "Usage: options storage sync\n"
+                    "       Copy lookup tables from MySQL into the local SQLite file now.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 3) {
+        return CLI_SHOWUSAGE;
+    }
+    if (!(cfg = ao2_global_obj_ref(options_globals)) || !cfg->dbCredentials) {
+        return CLI_FAILURE;
+    }
+    if (cfg->dbCredentials->storage != OPTIONS_STORAGE_SQLITE) {
+        ast_cli(a->fd, "Local storage is not in use (storage = mysql)\n");
+        return CLI_SUCCESS;
+    }
+    if (options_storage_sync(cfg->dbCredentials)) {
+        ast_cli(a->fd, "Sync failed , see logs\n");
+        return CLI_FAILURE;
+    }
+    ast_cli(a->fd, "Local storage synced\n");
+    return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry cli_options[] = {
+        AST_CLI_DEFINE(handle_cli_cache_invalidate, "Drop cached Options data"),
+        AST_CLI_DEFINE(handle_cli_cache_refresh, "Reload cached Options data"),
+        AST_CLI_DEFINE(handle_cli_cache_show, "Show Options cache statistics"),
+        AST_CLI_DEFINE(handle_cli_cache_benchmark, "Measure Options account cache scaling"),
+        AST_CLI_DEFINE(handle_cli_tenants_show, "Show Options cached tenants and their memory"),
+        AST_CLI_DEFINE(handle_cli_admission_show, "Show Options database admission statistics"),
+        AST_CLI_DEFINE(handle_cli_admission_set, "Change Options database admission limits"),
+        AST_CLI_DEFINE(handle_cli_replicas_show, "Show Options database endpoints"),
+        AST_CLI_DEFINE(handle_cli_storage_show, "Show Options storage backend and sync statistics"),
+        AST_CLI_DEFINE(handle_cli_storage_sync, "Sync Options local storage from MySQL"),
+        AST_CLI_DEFINE(handle_cli_limits_show, "Show Options call limits and refused calls"),
+        AST_CLI_DEFINE(handle_cli_limits_set, "Change Options call limits"),
+        AST_CLI_DEFINE(handle_cli_show_slowqueries, "Show Options slow database queries"),
+        AST_CLI_DEFINE(handle_cli_coalescing_show, "Show Options coalesced database lookups"),
+        AST_CLI_DEFINE(handle_cli_capture_start, "Record Options calls to a file"),
+        AST_CLI_DEFINE(handle_cli_capture_stop, "Stop recording Options calls"),
+        AST_CLI_DEFINE(handle_cli_capture_show, "Show Options call capture"),
+        AST_CLI_DEFINE(handle_cli_shadow_show, "Show Options shadow checks of cached decisions"),
+        AST_CLI_DEFINE(handle_cli_shadow_set, "Change the fraction of Options calls checked on MySQL"),
+};
+
+/*! \brief Shared body of OptionsCacheInvalidate and OptionsCacheRefresh */
+static int options_cache_manager_exec(struct mansession *s, const struct message *m, int refresh) {
+    const char *target = astman_get_header(m, "Target");
+    int scope = options_cache_scope_from_str(astman_get_header(m, "Scope"));
+    int dropped;
+
+    if (scope < 0) {
+        astman_send_error(s, m, "Scope must be one of user, tenant, group or table");
+        return 0;
+    }
+    if ((dropped = options_cache_invalidate(scope, target, refresh)) < 0) {
+        astman_send_error(s, m, "Invalid Target");
+        return 0;
+    }
+    astman_start_ack(s, m);
+    astman_append(s, "Entries: %d\r\n\r\n", dropped);
+    return 0;
+}
+
+/*! \brief AMI action OptionsCacheInvalidate */
+static int manager_cache_invalidate(struct mansession *s, const struct message *m) {
+    return options_cache_manager_exec(s, m, 0);
+}
+
+/*! \brief AMI action OptionsCacheRefresh */
+static int manager_cache_refresh(struct mansession *s, const struct message *m) {
+    return options_cache_manager_exec(s, m, 1);
+}
+
+/*! \brief AMI action OptionsCacheShow */
+static int manager_cache_show(struct mansession *s, const struct message *m) {
+    astman_start_ack(s, m);
+    astman_append(s,
+                  "TTL: %u\r\n"
+                  "Accounts: %d\r\n"
+                  "PrefixIn: %d\r\n"
+                  "GroupPrefixes: %d\r\n"
+                  "Hits: %d\r\n"
+                  "StaleHits: %d\r\n"
+                  "Misses: %d\r\n"
+                  "Invalidations: %d\r\n"
+                  "Refreshes: %d\r\n"
+                  "RefreshFailures: %d\r\n"
+                  "\r\n",
+                  optionsCache.ttl, options_account_table_count(optionsCache.accounts),
+                  ao2_container_count(optionsCache.prefixIn), ao2_container_count(optionsCache.groupPrefixes),
+                  optionsCache.hits, optionsCache.staleHits, optionsCache.misses, optionsCache.invalidations,
+                  optionsRefresh.refreshed, optionsRefresh.failed);
+    return 0;
+}
+
+
+/*! \brief free an options_channel_memo structure */
+static void options_memo_destroy(void *data) {
+    struct options_channel_memo *memo = data;
+    ao2_cleanup(memo->extra);
+    ast_free(memo);
+}
+
+/*! \brief Find the memo of a channel
+ * @param create add an empty one when the channel has none
+ * @return NULL if there is none (or on allocation failure)
+ */
+static struct options_channel_memo *options_memo_get(struct ast_channel *chan, int create) {
+    struct ast_datastore *datastore;
+    struct options_channel_memo *memo = NULL;
+
+    ast_channel_lock(chan);
+    if ((datastore = ast_channel_datastore_find(chan, &options_memo_info, NULL))) {
+        memo = datastore->data;
+    } else if (create && (datastore = ast_datastore_alloc(&options_memo_info, NULL))) {
+        if ((memo = ast_calloc(1, sizeof(*memo)))) {
+            memo->groupCount = -1;
+            datastore->data = memo;
+            ast_channel_datastore_add(chan, datastore);
+        } else {
+            ast_datastore_free(datastore);
+        }
+    }
+    ast_channel_unlock(chan);
+    return memo;
+}
+
+/*! \brief Save per-account results of this run , keeping track of an ongoing recording
+ * Groups and prohibitions are only known when lookups go through the cache
+ */
+static void options_memo_store(struct ast_channel *chan, struct options_channel_memo *memo, int tenantId,
+                               int monitored, int rcli, struct database_configuration *dbInfo) {
+    const char *accountCode = ast_channel_accountcode(chan);
+    struct options_account account;
+
+    ast_copy_string(memo->accountCode, accountCode, sizeof(memo->accountCode));
+    memo->tenantId = tenantId;
+    memo->monitored = monitored;
+    memo->rcli = rcli;
+    ao2_cleanup(memo->extra);
+    memo->extra = NULL;
+    memo->groupCount = -1;
+    /** The reference keeps groups and prohibitions even once the cached account is replaced **/
+    if (options_use_cache() && !options_cache_account(accountCode, dbInfo, &account, 1)) {
+        memo->extra = account.extra;
+        memo->groupCount = account.groupCount;
+    }
+}
+
+/*! \brief Microseconds on the monotonic clock */
+static uint64_t options_monotonic_us(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*! \brief Find the bucket of a key , claiming a free or idle slot for it if needed
+ * A key sits before the first never used slot of its probes : released slots are only handed over once the key
+ * is known to be missing , so it never gets two buckets.
+ * @return NULL when every slot the key may use is held by a busy key
+ */
+static struct options_limit_bucket *options_limit_bucket_get(struct options_limit_table *table, int key) {
+    unsigned int hash = options_account_hash(key);
+    struct options_limit_shard *shard = &table->shards[hash >> OPTIONS_LIMIT_SHARD_SHIFT];
+    struct options_limit_bucket *bucket;
+    uint64_t now;
+    unsigned int i;
+    int current;
+
+    for (i = 0; i < OPTIONS_LIMIT_PROBES; i++) {
+        bucket = &shard->buckets[(hash + i) & (OPTIONS_LIMIT_SHARD_SLOTS - 1)];
+        current = __atomic_load_n(&bucket->key, __ATOMIC_ACQUIRE);
+        if (!current && !__atomic_compare_exchange_n(&bucket->key, &current, key, 0, __ATOMIC_ACQ_REL,
+                                                     __ATOMIC_ACQUIRE)) {
+            /** Another thread claimed it first , current now holds its key **/
+        } else if (!current) {
+            return bucket;
+        }
+        if (current == key) {
+            return bucket;
+        }
+    }
+    /** No free slot left : take over a released one , or one of a key that has gone quiet **/
+    now = options_monotonic_us();
+    for (i = 0; i < OPTIONS_LIMIT_PROBES; i++) {
+        bucket = &shard->buckets[(hash + i) & (OPTIONS_LIMIT_SHARD_SLOTS - 1)];
+        current = __atomic_load_n(&bucket->key, __ATOMIC_ACQUIRE);
+        if (current == key || !options_limit_bucket_reclaim(bucket, current, key, now)) {
+            return bucket;
+        }
+    }
+    return NULL;
+}
+
+/*! \brief Hand an idle bucket over to another key , or release it with OPTIONS_LIMIT_KEY_RELEASED
+ * A bucket is idle when it holds no call and its rate allowance is full again. A call racing with the hand over
+ * may be counted once against the new key , the slot it holds is still given back to the same bucket.
+ * @return 0 if the bucket now belongs to key , -1 if it is in use
+ */
+static int options_limit_bucket_reclaim(struct options_limit_bucket *bucket, int current, int key, uint64_t now) {
+    if (!current || __atomic_load_n(&bucket->calls, __ATOMIC_RELAXED) > 0
+        || __atomic_load_n(&bucket->tat, __ATOMIC_RELAXED) > now
+        || !__atomic_compare_exchange_n(&bucket->key, &current, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    __atomic_store_n(&bucket->tat, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&bucket->rejected, 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*! \brief Release every idle bucket of a table , buckets holding calls keep their key until the next reload
+ * Released buckets are never set back to 0 : that would cut the probes of keys stored past them
+ */
+static void options_limit_table_reset(struct options_limit_table *table) {
+    uint64_t now = options_monotonic_us();
+    struct options_limit_bucket *bucket;
+    unsigned int i, j;
+
+    for (i = 0; i < OPTIONS_LIMIT_SHARDS; i++) {
+        for (j = 0; j < OPTIONS_LIMIT_SHARD_SLOTS; j++) {
+            bucket = &table->shards[i].buckets[j];
+            options_limit_bucket_reclaim(bucket, __atomic_load_n(&bucket->key, __ATOMIC_ACQUIRE),
+                                         OPTIONS_LIMIT_KEY_RELEASED, now);
+        }
+    }
+}
+
+/*! \brief Take a token from a bucket refilled at cps tokens per second , holding at most cps tokens
+ * Generic cell rate algorithm : the whole bucket state is one timestamp updated with a compare and swap
+ * @return 0 if the call may go , -1 if the bucket is empty
+ */
+static int options_limit_rate(struct options_limit_bucket *bucket, unsigned int cps, uint64_t now) {
+    uint64_t interval = 1000000 / cps;
+    uint64_t tat = __atomic_load_n(&bucket->tat, __ATOMIC_RELAXED);
+    uint64_t next;
+
+    do {
+        next = MAX(tat, now) + interval;
+        if (next > now + 1000000) {
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&bucket->tat, &tat, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+/*! \brief Take a concurrent call slot from a bucket
+ * @return 0 if the slot is held , -1 if calls are already in progress
+ */
+static int options_limit_take(struct options_limit_bucket *bucket, unsigned int calls) {
+    if (__atomic_fetch_add(&bucket->calls, 1, __ATOMIC_RELAXED) >= (int) calls) {
+        __atomic_fetch_sub(&bucket->calls, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+/*! \brief Give back a concurrent call slot */
+static void options_limit_give(struct options_limit_bucket *bucket) {
+    __atomic_fetch_sub(&bucket->calls, 1, __ATOMIC_RELAXED);
+}
+
+/*! \brief Check rate and concurrency of one key
+ * @param rate reason reported when the rate is reached , the concurrency one follows it
+ * @param held set to the bucket when a concurrent call slot has been taken
+ * @param reason set to the limit that has been reached
+ * @return 0 if the call may go , -1 if a limit is reached
+ */
+static int options_limit_apply(struct options_limit_table *table, int key, unsigned int cps, unsigned int calls,
+                               enum options_limit_reason rate, struct options_limit_bucket **held,
+                               enum options_limit_reason *reason) {
+    struct options_limit_bucket *bucket;
+
+    if (!cps && !calls) {
+        return 0;
+    }
+    /** Fail open : never refuse a call because too many keys have been seen **/
+    if (!(bucket = options_limit_bucket_get(table, key))) {
+        ast_atomic_fetchadd_int(&optionsLimits.full, 1);
+        return 0;
+    }
+    if (cps && options_limit_rate(bucket, cps, options_monotonic_us())) {
+        *reason = rate;
+    } else if (calls && options_limit_take(bucket, calls)) {
+        *reason = rate + 1;
+    } else {
+        if (calls) {
+            *held = bucket;
+        }
+        return 0;
+    }
+    __atomic_fetch_add(&bucket->rejected, 1, __ATOMIC_RELAXED);
+    ast_atomic_fetchadd_int(&optionsLimits.rejected[*reason], 1);
+    return -1;
+}
+
+/*! \brief Apply UserID and TenantID limits to a call
+ * Only the first run on a channel is counted. The tenant is checked as soon as it is known ,
+ * which may only be after the lookups of the first run.
+ * @param tenantId 0 when not known yet
+ * @param reason set to the limit that has been reached
+ * @return 0 if the call may go , -1 if it must be refused
+ */
+static int options_limit_enter(struct ast_channel *chan, int tenantId, enum options_limit_reason *reason) {
+    const char *accountCode = ast_channel_accountcode(chan);
+    struct options_limit_bucket *userBucket = NULL, *tenantBucket = NULL;
+    struct options_limit_hold *hold = NULL;
+    struct ast_datastore *datastore;
+    unsigned int userCps = __atomic_load_n(&optionsLimits.userCps, __ATOMIC_RELAXED);
+    unsigned int userCalls = __atomic_load_n(&optionsLimits.userCalls, __ATOMIC_RELAXED);
+    unsigned int tenantCps = __atomic_load_n(&optionsLimits.tenantCps, __ATOMIC_RELAXED);
+    unsigned int tenantCalls = __atomic_load_n(&optionsLimits.tenantCalls, __ATOMIC_RELAXED);
+    int userId = 0;
+
+    if (!userCps && !userCalls && !tenantCps && !tenantCalls) {
+        return 0;
+    }
+
+    ast_channel_lock(chan);
+    if ((datastore = ast_channel_datastore_find(chan, &options_limit_info, NULL))) {
+        hold = datastore->data;
+        if (hold->tenantChecked || !tenantId) {
+            ast_channel_unlock(chan);
+            return 0;
+        }
+    } else {
+        if (!is_string_digits(accountCode) && strlen(accountCode) <= 9) {
+            userId = atoi(accountCode);
+        }
+        if (userId && options_limit_apply(&optionsLimits.users, userId, userCps, userCalls, OPTIONS_LIMIT_USER_CPS,
+                                          &userBucket, reason)) {
+            ast_channel_unlock(chan);
+            return -1;
+        }
+    }
+    if (tenantId && options_limit_apply(&optionsLimits.tenants, tenantId, tenantCps, tenantCalls,
+                                        OPTIONS_LIMIT_TENANT_CPS, &tenantBucket, reason)) {
+        /** A call already held by the channel is given back with its datastore **/
+        if (userBucket) {
+            options_limit_give(userBucket);
+        }
+        ast_channel_unlock(chan);
+        return -1;
+    }
+    if (!hold) {
+        if (!(datastore = ast_datastore_alloc(&options_limit_info, NULL)) || !(hold = ast_calloc(1, sizeof(*hold)))) {
+            /** Nothing would give the slots back , let the call go uncounted **/
+            if (datastore) {
+                ast_datastore_free(datastore);
+            }
+            if (userBucket) {
+                options_limit_give(userBucket);
+            }
+            if (tenantBucket) {
+                options_limit_give(tenantBucket);
+            }
+            ast_channel_unlock(chan);
+            return 0;
+        }
+        hold->user = userBucket;
+        datastore->data = hold;
+        ast_channel_datastore_add(chan, datastore);
+        ast_atomic_fetchadd_int(&optionsLimits.admitted, 1);
+    }
+    hold->tenant = tenantBucket;
+    hold->tenantChecked = tenantId != 0;
+    ast_channel_unlock(chan);
+    return 0;
+}
+
+/*! \brief Refuse a call that reached one of its limits , without any database work */
+static int options_limit_reject(struct ast_channel *chan, enum options_limit_reason reason) {
+    ast_log(LOG_DEBUG, "-- %s : Account %s reached its %s limit , refusing call\n", ast_channel_uniqueid(chan),
+            ast_channel_accountcode(chan), options_limit_reason_name(reason));
+    ast_channel_softhangup_withcause_locked(chan, AST_CAUSE_CALL_REJECTED);
+    return -1;
+}
+
+/*! \brief Give back concurrent call slots of a channel that is going away */
+static void options_limit_hold_destroy(void *data) {
+    struct options_limit_hold *hold = data;
+
+    if (hold->user) {
+        options_limit_give(hold->user);
+    }
+    if (hold->tenant) {
+        options_limit_give(hold->tenant);
+    }
+    ast_free(hold);
+}
+
+/*! \brief Name of a limit as used by the CLI */
+static const char *options_limit_reason_name(int reason) {
+    static const char * const names[] = {"user cps", "user calls", "tenant cps", "tenant calls"};
+
+    return (reason >= 0 && reason < OPTIONS_LIMIT_REASONS) ? names[reason] : "unknown";
+}
+
+/*! \brief List buckets of a limit table that are busy or refused calls */
+static void options_limit_table_show(int fd, const char *title, struct options_limit_table *table) {
+    struct options_limit_bucket *bucket;
+    unsigned int i, j, keys = 0;
+
+    ast_cli(fd, "  == %s:\n", title);
+    for (i = 0; i < OPTIONS_LIMIT_SHARDS; i++) {
+        for (j = 0; j < OPTIONS_LIMIT_SHARD_SLOTS; j++) {
+            bucket = &table->shards[i].buckets[j];
+            if (__atomic_load_n(&bucket->key, __ATOMIC_RELAXED) <= 0) {
+                continue;
+            }
+            keys++;
+            if (bucket->calls || bucket->rejected) {
+                ast_cli(fd, "\t%-10d calls [%d] rejected [%u]\n", bucket->key, bucket->calls, bucket->rejected);
+            }
+        }
+    }
+    ast_cli(fd, "\tKeys           = [%u / %u]\n", keys, OPTIONS_LIMIT_SHARDS * OPTIONS_LIMIT_SHARD_SLOTS);
+}
+
+/*! \brief CLI command "options limits show" */
+static char *handle_cli_limits_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    int i;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options limits show";
+            e->usage =
+                    "Usage: options limits show [detail]\n"
+                    "       Display call limits and refused calls.\n"
+                    "       detail lists UserIDs and TenantIDs with calls in progress or refused calls.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc < 3 || a->argc > 4 || (a->argc == 4 && strcasecmp(a->argv[3], "detail"))) {
+        return CLI_SHOWUSAGE;
+    }
+    ast_cli(a->fd, "  == Options Limits:\n"
+                   "\tUserCps        = [%u]\n"
+                   "\tUserCalls      = [%u]\n"
+                   "\tTenantCps      = [%u]\n"
+                   "\tTenantCalls    = [%u]\n"
+                   "\tAdmitted       = [%d]\n"
+                   "\tTableFull      = [%d]\n",
+            optionsLimits.userCps, optionsLimits.userCalls, optionsLimits.tenantCps, optionsLimits.tenantCalls,
+            optionsLimits.admitted, optionsLimits.full);
+    for (i = 0; i < OPTIONS_LIMIT_REASONS; i++) {
+        ast_cli(a->fd, "\tRejected %-12s = [%d]\n", options_limit_reason_name(i), optionsLimits.rejected[i]);
+    }
+    if (a->argc == 4) {
+        options_limit_table_show(a->fd, "UserIDs", &optionsLimits.users);
+        options_limit_table_show(a->fd, "TenantIDs", &optionsLimits.tenants);
+    }
+    return CLI_SUCCESS;
+}
+
+/*! \brief CLI command "options limits set" */
+static char *handle_cli_limits_set(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    static const char * const scopes[] = {"user", "tenant", NULL};
+    static const char * const kinds[] = {"cps", "calls", NULL};
+    unsigned int value;
+    unsigned int *limit;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options limits set";
+            e->usage =
+                    "Usage: options limits set {user|tenant} {cps|calls} <value>\n"
+                    "       Change a call limit until next reload , 0 removes it.\n"
+                    "       cps   : new calls per second of each UserID or TenantID\n"
+                    "       calls : calls in progress of each UserID or TenantID\n";
+            return NULL;
+        case CLI_GENERATE:
+            if (a->pos == 3) {
+                return ast_cli_complete(a->word, scopes, a->n);
+            }
+            if (a->pos == 4) {
+                return ast_cli_complete(a->word, kinds, a->n);
+            }
+            return NULL;
+    }
+    if (a->argc != 6 || ast_parse_arg(a->argv[5], PARSE_UINT32 | PARSE_IN_RANGE, &value, 0, 1000000)) {
+        return CLI_SHOWUSAGE;
+    }
+    if (!strcasecmp(a->argv[3], "user")) {
+        limit = !strcasecmp(a->argv[4], "cps") ? &optionsLimits.userCps : &optionsLimits.userCalls;
+    } else if (!strcasecmp(a->argv[3], "tenant")) {
+        limit = !strcasecmp(a->argv[4], "cps") ? &optionsLimits.tenantCps : &optionsLimits.tenantCalls;
+    } else {
+        return CLI_SHOWUSAGE;
+    }
+    if (strcasecmp(a->argv[4], "cps") && strcasecmp(a->argv[4], "calls")) {
+        return CLI_SHOWUSAGE;
+    }
+    /** Call threads read limits without lock **/
+    __atomic_store_n(limit, value, __ATOMIC_RELAXED);
+    ast_cli(a->fd, "Limit %s %s set to %u\n", a->argv[3], a->argv[4], value);
+    return CLI_SUCCESS;
+}
+
+/*! \brief Append a string to a capture record and store its length in the record header
+ * @return position after the string
+ */
+static size_t options_capture_field(unsigned char *record, size_t pos, int field, const char *value) {
+    size_t length = strlen(S_OR(value, ""));
+
+    length = MIN(length, OPTIONS_CAPTURE_FIELD_MAX);
+    record[8 + field] = length;
+    memcpy(record + pos, S_OR(value, ""), length);
+    return pos + length;
+}
+
+/*! \brief Write the inputs of an Options() run to the capture file , when capturing */
+static void options_capture_record(struct ast_channel *chan, const char *data) {
+    unsigned char record[8 + 4 + 4 * OPTIONS_CAPTURE_FIELD_MAX];
+    struct timeval now = ast_tvnow();
+    uint64_t when = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+    struct ast_party_caller *caller = ast_channel_caller(chan);
+    size_t pos = 12;
+    int i;
+
+    /** Unlocked check : calls are not slowed down when nothing is captured **/
+    if (!optionsCapture.file) {
+        return;
+    }
+    for (i = 0; i < 8; i++) {
+        record[i] = when >> (8 * i);
+    }
+    pos = options_capture_field(record, pos, 0, data);
+    pos = options_capture_field(record, pos, 1, ast_channel_accountcode(chan));
+    pos = options_capture_field(record, pos, 2, caller->id.number.valid ? caller->id.number.str : NULL);
+    pos = options_capture_field(record, pos, 3, ast_channel_name(chan));
+
+    ast_mutex_lock(&optionsCapture.lock);
+    if (optionsCapture.file) {
+        if (fwrite(record, 1, pos, optionsCapture.file) != pos) {
+            ast_log(LOG_WARNING, "Unable to write to capture file %s : %s , capture stopped\n", optionsCapture.path,
+                    strerror(errno));
+            options_capture_close();
+        } else {
+            optionsCapture.records++;
+            optionsCapture.bytes += pos;
+            if (optionsCapture.limit && optionsCapture.records >= optionsCapture.limit) {
+                ast_verb(2, "Capture to %s complete , %u calls recorded\n", optionsCapture.path,
+                         optionsCapture.records);
+                options_capture_close();
+            }
+        }
+    }
+    ast_mutex_unlock(&optionsCapture.lock);
+}
+
+/*! \brief Close the capture file , if open , capture lock must be held */
+static void options_capture_close(void) {
+    if (optionsCapture.file) {
+        fclose(optionsCapture.file);
+        optionsCapture.file = NULL;
+    }
+}
+
+/*! \brief CLI command "options capture start" */
+static char *handle_cli_capture_start(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    unsigned int limit = 0;
+    FILE *file;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options capture start";
+            e->usage =
+                    "Usage: options capture start <file> [<calls>]\n"
+                    "       Record the inputs of every Options() call (data , accountcode , caller id , channel\n"
+                    "       name and time) to file , until stopped or until calls calls were recorded.\n"
+                    "       The file is replayed with loadtest/replay.py.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc < 4 || a->argc > 5 ||
+        (a->argc == 5 && ast_parse_arg(a->argv[4], PARSE_UINT32 | PARSE_IN_RANGE, &limit, 1, UINT_MAX))) {
+        return CLI_SHOWUSAGE;
+    }
+    ast_mutex_lock(&optionsCapture.lock);
+    if (optionsCapture.file) {
+        ast_cli(a->fd, "Already capturing to %s\n", optionsCapture.path);
+        ast_mutex_unlock(&optionsCapture.lock);
+        return CLI_FAILURE;
+    }
+    if (!(file = fopen(a->argv[3], "wb")) || fwrite(OPTIONS_CAPTURE_MAGIC, 1, 8, file) != 8) {
+        ast_cli(a->fd, "Unable to create capture file %s : %s\n", a->argv[3], strerror(errno));
+        if (file) {
+            fclose(file);
+        }
+        ast_mutex_unlock(&optionsCapture.lock);
+        return CLI_FAILURE;
+    }
+    optionsCapture.file = file;
+    ast_copy_string(optionsCapture.path, a->argv[3], sizeof(optionsCapture.path));
+    optionsCapture.started = time(NULL);
+    optionsCapture.records = 0;
+    optionsCapture.bytes = 8;
+    optionsCapture.limit = limit;
+    ast_mutex_unlock(&optionsCapture.lock);
+    ast_cli(a->fd, "Capturing Options() calls to %s\n", a->argv[3]);
+    return CLI_SUCCESS;
+}
+
+/*! \brief CLI command "options capture stop" */
+static char *handle_cli_capture_stop(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options capture stop";
+            e->usage =
+                    "Usage: options capture stop\n"
+                    "       Stop recording Options() calls and close the capture file.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 3) {
+        return CLI_SHOWUSAGE;
+    }
+    ast_mutex_lock(&optionsCapture.lock);
+    if (!optionsCapture.file) {
+        ast_cli(a->fd, "No capture in progress\n");
+    } else {
+        options_capture_close();
+        ast_cli(a->fd, "Capture to %s stopped , %u calls recorded\n", optionsCapture.path, optionsCapture.records);
+    }
+    ast_mutex_unlock(&optionsCapture.lock);
+    return CLI_SUCCESS;
+}
+
+/*! \brief CLI command "options capture show" */
+static char *handle_cli_capture_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    char started[32] = "never";
+    struct tm tm;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options capture show";
+            e->usage =
+                    "Usage: options capture show\n"
+                    "       Display the current or last capture of Options() calls.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 3) {
+        return CLI_SHOWUSAGE;
+    }
+    ast_mutex_lock(&optionsCapture.lock);
+    if (optionsCapture.started) {
+        strftime(started, sizeof(started), "%Y-%m-%d %H:%M:%S", localtime_r(&optionsCapture.started, &tm));
+    }
+    ast_cli(a->fd, "  == Options Capture:\n"
+                   "\tState          = [%s]\n"
+                   "\tFile           = [%s]\n"
+                   "\tStarted        = [%s]\n"
+                   "\tRecords        = [%u]%s\n"
+                   "\tBytes          = [%lu]\n",
+            optionsCapture.file ? "capturing" : "stopped", S_OR(optionsCapture.path, "(none)"), started,
+            optionsCapture.records, optionsCapture.file && optionsCapture.limit ? " (limited)" : "",
+            (unsigned long) optionsCapture.bytes);
+    ast_mutex_unlock(&optionsCapture.lock);
+    return CLI_SUCCESS;
+}
+
+/*! \brief Pick a call served from the cache for a shadow check on MySQL
+ * @return job to queue once RcliOnCountry ran , NULL if the call is not sampled
+ */
+static struct options_shadow_job *options_shadow_sample(struct ast_channel *chan, const char *data,
+                                                        const char *formattedNumber, int blocked, int monitored,
+                                                        int rcli) {
+    struct ast_party_caller *caller = ast_channel_caller(chan);
+    struct options_shadow_job *job;
+    unsigned int sample = __atomic_load_n(&optionsShadow.sample, __ATOMIC_RELAXED);
+
+    /** Unlocked check , and nothing to compare with when lookups already run on MySQL **/
+    if (!sample || !options_use_cache() || (unsigned int) (ast_random() % OPTIONS_SHADOW_SCALE) >= sample) {
+        return NULL;
+    }
+    if (strlen(data) >= sizeof(job->data) || !(job = ast_calloc(1, sizeof(*job)))) {
+        return NULL;
+    }
+    ast_copy_string(job->uniqueid, ast_channel_uniqueid(chan), sizeof(job->uniqueid));
+    ast_copy_string(job->channel, ast_channel_name(chan), sizeof(job->channel));
+    ast_copy_string(job->accountCode, ast_channel_accountcode(chan), sizeof(job->accountCode));
+    ast_copy_string(job->callerId, caller->id.number.valid ? S_OR(caller->id.number.str, "") : "",
+                    sizeof(job->callerId));
+    ast_copy_string(job->data, data, sizeof(job->data));
+    ast_copy_string(job->formattedNumber, formattedNumber, sizeof(job->formattedNumber));
+    job->blocked = blocked;
+    job->monitored = monitored;
+    job->rcli = rcli;
+    return job;
+}
+
+/*! \brief Queue the shadow check of a sampled call , dropped when the queue is full */
+static void options_shadow_queue(struct options_shadow_job *job, const char *sda) {
+    if (!job) {
+        return;
+    }
+    ast_copy_string(job->sda, S_OR(sda, ""), sizeof(job->sda));
+    ast_mutex_lock(&optionsShadow.lock);
+    optionsShadow.sampled++;
+    if (optionsShadow.thread == AST_PTHREADT_NULL || optionsShadow.stop
+        || optionsShadow.pending >= OPTIONS_SHADOW_QUEUE) {
+        optionsShadow.dropped++;
+        ast_mutex_unlock(&optionsShadow.lock);
+        ast_free(job);
+        return;
+    }
+    AST_LIST_INSERT_TAIL(&optionsShadow.jobs, job, list);
+    optionsShadow.pending++;
+    ast_cond_signal(&optionsShadow.cond);
+    ast_mutex_unlock(&optionsShadow.lock);
+}
+
+/*! \brief Run the decisions of a sampled call again with the MySQL queries used without cache , log those that differ
+ * Data changed on MySQL since the call was served is reported as well.
+ * @return 0 if every decision agrees , 1 if one differs , -1 on database error
+ */
+static int options_shadow_run(const struct options_shadow_job *job, struct database_configuration *dbInfo) {
+    struct options_call_state *state = options_call_state_get();
+    struct options_rows *sdas = NULL;
+    char formattedNumber[26];
+    char sdaCheck[64] = "-";
+    int blocked = 0, monitored = 0, rcli = 0, numRows = 0, sdaDiffers = 0, numberDiffers, i;
+    int res = -1;
+
+    /** Queries are tagged with the call they check in the slow log and processlist **/
+    if (state) {
+        memset(state, 0, sizeof(*state));
+        state->active = 1;
+        state->shadow = 1;
+        state->stage = "shadow";
+        ast_copy_string(state->uniqueid, job->uniqueid, sizeof(state->uniqueid));
+    }
+    if (options_sql_international_number(job->data, formattedNumber, dbInfo)
+        || (blocked = options_sql_prefix_blocked(job->uniqueid, job->accountCode, formattedNumber, dbInfo)) < 0
+        || (monitored = options_sql_call_monitored(job->accountCode, dbInfo)) < 0
+        || (rcli = options_sql_rcli_enabled(job->accountCode, dbInfo)) < 0) {
+        goto done;
+    }
+    /** The Sda is picked at random : check the cached pick is one of the Sda MySQL would pick from **/
+    if (job->rcli && rcli && !strncmp(job->formattedNumber, "33", 2)) {
+        sdas = options_sql_rcli_sdas(job->accountCode, job->formattedNumber[2] - '0', &numRows, dbInfo);
+        if (numRows < 0) {
+            goto done;
+        }
+        for (i = 0; !ast_strlen_zero(job->sda) && i < numRows; i++) {
+            if (!strcmp(S_OR(options_rows_fetch(sdas, i)[0], ""), job->sda)) {
+                break;
+            }
+        }
+        sdaDiffers = ast_strlen_zero(job->sda) ? numRows > 0 : i == numRows;
+        snprintf(sdaCheck, sizeof(sdaCheck), "%s among %d", S_OR(job->sda, "none"), numRows);
+    }
+    numberDiffers = strcmp(job->formattedNumber, formattedNumber) != 0;
+    res = numberDiffers || job->blocked != blocked || job->monitored != monitored || job->rcli != rcli || sdaDiffers;
+
+    ast_mutex_lock(&optionsShadow.lock);
+    optionsShadow.checked++;
+    optionsShadow.mismatches += res;
+    optionsShadow.numberMismatches += numberDiffers;
+    optionsShadow.blockedMismatches += job->blocked != blocked;
+    optionsShadow.monitoredMismatches += job->monitored != monitored;
+    optionsShadow.rcliMismatches += job->rcli != rcli;
+    optionsShadow.sdaMismatches += sdaDiffers;
+    ast_mutex_unlock(&optionsShadow.lock);
+    if (res) {
+        ast_log(LOG_WARNING, "-- %s : cached decisions differ from MySQL on channel %s (accountcode %s , callerid %s , "
+                             "data %s) : number %s/%s , blocked %d/%d , monitored %d/%d , rcli %d/%d , sda %s "
+                             "(cache/MySQL)\n", job->uniqueid, job->channel, job->accountCode,
+                S_OR(job->callerId, "-"), job->data, job->formattedNumber, formattedNumber, job->blocked, blocked,
+                job->monitored, monitored, job->rcli, rcli, sdaCheck);
+    }
+
+done:
+    ao2_cleanup(sdas);
+    if (state) {
+        state->active = 0;
+    }
+    return res;
+}
+
+/*! \brief Run queued shadow checks one at a time */
+static void *options_shadow_thread(void *data) {
+    struct options_shadow_job *job;
+    struct option_global *cfg;
+    int res;
+
+    ast_mutex_lock(&optionsShadow.lock);
+    while (!optionsShadow.stop) {
+        if (!(job = AST_LIST_REMOVE_HEAD(&optionsShadow.jobs, list))) {
+            ast_cond_wait(&optionsShadow.cond, &optionsShadow.lock);
+            continue;
+        }
+        optionsShadow.pending--;
+        ast_mutex_unlock(&optionsShadow.lock);
+        res = -1;
+        if ((cfg = ao2_global_obj_ref(options_globals))) {
+            if (cfg->dbCredentials) {
+                res = options_shadow_run(job, cfg->dbCredentials);
+            }
+            ao2_ref(cfg, -1);
+        }
+        if (res < 0) {
+            ast_log(LOG_DEBUG, "Shadow check of %s failed on MySQL , not compared\n", job->uniqueid);
+        }
+        ast_free(job);
+        ast_mutex_lock(&optionsShadow.lock);
+        if (res < 0) {
+            optionsShadow.failed++;
+        }
+    }
+    while ((job = AST_LIST_REMOVE_HEAD(&optionsShadow.jobs, list))) {
+        ast_free(job);
+    }
+    optionsShadow.pending = 0;
+    ast_mutex_unlock(&optionsShadow.lock);
+    return NULL;
+}
+
+/*! \brief Start the background shadow check job */
+static int options_shadow_start(void) {
+    ast_cond_init(&optionsShadow.cond, NULL);
+    optionsShadow.stop = 0;
+    if (ast_pthread_create_background(&optionsShadow.thread, NULL, options_shadow_thread, NULL)) {
+        ast_log(LOG_ERROR, "Unable to start background shadow checks\n");
+        optionsShadow.thread = AST_PTHREADT_NULL;
+        ast_cond_destroy(&optionsShadow.cond);
+        return -1;
+    }
+    return 0;
+}
+
+/*! \brief Stop the background shadow check job , if running , and drop the checks it did not run */
+static void options_shadow_stop(void) {
+    pthread_t thread;
+
+    ast_mutex_lock(&optionsShadow.lock);
+    thread = optionsShadow.thread;
+    optionsShadow.stop = 1;
+    if (thread != AST_PTHREADT_NULL) {
+        ast_cond_signal(&optionsShadow.cond);
+    }
+    ast_mutex_unlock(&optionsShadow.lock);
+    if (thread == AST_PTHREADT_NULL) {
+        return;
+    }
+    pthread_join(thread, NULL);
+    ast_mutex_lock(&optionsShadow.lock);
+    optionsShadow.thread = AST_PTHREADT_NULL;
+    ast_mutex_unlock(&optionsShadow.lock);
+    ast_cond_destroy(&optionsShadow.cond);
+}
+
+/*! \brief CLI command "options shadow show" */
+static char *handle_cli_shadow_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options shadow show";
+            e->usage =
+                    "Usage: options shadow show\n"
+                    "       Display how many calls served from the cache were checked again on MySQL ,\n"
+                    "       and how many of their decisions differed.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 3) {
+        return CLI_SHOWUSAGE;
+    }
+    ast_mutex_lock(&optionsShadow.lock);
+    ast_cli(a->fd, "  == Options Shadow:\n"
+                   "\tSample         = [%.4f]%s\n"
+                   "\tSampled        = [%d]\n"
+                   "\tPending        = [%d]\n"
+                   "\tDropped        = [%d]\n"
+                   "\tFailed         = [%d]\n"
+                   "\tChecked        = [%d]\n"
+                   "\tMismatches     = [%d] (%.3f %%)\n"
+                   "\t  number       = [%d]\n"
+                   "\t  blocked      = [%d]\n"
+                   "\t  monitored    = [%d]\n"
+                   "\t  rcli         = [%d]\n"
+                   "\t  sda          = [%d]\n",
+            (double) __atomic_load_n(&optionsShadow.sample, __ATOMIC_RELAXED) / OPTIONS_SHADOW_SCALE,
+            options_use_cache() ? "" : " (lookups run on MySQL , nothing to check)",
+            optionsShadow.sampled, optionsShadow.pending, optionsShadow.dropped, optionsShadow.failed,
+            optionsShadow.checked, optionsShadow.mismatches,
+            optionsShadow.checked ? 100.0 * optionsShadow.mismatches / optionsShadow.checked : 0.0,
+            optionsShadow.numberMismatches, optionsShadow.blockedMismatches, optionsShadow.monitoredMismatches,
+            optionsShadow.rcliMismatches, optionsShadow.sdaMismatches);
+    ast_mutex_unlock(&optionsShadow.lock);
+    return CLI_SUCCESS;
+}
+
+/*! \brief CLI command "options shadow set" */
+static char *handle_cli_shadow_set(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    double sample;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options shadow set";
+            e->usage =
+                    "Usage: options shadow set <fraction>\n"
+                    "       Change the fraction (0 to 1) of calls served from the cache checked again on\n"
+                    "       MySQL until next reload , 0 stops sampling.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 4 || ast_parse_arg(a->argv[3], PARSE_DOUBLE | PARSE_IN_RANGE, &sample, 0.0, 1.0)) {
+        return CLI_SHOWUSAGE;
+    }
+    /** Call threads sample without lock **/
+    __atomic_store_n(&optionsShadow.sample, (unsigned int) (sample * OPTIONS_SHADOW_SCALE + 0.5), __ATOMIC_RELAXED);
+    ast_cli(a->fd, "Shadow sample set to %.4f\n", sample);
+    return CLI_SUCCESS;
+}
+
+/*! \brief main function , executed everytime our application is executed */
+static int app_exec(struct ast_channel *chan, const char *data) {
+    char formattedNumber[26];
+    struct options_call_state *callState;
+    struct options_channel_memo *memo;
+    struct options_shadow_job *shadow = NULL;
+    struct options_account account;
+    enum options_limit_reason limit;
+    const char *sda = NULL;
+    int blocked, monitored, rcli, memoized, tenantId = 0, res = 0;
+    /** Get global Configuration **/
+    RAII_VAR(struct option_global *, cfg, ao2_global_obj_ref(options_globals), ao2_cleanup);
+    /** Queue our database queries with our tenant when it is already known **/
+    if (!(callState = options_call_state_get())) {
+        return -1;
+    }
+    memset(callState, 0, sizeof(*callState));
+    /** Inputs are captured as received , even those the sanity check refuses **/
+    options_capture_record(chan, data);
+    if (dataSanityCheck(chan, data)) {
+        ast_log(LOG_DEBUG, "Sanity Check Has failed [ABORTING]!\n");
+        res = -1;
+        goto done;
+    }
+    /** Refuse calls of accounts over their limits before any database work **/
+    memo = options_memo_get(chan, 0);
+    memoized = memo && !ast_strlen_zero(memo->accountCode) && !strcmp(memo->accountCode, ast_channel_accountcode(chan));
+    if (memoized) {
+        tenantId = memo->tenantId;
+    } else if (!is_string_digits(ast_channel_accountcode(chan)) && strlen(ast_channel_accountcode(chan)) <= 9 &&
+        !options_account_table_get(optionsCache.accounts, atoi(ast_channel_accountcode(chan)), &account, 0)) {
+        tenantId = account.tenantId;
+    }
+    if (options_limit_enter(chan, tenantId, &limit)) {
+        res = options_limit_reject(chan, limit);
+        goto done;
+    }
+    callState->active = 1;
+    ast_copy_string(callState->uniqueid, ast_channel_uniqueid(chan), sizeof(callState->uniqueid));
+    /** An earlier run on this channel already resolved the account **/
+    callState->tenantId = tenantId;
+    /** Format Number to international number **/
+    callState->stage = "normalize";
+    get_international_number(data, formattedNumber, cfg->dbCredentials);
+    /** Check for option trunkASP **/
+    if (!memoized) {
+        callState->stage = "trunk_asp";
+        is_trunked_asp_account(chan, cfg->dbCredentials);
+    }
+    /** Check if prefix is bloqued **/
+    callState->stage = "blocked_prefix";
+    blocked = is_prefix_bloqued(chan, formattedNumber, memoized ? memo : NULL, cfg->dbCredentials);
+    if (memoized) {
+        monitored = memo->monitored;
+        rcli = memo->rcli;
+    } else {
+        /** Check if Call should be monitored/recorded in our case **/
+        callState->stage = "monitor";
+        monitored = isCallMonitored(chan, cfg->dbCredentials);
+        /** Check if Option RcliOnCountry is enabled **/
+        callState->stage = "rcli_check";
+        rcli = isRcliOnCountryEnabled(chan, cfg->dbCredentials);
+    }
+    /** A prohibited number , or one whose check failed , is refused even when the database is overloaded **/
+    if (blocked)
+        forceHangup(ast_channel_name(chan));
+    /** Database was too busy to answer , don't trust the other results **/
+    if (callState->shed) {
+        if (!blocked) {
+            res = options_admission_shed(chan);
+        }
+        goto done;
+    }
+    if (!memoized && (memo = options_memo_get(chan, 1))) {
+        callState->stage = "memo";
+        options_memo_store(chan, memo, callState->tenantId, monitored, rcli, cfg->dbCredentials);
+    }
+    /** Tenant was unknown before the lookups **/
+    if (!tenantId && callState->tenantId && options_limit_enter(chan, callState->tenantId, &limit)) {
+        res = options_limit_reject(chan, limit);
+        goto done;
+    }
+
+    /** Decisions of an earlier run are not sampled again **/
+    if (!memoized) {
+        shadow = options_shadow_sample(chan, data, formattedNumber, blocked, monitored, rcli);
+    }
+
+    /** Only one recording per channel **/
+    if (monitored && !(memo && memo->recording)) {
+        recordCall(chan, cfg->options);
+        if (memo) {
+            memo->recording = 1;
+        }
+    }
+    if (rcli) {
+        callState->stage = "rcli";
+        sda = startRcliOnCountry(chan, formattedNumber, cfg->dbCredentials);
+    }
+    /** Checked on MySQL off the call path **/
+    options_shadow_queue(shadow, sda);
+
+done:
+    /** The next call served by this thread starts from a clean state **/
+    callState->active = 0;
+    callState->stage = NULL;
+    return res;
+}
+
+
+/*! \internal \brief reload handler
+ * \retval AST_MODULE_LOAD_SUCCESS on success
+ * \retval AST_MODULE_LOAD_DECLINE on failure
+ */
+static int reload_module(void) {
+    ast_unregister_application(app);
+    if (aco_process_config(&cfg_info, 1) || ast_register_application_xml(app, app_exec)) {
+        ast_log(LOG_WARNING, "Error While reloading application %s\n", app);
+        return AST_MODULE_LOAD_DECLINE;
+    }
+    return AST_MODULE_LOAD_SUCCESS;
+}
+
+/*! \internal \brief unload handler */
+static int unload_module(void) {
+    ast_unregister_application(app);
+    options_health_stop();
+    options_refresh_stop();
+    options_shadow_stop();
+    options_storage_stop();
+    ast_cli_unregister_multiple(cli_options, ARRAY_LEN(cli_options));
+    ast_manager_unregister("OptionsCacheInvalidate");
+    ast_manager_unregister("OptionsCacheRefresh");
+    ast_manager_unregister("OptionsCacheShow");
+    aco_info_destroy(&cfg_info);
+    options_cache_destroy();
+    options_slow_log_configure(0, 0, 0);
+    ast_mutex_lock(&optionsCapture.lock);
+    options_capture_close();
+    ast_mutex_unlock(&optionsCapture.lock);
+    return 0;
+}
+
+/*! \internal \brief load handler
+ * \retval AST_MODULE_LOAD_SUCCESS on success
+ * \retval AST_MODULE_LOAD_DECLINE on failure
  */
 static int load_module(void) {
+    struct options_endpoint *endpoint;
+    MYSQL *conn;
+    /** Allocate lookup cache **/
+    if (options_cache_init()) {
+        return AST_MODULE_LOAD_DECLINE;
+    }
     /** Register Our application **/
     if (loadConfiguration() || ast_register_application_xml(app, app_exec)) {
         ast_log(LOG_WARNING, "Error While loading application %s\n", app);
+        options_cache_destroy();
         return AST_MODULE_LOAD_DECLINE;
     }
     RAII_VAR(struct option_global *, cfg, ao2_global_obj_ref(options_globals), ao2_cleanup);
 #ifdef DEBUG_OPTIONS
     displayConfiguration(cfg);
 #endif
+    /** Local storage is built from MySQL the first time **/
+    if (cfg->dbCredentials->storage == OPTIONS_STORAGE_SQLITE && !optionsStorage.db
+        && options_storage_sync(cfg->dbCredentials)) {
+        unload_module();
+        return AST_MODULE_LOAD_DECLINE;
+    }
     /** Connect to DB **/
-    if (MYSQL_connect(cfg->dbCredentials)) {
+    if ((conn = options_db_checkout(cfg->dbCredentials, &endpoint))) {
+        options_db_checkin(cfg->dbCredentials, endpoint, conn, 0, 0);
+        ast_verb(0, "  == Database Connection : Successfull\n");
+    } else if (cfg->dbCredentials->storage == OPTIONS_STORAGE_SQLITE) {
+        ast_log(LOG_WARNING, "Mysql database unreachable , lookups use local storage until it syncs again\n");
+    } else {
         ast_log(LOG_WARNING, "Error While connecting to Mysql database\n");
         unload_module();
         return AST_MODULE_LOAD_DECLINE;
-    };
-    ast_verb(0, "  == Database Connection : Successfull\n");
+    }
+    /** Replicas only receive reads once a health check succeeded **/
+    if (options_health_start() || options_storage_start() || options_refresh_start() || options_shadow_start()) {
+        unload_module();
+        return AST_MODULE_LOAD_DECLINE;
+    }
+    /** Register cache control commands **/
+    ast_cli_register_multiple(cli_options, ARRAY_LEN(cli_options));
+    ast_manager_register_xml("OptionsCacheInvalidate", EVENT_FLAG_SYSTEM, manager_cache_invalidate);
+    ast_manager_register_xml("OptionsCacheRefresh", EVENT_FLAG_SYSTEM, manager_cache_refresh);
+    ast_manager_register_xml("OptionsCacheShow", EVENT_FLAG_SYSTEM | EVENT_FLAG_REPORTING, manager_cache_show);
 
     return AST_MODULE_LOAD_SUCCESS;
 }
@@ -671,42 +4948,147 @@ static int loadConfiguration() {
                                 struct database_configuration, dbname )); /* Store the value in member dbname of a database_configuration struct */
 
 
-    aco_option_register(&cfg_info, "socket",                        /* Extract configuration item "socket" */
-                        ACO_EXACT,                                  /* Match the exact configuration item name */
-                        dbCredentials_mappings,                          /* Use the databasep_options array to find the object to populate */
-                        "/tmp/mysql.sock",                          /* supply a default value */
-                        OPT_STRINGFIELD_T,                           /* Interpret the value as a character array */
-                        0,                                          /* No interpretation flags are needed */
-                        STRFLDSET(
-                                struct database_configuration, socket )); /* Store the value in member socket of a database_configuration struct */
+    aco_option_register(&cfg_info, "socket",                        /* Extract configuration item "socket" */
+                        ACO_EXACT,                                  /* Match the exact configuration item name */
+                        dbCredentials_mappings,                          /* Use the databasep_options array to find the object to populate */
+                        "/tmp/mysql.sock",                          /* supply a default value */
+                        OPT_STRINGFIELD_T,                           /* Interpret the value as a character array */
+                        0,                                          /* No interpretation flags are needed */
+                        STRFLDSET(
+                                struct database_configuration, socket )); /* Store the value in member socket of a database_configuration struct */
+
+
+    aco_option_register(&cfg_info, "dstPath",                        /* Extract configuration item "dstPath" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        options_mappings,                             /* Use the configp_options array to find the object to populate */
+                        NULL,                                        /* Don't supply a default value */
+                        OPT_STRINGFIELD_T,                            /* Interpret the value as a character array */
+                        0,                                           /* No interpretation flags are needed */
+                        STRFLDSET(
+                                struct option_configuration, dstPath)); /* Store the value in member dstPath of option_configuration struct */
+
+    aco_option_register(&cfg_info, "host",                           /* Extract configuration item "host" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        options_mappings,                            /* Use the configp_options array to find the object to populate */
+                        "LEA-DEFAULT",                               /* Don't supply a default value */
+                        OPT_STRINGFIELD_T,                            /* Interpret the value as a character array */
+                        0,                                           /* No interpretation flags are needed */
+                        STRFLDSET(
+                                struct option_configuration, host)); /* Store the value in member dstPath of option_configuration struct */
+
+    aco_option_register(&cfg_info, "extension",                      /* Extract configuration item "host" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        options_mappings,                            /* Use the configp_options array to find the object to populate */
+                        "WAV",                                       /* Don't supply a default value */
+                        OPT_STRINGFIELD_T,                           /* Interpret the value as a character array */
+                        0,                                           /* No interpretation flags are needed */
+                        STRFLDSET(
+                                struct option_configuration, extension)); /* Store the value in member dstPath of option_configuration struct */
+
+    aco_option_register(&cfg_info, "cache_ttl",                      /* Extract configuration item "cache_ttl" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        options_mappings,                            /* Use the configp_options array to find the object to populate */
+                        "300",                                       /* supply a default value */
+                        OPT_UINT_T,                                  /* Interpret the value as an unsigned integer */
+                        0,                                           /* No interpretation flags are needed */
+                        FLDSET(
+                                struct option_configuration, cacheTtl)); /* Store the value in member cacheTtl of option_configuration struct */
+
+    aco_option_register(&cfg_info, "cache_refresh_ahead",            /* Extract configuration item "cache_refresh_ahead" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        options_mappings,                            /* Use the configp_options array to find the object to populate */
+                        "80",                                        /* supply a default value */
+                        OPT_UINT_T,                                  /* Interpret the value as an unsigned integer */
+                        PARSE_IN_RANGE,                              /* Accept values in a range */
+                        FLDSET(
+                                struct option_configuration, cacheRefreshAhead), /* Store the value in member cacheRefreshAhead of option_configuration struct */
+                        0,                                                 /* Use MIN as the minimum value of the allowed range */
+                        99);                                               /* Use MAX as the maximum value of the allowed range */
+
+    aco_option_register(&cfg_info, "cache_stale_ttl",                /* Extract configuration item "cache_stale_ttl" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        options_mappings,                            /* Use the configp_options array to find the object to populate */
+                        "30",                                        /* supply a default value */
+                        OPT_UINT_T,                                  /* Interpret the value as an unsigned integer */
+                        0,                                           /* No interpretation flags are needed */
+                        FLDSET(
+                                struct option_configuration, cacheStaleTtl)); /* Store the value in member cacheStaleTtl of option_configuration struct */
+
+    aco_option_register(&cfg_info, "cache_ttl_jitter",               /* Extract configuration item "cache_ttl_jitter" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        options_mappings,                            /* Use the configp_options array to find the object to populate */
+                        "10",                                        /* supply a default value */
+                        OPT_UINT_T,                                  /* Interpret the value as an unsigned integer */
+                        PARSE_IN_RANGE,                              /* Accept values in a range */
+                        FLDSET(
+                                struct option_configuration, cacheTtlJitter), /* Store the value in member cacheTtlJitter of option_configuration struct */
+                        0,                                                 /* Use MIN as the minimum value of the allowed range */
+                        OPTIONS_TTL_JITTER_MAX);                           /* Use MAX as the maximum value of the allowed range */
+
+    aco_option_register(&cfg_info, "shadow_sample",                  /* Extract configuration item "shadow_sample" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        options_mappings,                            /* Use the configp_options array to find the object to populate */
+                        "0",                                         /* supply a default value */
+                        OPT_DOUBLE_T,                                /* Interpret the value as a double */
+                        PARSE_IN_RANGE,                              /* Accept values in a range */
+                        FLDSET(
+                                struct option_configuration, shadowSample), /* Store the value in member shadowSample of option_configuration struct */
+                        0,                                                 /* Use MIN as the minimum value of the allowed range */
+                        1);                                                /* Use MAX as the maximum value of the allowed range */
 
+    aco_option_register(&cfg_info, "user_cps",                       /* Extract configuration item "user_cps" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        options_mappings,                            /* Use the configp_options array to find the object to populate */
+                        "0",                                         /* supply a default value */
+                        OPT_UINT_T,                                  /* Interpret the value as an unsigned integer */
+                        0,                                           /* No interpretation flags are needed */
+                        FLDSET(
+                                struct option_configuration, userCps)); /* Store the value in member userCps of option_configuration struct */
 
-    aco_option_register(&cfg_info, "dstPath",                        /* Extract configuration item "dstPath" */
+    aco_option_register(&cfg_info, "user_calls",                     /* Extract configuration item "user_calls" */
                         ACO_EXACT,                                   /* Match the exact configuration item name */
-                        options_mappings,                             /* Use the configp_options array to find the object to populate */
-                        NULL,                                        /* Don't supply a default value */
-                        OPT_STRINGFIELD_T,                            /* Interpret the value as a character array */
+                        options_mappings,                            /* Use the configp_options array to find the object to populate */
+                        "0",                                         /* supply a default value */
+                        OPT_UINT_T,                                  /* Interpret the value as an unsigned integer */
                         0,                                           /* No interpretation flags are needed */
-                        STRFLDSET(
-                                struct option_configuration, dstPath)); /* Store the value in member dstPath of option_configuration struct */
+                        FLDSET(
+                                struct option_configuration, userCalls)); /* Store the value in member userCalls of option_configuration struct */
 
-    aco_option_register(&cfg_info, "host",                           /* Extract configuration item "host" */
+    aco_option_register(&cfg_info, "tenant_cps",                     /* Extract configuration item "tenant_cps" */
                         ACO_EXACT,                                   /* Match the exact configuration item name */
                         options_mappings,                            /* Use the configp_options array to find the object to populate */
-                        "LEA-DEFAULT",                               /* Don't supply a default value */
-                        OPT_STRINGFIELD_T,                            /* Interpret the value as a character array */
+                        "0",                                         /* supply a default value */
+                        OPT_UINT_T,                                  /* Interpret the value as an unsigned integer */
                         0,                                           /* No interpretation flags are needed */
-                        STRFLDSET(
-                                struct option_configuration, host)); /* Store the value in member dstPath of option_configuration struct */
+                        FLDSET(
+                                struct option_configuration, tenantCps)); /* Store the value in member tenantCps of option_configuration struct */
 
-    aco_option_register(&cfg_info, "extension",                      /* Extract configuration item "host" */
+    aco_option_register(&cfg_info, "tenant_calls",                   /* Extract configuration item "tenant_calls" */
                         ACO_EXACT,                                   /* Match the exact configuration item name */
                         options_mappings,                            /* Use the configp_options array to find the object to populate */
-                        "WAV",                                       /* Don't supply a default value */
-                        OPT_STRINGFIELD_T,                           /* Interpret the value as a character array */
+                        "0",                                         /* supply a default value */
+                        OPT_UINT_T,                                  /* Interpret the value as an unsigned integer */
                         0,                                           /* No interpretation flags are needed */
-                        STRFLDSET(
-                                struct option_configuration, extension)); /* Store the value in member dstPath of option_configuration struct */
+                        FLDSET(
+                                struct option_configuration, tenantCalls)); /* Store the value in member tenantCalls of option_configuration struct */
+
+    aco_option_register_custom(&cfg_info, "cache_partition",         /* Extract configuration item "cache_partition" */
+                               ACO_EXACT,                            /* Match the exact configuration item name */
+                               options_mappings,                     /* Use the configp_options array to find the object to populate */
+                               "account",                            /* supply a default value */
+                               cache_partition_handler,              /* Parse account|tenant */
+                               0);                                   /* No interpretation flags are needed */
+
+    aco_option_register(&cfg_info, "cache_max_memory",               /* Extract configuration item "cache_max_memory" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        options_mappings,                            /* Use the configp_options array to find the object to populate */
+                        "0",                                         /* supply a default value */
+                        OPT_UINT_T,                                  /* Interpret the value as an unsigned integer */
+                        PARSE_IN_RANGE,                              /* Accept values in a range */
+                        FLDSET(
+                                struct option_configuration, cacheMaxMemory), /* Store the value in member cacheMaxMemory of option_configuration struct */
+                        0,                                                 /* Use MIN as the minimum value of the allowed range */
+                        OPTIONS_CACHE_MAX_MEMORY);                         /* Use MAX as the maximum value of the allowed range */
 
     aco_option_register(&cfg_info, "port",                           /* Extract configuration item "port" */
                         ACO_EXACT,                                   /* Match the exact configuration item name */
@@ -719,6 +5101,123 @@ static int loadConfiguration() {
                         0,                                                 /* Use MIN as the minimum value of the allowed range */
                         20000);                                            /* Use MAX as the maximum value of the allowed range */
 
+    aco_option_register(&cfg_info, "max_inflight",                   /* Extract configuration item "max_inflight" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        dbCredentials_mappings,                      /* Use the general_options array to find the object to populate */
+                        "8",                                         /* supply a default value */
+                        OPT_UINT_T,                                  /* Interpret the value as an unsigned integer */
+                        PARSE_IN_RANGE,                              /* Accept values in a range */
+                        FLDSET(
+                                struct database_configuration, maxInflight), /* Store the value in member maxInflight of a database_configuration struct */
+                        1,                                                 /* Use MIN as the minimum value of the allowed range */
+                        OPTIONS_DB_MAX_CONNECTIONS);                       /* Use MAX as the maximum value of the allowed range */
+
+    aco_option_register(&cfg_info, "max_queue_wait",                 /* Extract configuration item "max_queue_wait" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        dbCredentials_mappings,                      /* Use the general_options array to find the object to populate */
+                        "500",                                       /* supply a default value */
+                        OPT_UINT_T,                                  /* Interpret the value as an unsigned integer */
+                        0,                                           /* No interpretation flags are needed */
+                        FLDSET(
+                                struct database_configuration, maxQueueWait)); /* Store the value in member maxQueueWait of a database_configuration struct */
+
+    aco_option_register_custom(&cfg_info, "shed_verdict",            /* Extract configuration item "shed_verdict" */
+                               ACO_EXACT,                            /* Match the exact configuration item name */
+                               dbCredentials_mappings,               /* Use the general_options array to find the object to populate */
+                               "allow",                              /* supply a default value */
+                               shed_verdict_handler,                 /* Parse allow|hangup */
+                               0);                                   /* No interpretation flags are needed */
+
+    aco_option_register_custom(&cfg_info, "replica",                 /* Extract every configuration item "replica" */
+                               ACO_EXACT,                            /* Match the exact configuration item name */
+                               dbCredentials_mappings,               /* Use the general_options array to find the object to populate */
+                               NULL,                                 /* No replica by default */
+                               replica_handler,                      /* Parse host[:port][,weight] */
+                               0);                                   /* No interpretation flags are needed */
+
+    aco_option_register_custom(&cfg_info, "storage",                 /* Extract configuration item "storage" */
+                               ACO_EXACT,                            /* Match the exact configuration item name */
+                               dbCredentials_mappings,               /* Use the general_options array to find the object to populate */
+                               "mysql",                              /* supply a default value */
+                               storage_handler,                      /* Parse mysql|sqlite */
+                               0);                                   /* No interpretation flags are needed */
+
+    aco_option_register_custom(&cfg_info, "prefix_lookup",           /* Extract configuration item "prefix_lookup" */
+                               ACO_EXACT,                            /* Match the exact configuration item name */
+                               dbCredentials_mappings,               /* Use the general_options array to find the object to populate */
+                               "like",                               /* supply a default value */
+                               prefix_lookup_handler,                /* Parse like|candidates */
+                               0);                                   /* No interpretation flags are needed */
+
+    aco_option_register(&cfg_info, "sqlite_file",                    /* Extract configuration item "sqlite_file" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        dbCredentials_mappings,                      /* Use the general_options array to find the object to populate */
+                        "/var/lib/asterisk/options.sqlite3",         /* supply a default value */
+                        OPT_STRINGFIELD_T,                           /* Interpret the value as a character array */
+                        0,                                           /* No interpretation flags are needed */
+                        STRFLDSET(
+                                struct database_configuration, sqliteFile)); /* Store the value in member sqliteFile of a database_configuration struct */
+
+    aco_option_register(&cfg_info, "sync_interval",                  /* Extract configuration item "sync_interval" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        dbCredentials_mappings,                      /* Use the general_options array to find the object to populate */
+                        "300",                                       /* supply a default value */
+                        OPT_UINT_T,                                  /* Interpret the value as an unsigned integer */
+                        0,                                           /* No interpretation flags are needed */
+                        FLDSET(
+                                struct database_configuration, syncInterval)); /* Store the value in member syncInterval of a database_configuration struct */
+
+    aco_option_register(&cfg_info, "replica_check_interval",         /* Extract configuration item "replica_check_interval" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        dbCredentials_mappings,                      /* Use the general_options array to find the object to populate */
+                        "5",                                         /* supply a default value */
+                        OPT_UINT_T,                                  /* Interpret the value as an unsigned integer */
+                        PARSE_IN_RANGE,                              /* Accept values in a range */
+                        FLDSET(
+                                struct database_configuration, healthInterval), /* Store the value in member healthInterval of a database_configuration struct */
+                        1,                                                 /* Use MIN as the minimum value of the allowed range */
+                        3600);                                             /* Use MAX as the maximum value of the allowed range */
+
+    aco_option_register(&cfg_info, "slow_query_threshold",           /* Extract configuration item "slow_query_threshold" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        dbCredentials_mappings,                      /* Use the general_options array to find the object to populate */
+                        "100",                                       /* supply a default value */
+                        OPT_UINT_T,                                  /* Interpret the value as an unsigned integer */
+                        0,                                           /* No interpretation flags are needed */
+                        FLDSET(
+                                struct database_configuration, slowQueryThreshold)); /* Store the value in member slowQueryThreshold of a database_configuration struct */
+
+    aco_option_register(&cfg_info, "slow_query_sample",              /* Extract configuration item "slow_query_sample" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        dbCredentials_mappings,                      /* Use the general_options array to find the object to populate */
+                        "0",                                         /* supply a default value */
+                        OPT_DOUBLE_T,                                /* Interpret the value as a double */
+                        PARSE_IN_RANGE,                              /* Accept values in a range */
+                        FLDSET(
+                                struct database_configuration, slowQuerySample), /* Store the value in member slowQuerySample of a database_configuration struct */
+                        0,                                                 /* Use MIN as the minimum value of the allowed range */
+                        1);                                                /* Use MAX as the maximum value of the allowed range */
+
+    aco_option_register(&cfg_info, "slow_query_log_size",            /* Extract configuration item "slow_query_log_size" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        dbCredentials_mappings,                      /* Use the general_options array to find the object to populate */
+                        "100",                                       /* supply a default value */
+                        OPT_UINT_T,                                  /* Interpret the value as an unsigned integer */
+                        PARSE_IN_RANGE,                              /* Accept values in a range */
+                        FLDSET(
+                                struct database_configuration, slowQueryLogSize), /* Store the value in member slowQueryLogSize of a database_configuration struct */
+                        0,                                                 /* Use MIN as the minimum value of the allowed range */
+                        OPTIONS_SLOW_LOG_MAX);                             /* Use MAX as the maximum value of the allowed range */
+
+    aco_option_register(&cfg_info, "coalesce_queries",               /* Extract configuration item "coalesce_queries" */
+                        ACO_EXACT,                                   /* Match the exact configuration item name */
+                        dbCredentials_mappings,                      /* Use the general_options array to find the object to populate */
+                        "yes",                                       /* supply a default value */
+                        OPT_BOOL_T,                                  /* Interpret the value as a boolean */
+                        1,                                           /* yes and true enable it */
+                        FLDSET(
+                                struct database_configuration, coalesceQueries)); /* Store the value in member coalesceQueries of a database_configuration struct */
+
 
 
     if (aco_process_config(&cfg_info, 0)) {
@@ -749,30 +5248,70 @@ static void displayConfiguration(struct option_global *cfg) {
             "\t[DbCredentials]->dbname   = [%s]\n"
             "\t[DbCredentials]->socket   = [%s]\n"
             "\t[DbCredentials]->port     = [%d]\n"
+            "\t[DbCredentials]->max_inflight   = [%u]\n"
+            "\t[DbCredentials]->max_queue_wait = [%u]\n"
+            "\t[DbCredentials]->replicas       = [%d]\n"
+            "\t[DbCredentials]->replica_check_interval = [%u]\n"
+            "\t[DbCredentials]->storage        = [%s]\n"
+            "\t[DbCredentials]->sqlite_file    = [%s]\n"
+            "\t[DbCredentials]->sync_interval  = [%u]\n"
+            "\t[DbCredentials]->prefix_lookup  = [%s]\n"
+            "\t[DbCredentials]->slow_query_threshold = [%u]\n"
+            "\t[DbCredentials]->slow_query_sample    = [%.4f]\n"
+            "\t[DbCredentials]->slow_query_log_size  = [%u]\n"
+            "\t[DbCredentials]->coalesce_queries     = [%s]\n"
             "  == Options Configuration:\n"
             "\t[Options]->dstPath        = [%s]\n"
             "\t[Options]->host           = [%s]\n"
-            "\t[Options]->extension      = [%s]\n",
+            "\t[Options]->extension      = [%s]\n"
+            "\t[Options]->cache_ttl      = [%u]\n"
+            "\t[Options]->user_cps       = [%u]\n"
+            "\t[Options]->user_calls     = [%u]\n"
+            "\t[Options]->tenant_cps     = [%u]\n"
+            "\t[Options]->tenant_calls   = [%u]\n"
+            "\t[Options]->cache_partition  = [%s]\n"
+            "\t[Options]->cache_max_memory = [%u]\n"
+            "\t[Options]->cache_refresh_ahead = [%u]\n"
+            "\t[Options]->cache_stale_ttl  = [%u]\n"
+            "\t[Options]->cache_ttl_jitter = [%u]\n"
+            "\t[Options]->shadow_sample    = [%.4f]\n",
              cfg->dbCredentials->hostname, cfg->dbCredentials->username, cfg->dbCredentials->secret,
              cfg->dbCredentials->dbname, cfg->dbCredentials->socket,
-             cfg->dbCredentials->port, cfg->options->dstPath, cfg->options->host, cfg->options->extension
+             cfg->dbCredentials->port, cfg->dbCredentials->maxInflight, cfg->dbCredentials->maxQueueWait,
+             cfg->dbCredentials->nbEndpoints - 1, cfg->dbCredentials->healthInterval,
+             cfg->dbCredentials->storage == OPTIONS_STORAGE_SQLITE ? "sqlite" : "mysql",
+             cfg->dbCredentials->sqliteFile, cfg->dbCredentials->syncInterval,
+             cfg->dbCredentials->prefixLookup == OPTIONS_PREFIX_CANDIDATES ? "candidates" : "like",
+             cfg->dbCredentials->slowQueryThreshold, cfg->dbCredentials->slowQuerySample,
+             cfg->dbCredentials->slowQueryLogSize, cfg->dbCredentials->coalesceQueries ? "yes" : "no",
+             cfg->options->dstPath, cfg->options->host, cfg->options->extension,
+             cfg->options->cacheTtl, cfg->options->userCps, cfg->options->userCalls, cfg->options->tenantCps,
+             cfg->options->tenantCalls,
+             cfg->options->cachePartition == OPTIONS_PARTITION_TENANT ? "tenant" : "account",
+             cfg->options->cacheMaxMemory, cfg->options->cacheRefreshAhead, cfg->options->cacheStaleTtl,
+             cfg->options->cacheTtlJitter, cfg->options->shadowSample
     );
 }
 
 
 /*! \brief Connect to Mysql using database_configuraiton access */
-int MYSQL_connect(struct database_configuration *dbInfo) {
+int MYSQL_connect(struct database_configuration *dbInfo, struct options_endpoint *endpoint, MYSQL *conn) {
     my_bool reconnect = 1;
-    mysql_init(&dbInfo->conn);
-    mysql_options(&dbInfo->conn, MYSQL_OPT_RECONNECT, &reconnect);
-    if (&dbInfo->conn) {
-        if (mysql_real_connect(&dbInfo->conn, dbInfo->hostname, dbInfo->username, dbInfo->secret, dbInfo->dbname,
-                               (unsigned int) dbInfo->port, dbInfo->socket, 0)) {
+    /** Replicas share the primary credentials but are always reached over TCP **/
+    const char *hostname = endpoint->hostname ? endpoint->hostname : dbInfo->hostname;
+    int port = endpoint->hostname ? endpoint->port : dbInfo->port;
+    const char *socket = endpoint->hostname ? NULL : dbInfo->socket;
+
+    if (mysql_init(conn)) {
+        mysql_options(conn, MYSQL_OPT_RECONNECT, &reconnect);
+        if (mysql_real_connect(conn, hostname, dbInfo->username, dbInfo->secret, dbInfo->dbname,
+                               (unsigned int) port, socket, 0)) {
             return 0;
         } else {
             ast_log(LOG_WARNING, "mysql_real_connect(mysql,%s,%s,*****,%s,....) failed\n",
-                    dbInfo->hostname, dbInfo->username, dbInfo->dbname
+                    hostname, dbInfo->username, dbInfo->dbname
             );
+            mysql_close(conn);
         }
     } else {
         ast_log(LOG_WARNING, "mysql_init function returned NULL\n");
@@ -783,19 +5322,61 @@ int MYSQL_connect(struct database_configuration *dbInfo) {
 
 /*! \brief Connect to Mysql using database_configuration access */
 MYSQL_RES *MYSQL_query(MYSQL_RES *mysqlRes, int *numRows, char *querystring, struct database_configuration *dbInfo) {
+    struct options_call_state *state = options_call_state_get();
+    int shadow = state && state->active && state->shadow;
+    struct options_endpoint *endpoint;
+    unsigned int error;
+    int64_t waited, elapsed;
+    MYSQL *conn;
+    uint64_t queued = options_monotonic_us(), start;
+    char tag[AST_MAX_UNIQUEID + 64];
+    char *statement;
     ast_log(LOG_DEBUG, "--Query:[%s]\n", querystring);
     mysql_free_result(mysqlRes);
-    mysql_real_query(&dbInfo->conn, querystring, strlen(querystring));
+    /** Wait for a free slot , or give up if the database is overloaded : shadow checks take none **/
+    if (!shadow && options_admission_acquire(state)) {
+        *numRows = -1;
+        return NULL;
+    }
+    if (!(conn = options_db_checkout(dbInfo, &endpoint))) {
+        if (!shadow) {
+            options_admission_release(0);
+        }
+        *numRows = -1;
+        return NULL;
+    }
+    /** Let the database slow log and processlist point back to the call **/
+    options_slow_log_tag(state, tag, sizeof(tag));
+    statement = ast_alloca(strlen(tag) + strlen(querystring) + 1);
+    strcpy(statement, tag);
+    strcat(statement, querystring);
+    start = options_monotonic_us();
+    waited = start - queued;
+    mysql_real_query(conn, statement, strlen(statement));
     /** Check For Errors **/
-    if (mysql_errno(&dbInfo->conn)) {
+    if ((error = mysql_errno(conn))) {
         ast_log(LOG_ERROR, "Mysql return an Error (%i) : %s on MySQL query:\n[%s]\n",
-                mysql_errno(&dbInfo->conn), mysql_error(&dbInfo->conn), querystring
+                error, mysql_error(conn), statement
         );
+        elapsed = options_monotonic_us() - start;
+        options_slow_log_record(state, endpoint->hostname ? endpoint->hostname : dbInfo->hostname, querystring,
+                                waited, elapsed, -1);
+        options_db_checkin(dbInfo, endpoint, conn, elapsed, error);
+        if (!shadow) {
+            options_admission_release(elapsed);
+        }
         *numRows = -1;
         return NULL;
     }
     /** Check For Results **/
-    mysqlRes = mysql_store_result(&dbInfo->conn);
+    mysqlRes = mysql_store_result(conn);
+    elapsed = options_monotonic_us() - start;
+    options_slow_log_record(state, endpoint->hostname ? endpoint->hostname : dbInfo->hostname, querystring, waited,
+                            elapsed, mysqlRes ? (int) mysql_num_rows(mysqlRes) : 0);
+    options_db_checkin(dbInfo, endpoint, conn, elapsed, 0);
+    if (!shadow) {
+        options_admission_release(elapsed);
+    }
     if (mysqlRes) {
         *numRows = (int) mysql_num_rows(mysqlRes);
         return mysqlRes;
@@ -805,6 +5386,620 @@ MYSQL_RES *MYSQL_query(MYSQL_RES *mysqlRes, int *numRows, char *querystring, str
     }
 }
 
+/*! \brief Copy the rows of a MySQL result in one block calls can share
+ * @return NULL on memory error
+ */
+static struct options_rows *options_rows_copy(MYSQL_RES *res) {
+    int count = (int) mysql_num_rows(res);
+    int columns = (int) mysql_num_fields(res);
+    struct options_rows *rows;
+    MYSQL_ROW row;
+    size_t size = 0;
+    char *strings;
+    int i, j;
+
+    mysql_data_seek(res, 0);
+    while ((row = mysql_fetch_row(res))) {
+        for (j = 0; j < columns; j++) {
+            size += row[j] ? strlen(row[j]) + 1 : 0;
+        }
+    }
+    if (!(rows = ao2_alloc_options(sizeof(*rows) + count * columns * sizeof(rows->cells[0]) + size, NULL,
+                                   AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+        ast_log(LOG_WARNING, "Memory Error , Allocation of query rows failed!\n");
+        return NULL;
+    }
+    rows->count = count;
+    rows->columns = columns;
+    strings = (char *) &rows->cells[count * columns];
+    mysql_data_seek(res, 0);
+    for (i = 0; i < count && (row = mysql_fetch_row(res)); i++) {
+        for (j = 0; j < columns; j++) {
+            if (!row[j]) {
+                rows->cells[i * columns + j] = NULL;
+                continue;
+            }
+            rows->cells[i * columns + j] = strcpy(strings, row[j]);
+            strings += strlen(row[j]) + 1;
+        }
+    }
+    return rows;
+}
+
+/*! \brief Columns of a row , as mysql_fetch_row() would return them */
+static MYSQL_ROW options_rows_fetch(struct options_rows *rows, int row) {
+    return &rows->cells[row * rows->columns];
+}
+
+/*! \brief Release a flight once its leader and every waiter are done with it */
+static void options_flight_destructor(void *obj) {
+    struct options_flight *flight = obj;
+
+    ao2_cleanup(flight->rows);
+    ast_cond_destroy(&flight->cond);
+}
+
+/*! \brief Run a lookup on MySQL , or wait for the identical lookup another call is running
+ * Lookups are identical when their statements , parameters included , are. Rows are only shared with the calls
+ * that waited for them : nothing is kept once the query is answered.
+ * @param previous rows of a previous lookup , released
+ * @param numRows receives the number of rows , -1 on error
+ * @return NULL if no row or on error , rows to release with ao2_cleanup otherwise
+ */
+static struct options_rows *options_query(struct options_rows *previous, int *numRows, char *querystring,
+                                          struct database_configuration *dbInfo) {
+    struct options_flight *flight = NULL;
+    struct options_rows *rows = NULL;
+    struct options_call_state *state;
+    struct timeval start = ast_tvnow();
+    struct timespec deadline;
+    unsigned int hash;
+    int bucket, shed;
+    MYSQL_RES *res;
+
+    ao2_cleanup(previous);
+    hash = (unsigned int) ast_str_hash(querystring);
+    bucket = hash & (OPTIONS_FLIGHT_BUCKETS - 1);
+    /** Shadow checks neither wait for live calls nor make them wait **/
+    state = options_call_state_get();
+    if (optionsFlights.enabled && !(state && state->active && state->shadow)) {
+        ast_mutex_lock(&optionsFlights.lock);
+        AST_LIST_TRAVERSE(&optionsFlights.buckets[bucket], flight, list) {
+            if (flight->hash == hash && !strcmp(flight->sql, querystring)) {
+                break;
+            }
+        }
+        if (flight) {
+            /** Same statement already sent : wait for its rows **/
+            ao2_ref(flight, +1);
+            flight->waiters++;
+            optionsFlights.coalesced++;
+            optionsFlights.maxWaiters = MAX(optionsFlights.maxWaiters, flight->waiters);
+            /** Waiting for another call counts against max_queue_wait like waiting for a slot **/
+            while (!flight->done) {
+                options_admission_deadline(start, &deadline);
+                if (ast_cond_timedwait(&flight->cond, &optionsFlights.lock, &deadline) == ETIMEDOUT) {
+                    break;
+                }
+            }
+            if (!flight->done || flight->numRows < 0) {
+                optionsFlights.failed++;
+            }
+            /** A call not answered in time , or waiting on a shed one , is shed too **/
+            shed = !flight->done || flight->shed;
+            *numRows = flight->done ? flight->numRows : -1;
+            rows = flight->done ? ao2_bump(flight->rows) : NULL;
+            ast_mutex_unlock(&optionsFlights.lock);
+            ao2_ref(flight, -1);
+            if (shed && state && state->active && !state->shed) {
+                state->shed = 1;
+                ast_mutex_lock(&optionsAdmission.lock);
+                optionsAdmission.shed++;
+                ast_mutex_unlock(&optionsAdmission.lock);
+            }
+            return rows;
+        }
+        if ((flight = ao2_alloc_options(sizeof(*flight) + strlen(querystring) + 1, options_flight_destructor,
+                                        AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+            flight->hash = hash;
+            strcpy(flight->sql, querystring);
+            ast_cond_init(&flight->cond, NULL);
+            AST_LIST_INSERT_HEAD(&optionsFlights.buckets[bucket], flight, list);
+            optionsFlights.inflight++;
+        }
+        ast_mutex_unlock(&optionsFlights.lock);
+    }
+    ast_atomic_fetchadd_int(&optionsFlights.leaders, 1);
+
+    res = MYSQL_query(NULL, numRows, querystring, dbInfo);
+    if (res && !(rows = options_rows_copy(res))) {
+        *numRows = -1;
+    }
+    mysql_free_result(res);
+
+    if (flight) {
+        ast_mutex_lock(&optionsFlights.lock);
+        AST_LIST_REMOVE(&optionsFlights.buckets[bucket], flight, list);
+        optionsFlights.inflight--;
+        flight->done = 1;
+        flight->numRows = *numRows;
+        flight->shed = *numRows < 0 && state && state->active && state->shed;
+        flight->rows = ao2_bump(rows);
+        ast_cond_broadcast(&flight->cond);
+        ast_mutex_unlock(&optionsFlights.lock);
+        ao2_ref(flight, -1);
+    }
+    return rows;
+}
+
+/*! \brief CLI command "options coalescing show" */
+static char *handle_cli_coalescing_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    int leaders, coalesced;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options coalescing show";
+            e->usage =
+                    "Usage: options coalescing show\n"
+                    "       Display how many lookups were sent to MySQL and how many waited for\n"
+                    "       an identical lookup of another call instead.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 3) {
+        return CLI_SHOWUSAGE;
+    }
+    leaders = optionsFlights.leaders;
+    coalesced = optionsFlights.coalesced;
+    ast_cli(a->fd, "  == Options Query Coalescing:\n"
+                   "\tEnabled        = [%s]\n"
+                   "\tIn flight      = [%d]\n"
+                   "\tSent           = [%d]\n"
+                   "\tCoalesced      = [%d] (%.1f%%)\n"
+                   "\tFailed         = [%d]\n"
+                   "\tMax waiters    = [%d]\n",
+            optionsFlights.enabled ? "yes" : "no", optionsFlights.inflight, leaders, coalesced,
+            leaders + coalesced ? 100.0 * coalesced / (leaders + coalesced) : 0.0, optionsFlights.failed,
+            optionsFlights.maxWaiters);
+    return CLI_SUCCESS;
+}
+
+/*! \brief Build the comment put in front of a statement : uniqueid and stage of the query
+ * Only characters that can't end the comment are copied from the uniqueid
+ */
+static void options_slow_log_tag(const struct options_call_state *state, char *tag, size_t size) {
+    char uniqueid[AST_MAX_UNIQUEID] = "-";
+    const char *src;
+    char *dst = uniqueid;
+
+    if (state && state->active && !ast_strlen_zero(state->uniqueid)) {
+        for (src = state->uniqueid; *src && dst < uniqueid + sizeof(uniqueid) - 1; src++) {
+            if (isalnum((unsigned char) *src) || *src == '.' || *src == '-' || *src == '_') {
+                *dst++ = *src;
+            }
+        }
+        *dst = '\0';
+    }
+    snprintf(tag, size, "/* %s %s */ ", uniqueid, (state && state->stage) ? state->stage : "-");
+}
+
+/*! \brief Keep a query in the slow log if it is over the threshold or picked by sampling
+ * @param waitTime microseconds waited for an admission slot
+ * @param queryTime microseconds spent running the query
+ * @param rows rows returned , -1 on error
+ */
+static void options_slow_log_record(const struct options_call_state *state, const char *endpoint, const char *sql,
+                                    int64_t waitTime, int64_t queryTime, int rows) {
+    struct options_slow_query *entry;
+    int slow, sampled;
+
+    ast_atomic_fetchadd_int(&optionsSlowLog.queries, 1);
+    slow = optionsSlowLog.threshold && waitTime + queryTime >= (int64_t) optionsSlowLog.threshold * 1000;
+    sampled = !slow && optionsSlowLog.sample > 0 && (double) ast_random() / RAND_MAX < optionsSlowLog.sample;
+    if (!slow && !sampled) {
+        return;
+    }
+    ast_atomic_fetchadd_int(slow ? &optionsSlowLog.slow : &optionsSlowLog.sampled, 1);
+
+    ast_mutex_lock(&optionsSlowLog.lock);
+    if (!optionsSlowLog.entries) {
+        ast_mutex_unlock(&optionsSlowLog.lock);
+        return;
+    }
+    entry = &optionsSlowLog.entries[optionsSlowLog.next];
+    optionsSlowLog.next = (optionsSlowLog.next + 1) % optionsSlowLog.size;
+    optionsSlowLog.count = MIN(optionsSlowLog.count + 1, optionsSlowLog.size);
+    entry->when = time(NULL);
+    ast_copy_string(entry->uniqueid, (state && state->active) ? state->uniqueid : "", sizeof(entry->uniqueid));
+    entry->stage = (state && state->stage) ? state->stage : "-";
+    ast_copy_string(entry->endpoint, S_OR(endpoint, "localhost"), sizeof(entry->endpoint));
+    entry->waitTime = waitTime;
+    entry->queryTime = queryTime;
+    entry->rows = rows;
+    entry->sampled = sampled;
+    ast_copy_string(entry->sql, sql, sizeof(entry->sql));
+    ast_mutex_unlock(&optionsSlowLog.lock);
+    if (slow) {
+        ast_log(LOG_DEBUG, "-- %s : Slow query at stage %s , %ld us waiting and %ld us running\n",
+                S_OR(entry->uniqueid, "-"), entry->stage, (long) waitTime, (long) queryTime);
+    }
+}
+
+/*! \brief Apply slow log settings , entries are dropped when its size changes */
+static void options_slow_log_configure(unsigned int threshold, double sample, unsigned int size) {
+    struct options_slow_query *entries = NULL;
+
+    ast_mutex_lock(&optionsSlowLog.lock);
+    optionsSlowLog.threshold = threshold;
+    optionsSlowLog.sample = sample;
+    if (size != optionsSlowLog.size || !optionsSlowLog.entries) {
+        if (size && !(entries = ast_calloc(size, sizeof(*entries)))) {
+            size = 0;
+        }
+        ast_free(optionsSlowLog.entries);
+        optionsSlowLog.entries = entries;
+        optionsSlowLog.size = size;
+        optionsSlowLog.next = 0;
+        optionsSlowLog.count = 0;
+    }
+    ast_mutex_unlock(&optionsSlowLog.lock);
+}
+
+/*! \brief CLI command "options show slowqueries" */
+static char *handle_cli_show_slowqueries(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    struct options_slow_query *entry;
+    struct tm tm;
+    char when[32];
+    unsigned int i, max = OPTIONS_SLOW_LOG_MAX;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options show slowqueries";
+            e->usage =
+                    "Usage: options show slowqueries [<count>]\n"
+                    "       Display the last queries over slow_query_threshold , and those picked by\n"
+                    "       slow_query_sample (flagged with *) , newest first.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc > 4 || (a->argc == 4 && ast_parse_arg(a->argv[3], PARSE_UINT32, &max))) {
+        return CLI_SHOWUSAGE;
+    }
+    ast_cli(a->fd, "  == Options Slow Queries:\n"
+                   "\tThreshold      = [%u ms]\n"
+                   "\tSample         = [%.4f]\n"
+                   "\tQueries        = [%d]\n"
+                   "\tSlow           = [%d]\n"
+                   "\tSampled        = [%d]\n",
+            optionsSlowLog.threshold, optionsSlowLog.sample, optionsSlowLog.queries, optionsSlowLog.slow,
+            optionsSlowLog.sampled);
+    ast_cli(a->fd, "%-15s  %-32s %-16s %-20s %10s %10s %6s  %s\n", "Time", "UniqueID", "Stage", "Endpoint",
+            "Wait(ms)", "Query(ms)", "Rows", "Statement");
+    ast_mutex_lock(&optionsSlowLog.lock);
+    for (i = 0; i < optionsSlowLog.count && i < max; i++) {
+        entry = &optionsSlowLog.entries[(optionsSlowLog.next + optionsSlowLog.size - 1 - i) % optionsSlowLog.size];
+        localtime_r(&entry->when, &tm);
+        strftime(when, sizeof(when), DATE_FORMAT, &tm);
+        ast_cli(a->fd, "%-15s%c %-32s %-16s %-20s %10.3f %10.3f %6d  %s\n", when, entry->sampled ? '*' : ' ',
+                S_OR(entry->uniqueid, "-"), entry->stage, entry->endpoint, entry->waitTime / 1000.0,
+                entry->queryTime / 1000.0, entry->rows, entry->sql);
+    }
+    ast_mutex_unlock(&optionsSlowLog.lock);
+    return CLI_SUCCESS;
+}
+
+/*! \brief Parse a "replica = host[:port][,weight]" line of [general] */
+static int replica_handler(const struct aco_option *opt, struct ast_variable *var, void *obj) {
+    struct database_configuration *dbInfo = obj;
+    struct options_endpoint *endpoint;
+    char *value = ast_strdupa(var->value);
+    char *host, *port, *weight;
+
+    if (dbInfo->nbEndpoints >= OPTIONS_DB_MAX_ENDPOINTS) {
+        ast_log(LOG_ERROR, "Too many replicas , at most %d are supported\n", OPTIONS_DB_MAX_ENDPOINTS - 1);
+        return -1;
+    }
+    endpoint = &dbInfo->endpoints[dbInfo->nbEndpoints];
+    host = ast_strip(strsep(&value, ","));
+    weight = value ? ast_strip(value) : NULL;
+    if ((port = strrchr(host, ':'))) {
+        *port++ = '\0';
+    }
+    endpoint->port = 3306;
+    endpoint->weight = 1;
+    if (ast_strlen_zero(host)
+        || (port && ast_parse_arg(port, PARSE_INT32 | PARSE_IN_RANGE, &endpoint->port, 1, 65535))
+        || (weight && ast_parse_arg(weight, PARSE_UINT32 | PARSE_IN_RANGE, &endpoint->weight, 1, 100))) {
+        ast_log(LOG_ERROR, "Invalid replica '%s' , expected host[:port][,weight]\n", var->value);
+        return -1;
+    }
+    if (!(endpoint->hostname = ast_strdup(host))) {
+        return -1;
+    }
+    dbInfo->nbEndpoints++;
+    return 0;
+}
+
+/*! \brief Draw a replica among candidates , each with a chance proportional to its weight */
+static struct options_endpoint *options_endpoint_draw(struct options_endpoint **candidates, int count,
+                                                      unsigned int totalWeight) {
+    unsigned int draw = ast_random() % totalWeight;
+    int i;
+
+    for (i = 0; i < count - 1 && draw >= candidates[i]->weight; i++) {
+        draw -= candidates[i]->weight;
+    }
+    return candidates[i];
+}
+
+/*! \brief Pick the endpoint a read should go to
+ * Two healthy replicas are drawn according to their weight and the one with the lowest latency per weight unit
+ * wins , so reads spread over replicas instead of piling onto the fastest one. The primary is the fallback.
+ * \note poolLock must be held
+ */
+static struct options_endpoint *options_endpoint_pick(struct database_configuration *dbInfo, unsigned int skip) {
+    struct options_endpoint *candidates[OPTIONS_DB_MAX_ENDPOINTS];
+    struct options_endpoint *first, *second;
+    unsigned int totalWeight = 0;
+    int count = 0;
+    int i;
+
+    for (i = 1; i < dbInfo->nbEndpoints; i++) {
+        if (!dbInfo->endpoints[i].healthy || (skip & (1U << i))) {
+            continue;
+        }
+        candidates[count++] = &dbInfo->endpoints[i];
+        totalWeight += dbInfo->endpoints[i].weight;
+    }
+    if (!count) {
+        return &dbInfo->endpoints[0];
+    }
+    first = options_endpoint_draw(candidates, count, totalWeight);
+    second = options_endpoint_draw(candidates, count, totalWeight);
+    return second->latency / second->weight < first->latency / first->weight ? second : first;
+}
+
+/*! \brief Take a free connection from the best endpoint pool , opening it if needed
+ * Admission control keeps the number of callers below the pool size , the shadow thread uses the extra connection
+ * @return NULL if no connection could be opened , even on the primary
+ */
+static MYSQL *options_db_checkout(struct database_configuration *dbInfo, struct options_endpoint **endpoint) {
+    struct options_endpoint *candidate;
+    struct options_dbconn *slot;
+    unsigned int skip = 0;
+    int i;
+
+    for (;;) {
+        slot = NULL;
+        ast_mutex_lock(&dbInfo->poolLock);
+        candidate = options_endpoint_pick(dbInfo, skip);
+        for (i = 0; i < OPTIONS_DB_POOL_SIZE; i++) {
+            if (!candidate->pool[i].busy && (candidate->pool[i].conn || !slot)) {
+                slot = &candidate->pool[i];
+                if (slot->conn) {
+                    break;
+                }
+            }
+        }
+        if (slot) {
+            slot->busy = 1;
+        }
+        ast_mutex_unlock(&dbInfo->poolLock);
+
+        if (slot && !slot->conn) {
+            if (!(slot->conn = ast_calloc(1, sizeof(*slot->conn))) || MYSQL_connect(dbInfo, candidate, slot->conn)) {
+                ast_free(slot->conn);
+                ast_mutex_lock(&dbInfo->poolLock);
+                slot->conn = NULL;
+                slot->busy = 0;
+                candidate->errors++;
+                if (candidate != &dbInfo->endpoints[0]) {
+                    candidate->healthy = 0;
+                }
+                ast_mutex_unlock(&dbInfo->poolLock);
+                slot = NULL;
+            }
+        }
+        if (slot) {
+            *endpoint = candidate;
+            return slot->conn;
+        }
+        if (candidate == &dbInfo->endpoints[0]) {
+            ast_log(LOG_WARNING, "No usable database connection!\n");
+            return NULL;
+        }
+        /** Try the next replica , the primary comes last **/
+        skip |= 1U << (candidate - dbInfo->endpoints);
+    }
+}
+
+/*! \brief Give a connection back to its endpoint pool and account for the query
+ * A client side error (2000 and above) means the server is gone , a replica then leaves the rotation
+ */
+static void options_db_checkin(struct database_configuration *dbInfo, struct options_endpoint *endpoint, MYSQL *conn,
+                               int64_t latency, unsigned int error) {
+    int i;
+
+    ast_mutex_lock(&dbInfo->poolLock);
+    for (i = 0; i < OPTIONS_DB_POOL_SIZE; i++) {
+        if (endpoint->pool[i].conn == conn) {
+            endpoint->pool[i].busy = 0;
+            break;
+        }
+    }
+    if (latency) {
+        endpoint->queries++;
+    }
+    if (error) {
+        endpoint->errors++;
+        if (error >= 2000 && endpoint != &dbInfo->endpoints[0] && endpoint->healthy) {
+            ast_log(LOG_WARNING, "Replica %s:%d lost , reads go to other endpoints\n",
+                    endpoint->hostname, endpoint->port);
+            endpoint->healthy = 0;
+        }
+    } else if (latency) {
+        endpoint->latency = endpoint->latency
+                            ? OPTIONS_EWMA_ALPHA * latency + (1 - OPTIONS_EWMA_ALPHA) * endpoint->latency
+                            : latency;
+    }
+    ast_mutex_unlock(&dbInfo->poolLock);
+}
+
+/*! \brief Ping every replica , bringing it back into or taking it out of the rotation */
+static void options_health_check(struct database_configuration *dbInfo) {
+    struct options_endpoint *endpoint;
+    struct timeval start;
+    int64_t latency = 0;
+    int i, alive;
+
+    for (i = 1; i < dbInfo->nbEndpoints; i++) {
+        endpoint = &dbInfo->endpoints[i];
+        /** healthConn is only touched by this thread , no lock needed while talking to the server **/
+        if (endpoint->healthConn && mysql_ping(endpoint->healthConn)) {
+            mysql_close(endpoint->healthConn);
+            ast_free(endpoint->healthConn);
+            endpoint->healthConn = NULL;
+        }
+        if (!endpoint->healthConn) {
+            if (!(endpoint->healthConn = ast_calloc(1, sizeof(*endpoint->healthConn)))
+                || MYSQL_connect(dbInfo, endpoint, endpoint->healthConn)) {
+                ast_free(endpoint->healthConn);
+                endpoint->healthConn = NULL;
+            }
+        }
+        if ((alive = endpoint->healthConn != NULL)) {
+            start = ast_tvnow();
+            alive = !mysql_ping(endpoint->healthConn);
+            latency = ast_tvdiff_us(ast_tvnow(), start);
+        }
+
+        ast_mutex_lock(&dbInfo->poolLock);
+        if (alive) {
+            if (!endpoint->healthy) {
+                ast_log(LOG_NOTICE, "Replica %s:%d is healthy , reads may use it\n", endpoint->hostname,
+                        endpoint->port);
+            }
+            endpoint->healthy = 1;
+            endpoint->latency = endpoint->latency
+                                ? OPTIONS_EWMA_ALPHA * latency + (1 - OPTIONS_EWMA_ALPHA) * endpoint->latency
+                                : latency;
+        } else {
+            if (endpoint->healthy) {
+                ast_log(LOG_WARNING, "Replica %s:%d failed its health check\n", endpoint->hostname,
+                        endpoint->port);
+            }
+            endpoint->healthy = 0;
+        }
+        ast_mutex_unlock(&dbInfo->poolLock);
+    }
+}
+
+/*! \brief Check replicas every replica_check_interval seconds , or right after a reload */
+static void *options_health_thread(void *data) {
+    struct option_global *cfg;
+    unsigned int interval;
+    struct timespec wake;
+
+    ast_mutex_lock(&optionsHealth.lock);
+    while (!optionsHealth.stop) {
+        ast_mutex_unlock(&optionsHealth.lock);
+        interval = 5;
+        if ((cfg = ao2_global_obj_ref(options_globals))) {
+            if (cfg->dbCredentials) {
+                options_health_check(cfg->dbCredentials);
+                interval = cfg->dbCredentials->healthInterval;
+            }
+            ao2_ref(cfg, -1);
+        }
+        ast_mutex_lock(&optionsHealth.lock);
+        if (!optionsHealth.stop) {
+            wake.tv_sec = ast_tvnow().tv_sec + interval;
+            wake.tv_nsec = 0;
+            ast_cond_timedwait(&optionsHealth.cond, &optionsHealth.lock, &wake);
+        }
+    }
+    ast_mutex_unlock(&optionsHealth.lock);
+    return NULL;
+}
+
+/*! \brief Start the replica health checker */
+static int options_health_start(void) {
+    ast_cond_init(&optionsHealth.cond, NULL);
+    optionsHealth.stop = 0;
+    if (ast_pthread_create_background(&optionsHealth.thread, NULL, options_health_thread, NULL)) {
+        ast_log(LOG_ERROR, "Unable to start replica health checker\n");
+        optionsHealth.thread = AST_PTHREADT_NULL;
+        ast_cond_destroy(&optionsHealth.cond);
+        return -1;
+    }
+    return 0;
+}
+
+/*! \brief Stop the replica health checker , if running */
+static void options_health_stop(void) {
+    pthread_t thread;
+
+    ast_mutex_lock(&optionsHealth.lock);
+    thread = optionsHealth.thread;
+    optionsHealth.stop = 1;
+    if (thread != AST_PTHREADT_NULL) {
+        ast_cond_signal(&optionsHealth.cond);
+    }
+    ast_mutex_unlock(&optionsHealth.lock);
+    if (thread == AST_PTHREADT_NULL) {
+        return;
+    }
+    pthread_join(thread, NULL);
+    ast_mutex_lock(&optionsHealth.lock);
+    optionsHealth.thread = AST_PTHREADT_NULL;
+    ast_mutex_unlock(&optionsHealth.lock);
+    ast_cond_destroy(&optionsHealth.cond);
+}
+
+/*! \brief CLI command "options replicas show" */
+static char *handle_cli_replicas_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    RAII_VAR(struct option_global *, cfg, NULL, ao2_cleanup);
+    struct database_configuration *dbInfo;
+    struct options_endpoint endpoint;
+    char address[160];
+    int i;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "options replicas show";
+            e->usage =
+                    "Usage: options replicas show\n"
+                    "       Display database endpoints with their health , latency and query counts.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 3) {
+        return CLI_SHOWUSAGE;
+    }
+    if (!(cfg = ao2_global_obj_ref(options_globals)) || !(dbInfo = cfg->dbCredentials)) {
+        return CLI_FAILURE;
+    }
+    ast_cli(a->fd, "%-32s %-8s %-6s %-9s %-12s %-12s %-8s\n",
+            "Endpoint", "Role", "Weight", "State", "Latency(us)", "Queries", "Errors");
+    for (i = 0; i < dbInfo->nbEndpoints; i++) {
+        ast_mutex_lock(&dbInfo->poolLock);
+        endpoint = dbInfo->endpoints[i];
+        ast_mutex_unlock(&dbInfo->poolLock);
+        if (i) {
+            snprintf(address, sizeof(address), "%s:%d", endpoint.hostname, endpoint.port);
+        } else {
+            snprintf(address, sizeof(address), "%s:%d", dbInfo->hostname, dbInfo->port);
+        }
+        ast_cli(a->fd, "%-32s %-8s %-6u %-9s %-12lu %-12lu %-8lu\n",
+                address, i ? "replica" : "primary", endpoint.weight, endpoint.healthy ? "healthy" : "down",
+                (unsigned long) endpoint.latency, (unsigned long) endpoint.queries, (unsigned long) endpoint.errors);
+    }
+    return CLI_SUCCESS;
+}
+
 /*! \brief Check if string contains only digits
  *  \returns
  *  0 => success
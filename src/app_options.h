@@ -12,11 +12,41 @@
 
 #include "asterisk/config.h"
 #include "asterisk/config_options.h"
+#include "asterisk/datastore.h"
 #include "mysql.h"
+#include <sqlite3.h>
 
 
 #define DEBUG_OPTIONS 1
 #define DATE_FORMAT "%Y%m%d-%H%M%S"
+#define OPTIONS_CACHE_LINE 64
+#define OPTIONS_ACCOUNT_STRIPES 64                                          /*< Must be a power of two */
+#define OPTIONS_ACCOUNT_STRIPE_SHIFT 26                                     /*< 32 - log2(OPTIONS_ACCOUNT_STRIPES) */
+#define OPTIONS_SLOT_FREE -1
+#define OPTIONS_SLOT_DELETED -2
+#define OPTIONS_DB_MAX_CONNECTIONS 64                                       /*< Upper bound of max_inflight */
+#define OPTIONS_DB_POOL_SIZE (OPTIONS_DB_MAX_CONNECTIONS + 1)               /*< One more for shadow checks , outside admission control */
+#define OPTIONS_DB_MAX_ENDPOINTS 9                                          /*< Primary and up to 8 read replicas */
+#define OPTIONS_EWMA_ALPHA 0.2                                              /*< Weight of the last latency sample */
+#define OPTIONS_LIMIT_SHARDS 64                                             /*< Must be a power of two */
+#define OPTIONS_LIMIT_SHARD_SHIFT 26                                        /*< 32 - log2(OPTIONS_LIMIT_SHARDS) */
+#define OPTIONS_LIMIT_SHARD_SLOTS 512                                       /*< Must be a power of two */
+#define OPTIONS_LIMIT_PROBES 16                                             /*< Slots tried before giving up on a full shard */
+#define OPTIONS_LIMIT_KEY_RELEASED -1                                       /*< Bucket freed on reload , probes go past it */
+#define OPTIONS_SLOW_LOG_MAX 10000                                          /*< Upper bound of slow_query_log_size */
+#define OPTIONS_SLOW_LOG_SQL 256                                            /*< Characters of a statement kept in the slow log */
+#define OPTIONS_TENANT_CLOCKS 1024                                          /*< Must be a power of two */
+#define OPTIONS_TENANT_CLOCK_SHIFT 22                                       /*< 32 - log2(OPTIONS_TENANT_CLOCKS) */
+#define OPTIONS_CACHE_MAX_MEMORY 2047                                       /*< Upper bound of cache_max_memory (MB) */
+#define OPTIONS_FLIGHT_BUCKETS 64                                           /*< Must be a power of two */
+#define OPTIONS_REFRESH_QUEUE 4096                                          /*< Background refreshes waiting at most */
+#define OPTIONS_TTL_JITTER_MAX 50                                           /*< Upper bound of cache_ttl_jitter (percent) */
+#define OPTIONS_INTERN_SWEEP_INTERVAL 300                                   /*< Seconds between two sweeps of unused interned strings */
+#define OPTIONS_STORAGE_CACHE_TTL 86400                                     /*< Seconds entries read from SQLite live with cache_ttl 0 */
+#define OPTIONS_CAPTURE_MAGIC "OPTCAP01"                                    /*< First 8 bytes of a capture file */
+#define OPTIONS_CAPTURE_FIELD_MAX 255                                       /*< Longer captured strings are truncated */
+#define OPTIONS_SHADOW_QUEUE 1024                                           /*< Shadow checks waiting at most */
+#define OPTIONS_SHADOW_SCALE 1000000                                        /*< shadow_sample is kept in parts per million */
 
 
 
@@ -31,6 +61,49 @@ static const char app_configfile[] = "options.conf";
  * Structures
  */
 
+/*! \brief Verdict applied to calls whose lookups waited too long for the database */
+enum options_shed_verdict {
+    OPTIONS_SHED_ALLOW,                                                     /*< Skip remaining options , let the call go */
+    OPTIONS_SHED_HANGUP,                                                    /*< Hangup the call */
+};
+
+/*! \brief Where lookups read their data from */
+enum options_storage_type {
+    OPTIONS_STORAGE_MYSQL,                                                  /*< The MySQL primary and its replicas */
+    OPTIONS_STORAGE_SQLITE,                                                 /*< A local file , filled from MySQL by the sync job */
+};
+
+/*! \brief How lookups without cache match a number against prefix tables */
+enum options_prefix_lookup {
+    OPTIONS_PREFIX_LIKE,                                                    /*< number LIKE CONCAT(prefix,'%') , scans the table */
+    OPTIONS_PREFIX_CANDIDATES,                                              /*< prefix IN (leading substrings of number) , uses an index */
+};
+
+/*! \brief How accounts missing from the cache are loaded */
+enum options_cache_partition {
+    OPTIONS_PARTITION_ACCOUNT,                                              /*< One account at a time */
+    OPTIONS_PARTITION_TENANT,                                               /*< Every account of its tenant at once */
+};
+
+/*! \brief One pooled database connection */
+struct options_dbconn {
+    MYSQL *conn;                                                            /*< NULL until first used */
+    int busy;
+};
+
+/*! \brief A database server lookups can be sent to */
+struct options_endpoint {
+    char *hostname;                                                         /*< NULL for the primary , see database_configuration */
+    int port;
+    unsigned int weight;                                                    /*< Higher weight attracts more reads */
+    int healthy;
+    double latency;                                                         /*< Moving average in microseconds */
+    uint64_t queries;
+    uint64_t errors;
+    MYSQL *healthConn;                                                      /*< Used by health checks only */
+    struct options_dbconn pool[OPTIONS_DB_POOL_SIZE];                       /*< Connections , opened on demand */
+};
+
 /*! \brief database_configuration parameter structure
  */
 struct database_configuration {
@@ -40,9 +113,23 @@ struct database_configuration {
             AST_STRING_FIELD(secret);
             AST_STRING_FIELD(dbname);
             AST_STRING_FIELD(socket);
+            AST_STRING_FIELD(sqliteFile);
     );
-    MYSQL conn ;
+    ast_mutex_t poolLock;                                                   /*< Protects endpoints pools and statistics */
+    struct options_endpoint endpoints[OPTIONS_DB_MAX_ENDPOINTS];            /*< Primary first , then read replicas */
+    int nbEndpoints;
+    unsigned int healthInterval;                                            /*< Seconds between replica health checks */
     int port;
+    unsigned int maxInflight;                                               /*< Concurrent queries allowed */
+    unsigned int maxQueueWait;                                              /*< Milliseconds a query may wait for a slot */
+    int shedVerdict;                                                        /*< enum options_shed_verdict */
+    int storage;                                                            /*< enum options_storage_type */
+    unsigned int syncInterval;                                              /*< Seconds between two SQLite syncs , 0 for none */
+    unsigned int slowQueryThreshold;                                        /*< Milliseconds , 0 to only keep sampled queries */
+    double slowQuerySample;                                                 /*< Fraction of faster queries kept in the slow log */
+    unsigned int slowQueryLogSize;                                          /*< Entries kept in the slow log */
+    int prefixLookup;                                                       /*< enum options_prefix_lookup */
+    int coalesceQueries;                                                    /*< Identical concurrent lookups share one query */
 };
 
 /*! \brief option_configuration parameters structure
@@ -53,6 +140,17 @@ struct option_configuration {
             AST_STRING_FIELD(host);
             AST_STRING_FIELD(extension);
     );
+    unsigned int cacheTtl;                                                  /*< Lifetime of cached lookup data (seconds) */
+    unsigned int userCps;                                                   /*< Calls per second of an UserID , 0 for no limit */
+    unsigned int userCalls;                                                 /*< Concurrent calls of an UserID , 0 for no limit */
+    unsigned int tenantCps;                                                 /*< Calls per second of a TenantID , 0 for no limit */
+    unsigned int tenantCalls;                                               /*< Concurrent calls of a TenantID , 0 for no limit */
+    int cachePartition;                                                     /*< enum options_cache_partition */
+    unsigned int cacheMaxMemory;                                            /*< MB held by cached accounts , 0 for no ceiling */
+    unsigned int cacheRefreshAhead;                                         /*< Percent of the lifetime after which used data is reloaded , 0 disables */
+    unsigned int cacheStaleTtl;                                             /*< Seconds expired data is still served while reloaded */
+    unsigned int cacheTtlJitter;                                            /*< Percent lifetimes are spread by */
+    double shadowSample;                                                    /*< Fraction of cached calls checked again on MySQL */
 };
 
 /*! \brief All configuration objects for this module
@@ -62,6 +160,569 @@ struct option_global {
     struct option_configuration *options;                                   /*< Our options configuration    */
 };
 
+/*! \brief One row of a cached prefix table (prefix_in, blocked_prefix_group, blocked_prefix_user) */
+struct options_prefix_rule {
+    const char *prefix;                                                     /*< Interned */
+    const char *newPrefix;                                                  /*< Interned */
+    int digitDelete;
+};
+
+/*! \brief Cached prefix rules owned by a tenant (prefix_in) or by a group (blocked_prefix_group) */
+struct options_prefix_set {
+    int id;                                                                 /*< TenantID or GroupID */
+    time_t expires;                                                         /*< Reloaded from database after this date */
+    time_t refresh;                                                         /*< Reloaded in background when used after this date */
+    int count;
+    struct options_prefix_rule rules[0];
+};
+
+/*! \brief Variable-size part of a cached account , shared read-only once loaded */
+struct options_account_extra {
+    int nbGroups;
+    int *groups;                                                            /*< Distinct GroupIDs */
+    int nbBlocked;
+    struct options_prefix_rule *blocked;                                    /*< blocked_prefix_user rows */
+    int nbDids;
+    const char **dids;                                                      /*< Interned dids assigned through didToUser */
+};
+
+/*! \brief Cached per-account data (users, options, group_user, group_agent, blocked_prefix_user, dids)
+ * Fixed-size and one cache line long : stored by value in the account table and copied out to callers
+ */
+struct options_account {
+    int userId;                                                             /*< OPTIONS_SLOT_FREE|DELETED in an empty slot */
+    int tenantId;
+    int found;                                                              /*< users row exists */
+    int hasOptions;                                                         /*< options row exists */
+    int cidIsAcode;
+    int monitored;
+    int rcli;
+    int groupCount;                                                         /*< Number of group_user rows */
+    int groupMonitored;                                                     /*< Number of monitored group_agent rows */
+    time_t expires;                                                         /*< Reloaded from database after this date */
+    time_t refresh;                                                         /*< Reloaded in background when used after this date */
+    struct options_account_extra *extra;
+} __attribute__((aligned(OPTIONS_CACHE_LINE)));
+
+/*! \brief One lock stripe of the account table : an open addressing hash table of its own */
+struct options_account_stripe {
+    ast_rwlock_t lock;
+    unsigned int size;                                                      /*< Number of slots , a power of two */
+    unsigned int used;                                                      /*< Live and deleted slots */
+    unsigned int count;                                                     /*< Live slots */
+    struct options_account *slots;
+    char *mem;                                                              /*< Unaligned allocation of slots */
+} __attribute__((aligned(OPTIONS_CACHE_LINE)));
+
+/*! \brief Accounts by UserID , striped so channel threads only contend on the same stripe */
+struct options_account_table {
+    struct options_account_stripe stripes[OPTIONS_ACCOUNT_STRIPES];
+    char *mem;                                                              /*< Unaligned allocation of the table */
+};
+
+/*! \brief State of one reader thread of the cache benchmark */
+struct options_bench_worker {
+    struct options_account_table *table;
+    int accounts;
+    volatile int *stop;
+    pthread_t thread;
+    unsigned long long lookups;
+} __attribute__((aligned(OPTIONS_CACHE_LINE)));
+
+typedef int (*options_account_match_fn)(const struct options_account *account, void *arg);
+
+/*! \brief Scopes accepted by the cache invalidation commands */
+enum options_cache_scope {
+    OPTIONS_CACHE_SCOPE_USER,
+    OPTIONS_CACHE_SCOPE_TENANT,
+    OPTIONS_CACHE_SCOPE_GROUP,
+    OPTIONS_CACHE_SCOPE_TABLE,
+};
+
+/*! \brief Caches a database table feeds */
+enum options_cache_kind {
+    OPTIONS_CACHE_ACCOUNTS = (1 << 0),
+    OPTIONS_CACHE_PREFIX_IN = (1 << 1),
+    OPTIONS_CACHE_GROUP_PREFIXES = (1 << 2),
+};
+
+/*! \brief Lookup data cached between calls */
+struct options_cache {
+    struct options_account_table *accounts;
+    struct ao2_container *strings;                                          /*< Interned prefixes and dids */
+    struct ao2_container *prefixIn;                                         /*< options_prefix_set by TenantID */
+    struct ao2_container *groupPrefixes;                                    /*< options_prefix_set by GroupID */
+    unsigned int ttl;                                                       /*< 0 disables the cache */
+    unsigned int refreshAhead;                                              /*< cache_refresh_ahead */
+    unsigned int staleTtl;                                                  /*< cache_stale_ttl */
+    unsigned int jitter;                                                    /*< cache_ttl_jitter */
+    int generation;                                                         /*< Bumped on every invalidation */
+    int hits;
+    int misses;
+    int staleHits;                                                          /*< Hits served expired while reloaded */
+    int invalidations;
+};
+
+/*! \brief Rows of a MySQL lookup , copied out of the driver so concurrent identical lookups can share them
+ * Read only once built : each row is an array of columns cells , NULL for SQL NULL
+ */
+struct options_rows {
+    int count;
+    int columns;
+    char *cells[0];                                                         /*< count * columns , followed by the strings */
+};
+
+/*! \brief A lookup running on MySQL , that identical lookups wait for instead of sending it again */
+struct options_flight {
+    unsigned int hash;
+    int done;
+    int numRows;                                                            /*< As returned by MYSQL_query , -1 on error */
+    int shed;                                                               /*< No admission slot , the query was not sent */
+    int waiters;
+    struct options_rows *rows;
+    ast_cond_t cond;                                                        /*< Signaled once done */
+    AST_LIST_ENTRY(options_flight) list;
+    char sql[0];
+};
+
+/*! \brief Lookups running on MySQL , by hash of their statement */
+struct options_flights {
+    ast_mutex_t lock;
+    AST_LIST_HEAD_NOLOCK(, options_flight) buckets[OPTIONS_FLIGHT_BUCKETS];
+    int enabled;                                                            /*< coalesce_queries */
+    int inflight;
+    int leaders;                                                            /*< Lookups sent to MySQL */
+    int coalesced;                                                          /*< Lookups answered by a query sent for another call */
+    int failed;                                                             /*< Coalesced lookups that received an error */
+    int maxWaiters;                                                         /*< Most calls that waited for one query */
+};
+
+/*! \brief A cached entry to reload in background */
+struct options_refresh_job {
+    enum options_cache_kind kind;                                           /*< Accounts , prefix_in or group prefixes */
+    int id;                                                                 /*< UserID , TenantID or GroupID */
+    int generation;                                                         /*< Cache generation when queued */
+    AST_LIST_ENTRY(options_refresh_job) list;
+};
+
+/*! \brief Background reload of cached entries used past their refresh date */
+struct options_refresh {
+    ast_mutex_t lock;
+    ast_cond_t cond;
+    pthread_t thread;
+    int stop;
+    AST_LIST_HEAD_NOLOCK(, options_refresh_job) jobs;
+    int pending;
+    int queued;
+    int refreshed;
+    int failed;
+    int dropped;                                                            /*< Not queued , the queue was full */
+};
+
+/*! \brief Load state of a tenant partition */
+enum options_tenant_state {
+    OPTIONS_TENANT_PARTIAL,                                                 /*< Only accounts loaded one at a time */
+    OPTIONS_TENANT_LOADING,                                                 /*< A call is loading every account , others wait */
+    OPTIONS_TENANT_LOADED,                                                  /*< Every account loaded until expires */
+    OPTIONS_TENANT_EVICTING,                                                /*< Its accounts are being dropped , loads wait */
+};
+
+/*! \brief Queries a tenant partition is loaded with , in order : each row starts with its UserID */
+enum options_tenant_part {
+    OPTIONS_TENANT_USERS,                                                   /*< UserID , options.UserID , cidIsAcode , Monitored , RCLI */
+    OPTIONS_TENANT_GROUPS,                                                  /*< UserID , GroupID */
+    OPTIONS_TENANT_MONITORED,                                               /*< UserID , number of monitored groups */
+    OPTIONS_TENANT_BLOCKED,                                                 /*< UserID , blocked prefix */
+    OPTIONS_TENANT_DIDS,                                                    /*< UserID , did */
+};
+
+/*! \brief Cached accounts of one tenant , the unit loaded on first call and evicted when cold */
+struct options_tenant {
+    int id;                                                                 /*< TenantID , first like options_prefix_set */
+    int state;                                                              /*< enum options_tenant_state , under optionsTenants.lock */
+    time_t expires;                                                         /*< Loaded accounts expire at this date */
+    int accounts;                                                           /*< Accounts in the cache */
+    int memory;                                                             /*< Bytes held by these accounts */
+    unsigned int loads;
+    unsigned int waits;                                                     /*< Calls that waited on a load run by another one */
+    int64_t loadTime;                                                       /*< Milliseconds taken by the last load */
+    int64_t maxLoadTime;
+};
+
+/*! \brief Coldest partition found by an eviction */
+struct options_tenant_victim {
+    int keep;                                                               /*< TenantID not to evict */
+    time_t lastUsed;
+    struct options_tenant *tenant;                                          /*< Reference , NULL if none */
+};
+
+/*! \brief Tenant partitions of the account cache */
+struct options_tenants {
+    struct ao2_container *partitions;                                       /*< options_tenant by TenantID */
+    ast_mutex_t lock;                                                       /*< Protects load states */
+    ast_cond_t cond;                                                        /*< Signaled when a load ends */
+    int partition;                                                          /*< enum options_cache_partition */
+    int maxMemory;                                                          /*< Bytes , 0 for no ceiling */
+    int memory;                                                             /*< Bytes held by every partition */
+    int evictions;
+    time_t lastUsed[OPTIONS_TENANT_CLOCKS];                                 /*< Last lookup , by hash of TenantID */
+};
+
+/*! \brief A query waiting for an admission slot */
+struct options_admission_waiter {
+    ast_cond_t cond;
+    int granted;
+    AST_LIST_ENTRY(options_admission_waiter) list;
+};
+
+/*! \brief Queries of one tenant waiting for an admission slot */
+struct options_admission_tenant {
+    int tenantId;
+    AST_LIST_HEAD_NOLOCK(, options_admission_waiter) waiters;
+    AST_LIST_ENTRY(options_admission_tenant) list;
+};
+
+/*! \brief Admission controller bounding concurrent database queries
+ * Slots are handed to waiting tenants in round robin so a single tenant's burst can't starve the others
+ */
+struct options_admission {
+    ast_mutex_t lock;
+    unsigned int maxInflight;
+    unsigned int maxQueueWait;                                              /*< Milliseconds */
+    int shedVerdict;                                                        /*< enum options_shed_verdict */
+    unsigned int inflight;
+    unsigned int queued;
+    AST_LIST_HEAD_NOLOCK(, options_admission_tenant) tenants;               /*< Tenants with waiters , next served first */
+    uint64_t queries;
+    uint64_t waited;                                                        /*< Queries that had to queue */
+    uint64_t shed;
+    uint64_t queueTime;                                                     /*< Microseconds */
+    uint64_t queueTimeMax;
+    uint64_t queryTime;                                                     /*< Microseconds */
+    uint64_t queryTimeMax;
+};
+
+/*! \brief Per-thread state of the Options() execution running on it */
+struct options_call_state {
+    int active;                                                             /*< Inside app_exec() */
+    int tenantId;                                                           /*< 0 until known , used for fair queueing */
+    int shed;                                                               /*< A query was refused by admission control */
+    const char *stage;                                                      /*< Step of Options() , or background job , running queries */
+    int shadow;                                                             /*< Shadow check : no admission slot , no coalescing */
+    char uniqueid[AST_MAX_UNIQUEID];                                        /*< Channel of the call */
+};
+
+/*! \brief A query kept in the slow log */
+struct options_slow_query {
+    time_t when;
+    char uniqueid[AST_MAX_UNIQUEID];                                        /*< Empty outside of a call */
+    const char *stage;
+    char endpoint[64];                                                      /*< Host that ran the query */
+    int64_t waitTime;                                                       /*< Microseconds waited for an admission slot */
+    int64_t queryTime;                                                      /*< Microseconds spent running the query */
+    int rows;                                                               /*< -1 on error */
+    int sampled;                                                            /*< Under the threshold , kept by sampling */
+    char sql[OPTIONS_SLOW_LOG_SQL];
+};
+
+/*! \brief Ring buffer of the last slow and sampled queries */
+struct options_slow_log {
+    ast_mutex_t lock;                                                       /*< Protects entries and their position */
+    unsigned int threshold;                                                 /*< Milliseconds , 0 to only keep sampled queries */
+    double sample;
+    unsigned int size;
+    unsigned int next;                                                      /*< Slot of the next entry */
+    unsigned int count;                                                     /*< Entries in use */
+    struct options_slow_query *entries;
+    int queries;
+    int slow;
+    int sampled;
+};
+
+/*! \brief Capture of Options() inputs , replayed offline by loadtest/replay.py
+ * The file starts with OPTIONS_CAPTURE_MAGIC , then holds one record per call : the time in microseconds since the
+ * epoch on 8 bytes , the lengths of data , accountcode , caller id number and channel name on one byte each , then
+ * these strings without terminator. Integers are little endian.
+ */
+struct options_capture {
+    ast_mutex_t lock;
+    FILE *file;                                                             /*< NULL when not capturing */
+    char path[PATH_MAX];
+    time_t started;
+    unsigned int records;
+    unsigned int limit;                                                     /*< Stop after this many records , 0 for no limit */
+    uint64_t bytes;
+};
+
+/*! \brief Inputs and cached decisions of a call , checked again on MySQL by the shadow job */
+struct options_shadow_job {
+    char uniqueid[AST_MAX_UNIQUEID];
+    char channel[AST_CHANNEL_NAME];
+    char accountCode[AST_MAX_ACCOUNT_CODE];                                 /*< Once trunkASP applied */
+    char callerId[AST_MAX_EXTENSION];                                       /*< Before RcliOnCountry */
+    char data[AST_MAX_EXTENSION];
+    char formattedNumber[26];
+    int blocked;
+    int monitored;
+    int rcli;
+    char sda[AST_MAX_EXTENSION];                                            /*< Set by RcliOnCountry , empty if none */
+    AST_LIST_ENTRY(options_shadow_job) list;
+};
+
+/*! \brief Sampled calls served from the cache , whose decisions are checked again on MySQL in background */
+struct options_shadow {
+    ast_mutex_t lock;
+    ast_cond_t cond;
+    pthread_t thread;
+    int stop;
+    AST_LIST_HEAD_NOLOCK(, options_shadow_job) jobs;
+    unsigned int sample;                                                    /*< Parts per million of calls checked , atomic , 0 disables */
+    int pending;
+    int sampled;
+    int dropped;                                                            /*< Not queued , the queue was full */
+    int failed;                                                             /*< Not compared , a MySQL query failed */
+    int checked;
+    int mismatches;                                                         /*< Calls with at least one different decision */
+    int numberMismatches;
+    int blockedMismatches;
+    int monitoredMismatches;
+    int rcliMismatches;
+    int sdaMismatches;                                                      /*< Chosen Sda not among MySQL ones */
+};
+
+/*! \brief Rate and concurrency of one UserID or TenantID
+ * Only updated with atomics : the key is claimed once with a compare and swap and the slot is never released
+ */
+struct options_limit_bucket {
+    int key;                                                                /*< 0 in a free slot */
+    int calls;                                                              /*< Calls in progress */
+    uint64_t tat;                                                           /*< Theoretical arrival time of the next call (us) */
+    unsigned int rejected;
+    unsigned int pad;
+};
+
+/*! \brief One shard of a limit table : a fixed open addressing table of its own */
+struct options_limit_shard {
+    struct options_limit_bucket buckets[OPTIONS_LIMIT_SHARD_SLOTS];
+} __attribute__((aligned(OPTIONS_CACHE_LINE)));
+
+/*! \brief Buckets by UserID or TenantID */
+struct options_limit_table {
+    struct options_limit_shard shards[OPTIONS_LIMIT_SHARDS];
+};
+
+/*! \brief Reasons a call is refused by the limiter */
+enum options_limit_reason {
+    OPTIONS_LIMIT_USER_CPS,
+    OPTIONS_LIMIT_USER_CALLS,
+    OPTIONS_LIMIT_TENANT_CPS,
+    OPTIONS_LIMIT_TENANT_CALLS,
+    OPTIONS_LIMIT_REASONS,
+};
+
+/*! \brief Per-account and per-tenant call limits , checked before any database work */
+struct options_limits {
+    unsigned int userCps;
+    unsigned int userCalls;
+    unsigned int tenantCps;
+    unsigned int tenantCalls;
+    int admitted;
+    int rejected[OPTIONS_LIMIT_REASONS];
+    int full;                                                               /*< Calls let through because a shard was full */
+    struct options_limit_table users;
+    struct options_limit_table tenants;
+};
+
+/*! \brief Concurrent call slots held by a channel , given back when the channel goes away */
+struct options_limit_hold {
+    struct options_limit_bucket *user;
+    struct options_limit_bucket *tenant;
+    int tenantChecked;                                                      /*< Tenant limits have been applied */
+};
+
+/*! \brief Per-account results of Options() kept on the channel for its later runs
+ * Stale once the channel accountcode differs from accountCode (transfer , new trunk ...)
+ */
+struct options_channel_memo {
+    char accountCode[AST_MAX_ACCOUNT_CODE];                                 /*< After Trunk ASP , empty when not usable */
+    int tenantId;
+    int monitored;
+    int rcli;
+    int recording;                                                          /*< A recording was started on this channel */
+    int groupCount;                                                         /*< group_user rows , -1 when not known */
+    struct options_account_extra *extra;                                    /*< Groups and prohibitions of the account */
+};
+
+/*! \brief Data access of the lookups , one implementation per storage
+ * Account operations fill account (and account->extra) , they return 0 on success and -1 on error.
+ * Prefix operations return a new options_prefix_set , or NULL on error.
+ * tenant_accounts stores every account of a tenant in batch , it returns 0 on success and -1 on error.
+ */
+struct options_backend {
+    const char *name;
+    int (*account_options)(int userId, struct options_account *account, struct database_configuration *dbInfo);
+    int (*group_membership)(int userId, struct options_account *account, struct database_configuration *dbInfo);
+    int (*blocked_prefixes)(int userId, struct options_account *account, struct database_configuration *dbInfo);
+    int (*dids)(int userId, struct options_account *account, struct database_configuration *dbInfo);
+    struct options_prefix_set *(*normalization)(int tenantId, struct database_configuration *dbInfo);
+    struct options_prefix_set *(*group_prefixes)(int groupId, struct database_configuration *dbInfo);
+    int (*tenant_accounts)(int tenantId, struct options_account_table *batch, struct database_configuration *dbInfo);
+};
+
+/*! \brief Storage backend in use and the local SQLite file */
+struct options_storage {
+    const struct options_backend *backend;
+    ast_rwlock_t lock;                                                      /*< Protects db against swaps by the sync job */
+    sqlite3 *db;
+    char file[PATH_MAX];                                                    /*< File db was opened from */
+    ast_mutex_t syncLock;                                                   /*< Serializes syncs , protects statistics */
+    time_t lastAttempt;
+    time_t lastSync;
+    unsigned int syncs;
+    unsigned int syncFailures;
+    unsigned int rows;                                                      /*< Rows copied by the last sync */
+    int64_t syncTime;                                                       /*< Milliseconds taken by the last sync */
+    ast_mutex_t jobLock;
+    ast_cond_t jobCond;
+    pthread_t thread;
+    int stop;
+};
+
+/*! \brief Tables copied from MySQL into the local SQLite file
+ * Joins needed by lookups are resolved while copying (user_dids)
+ */
+static const struct {
+    const char *name;
+    const char *create;
+    const char *index;
+    const char *select;                                                     /*< Run on MySQL , columns in local order */
+    int columns;
+} options_sync_tables[] = {
+        {"users",
+                "CREATE TABLE users (UserID INTEGER PRIMARY KEY, TenantID INTEGER)",
+                NULL,
+                "SELECT UserID, TenantID FROM users", 2},
+        {"options",
+                "CREATE TABLE options (UserID INTEGER PRIMARY KEY, cidIsAcode INTEGER, Monitored INTEGER, RCLI INTEGER)",
+                NULL,
+                "SELECT UserID, cidIsAcode, Monitored, RCLI FROM options", 4},
+        {"group_user",
+                "CREATE TABLE group_user (UserID INTEGER, GroupID INTEGER)",
+                "CREATE INDEX group_user_UserID ON group_user (UserID)",
+                "SELECT UserID, GroupID FROM group_user", 2},
+        {"group_agent",
+                "CREATE TABLE group_agent (GroupID INTEGER, monitored INTEGER)",
+                "CREATE INDEX group_agent_GroupID ON group_agent (GroupID)",
+                "SELECT GroupID, monitored FROM group_agent", 2},
+        {"blocked_prefix_user",
+                "CREATE TABLE blocked_prefix_user (UserID INTEGER, prefix TEXT)",
+                "CREATE INDEX blocked_prefix_user_UserID ON blocked_prefix_user (UserID)",
+                "SELECT UserID, prefix FROM blocked_prefix_user", 2},
+        {"blocked_prefix_group",
+                "CREATE TABLE blocked_prefix_group (GroupID INTEGER, prefix TEXT)",
+                "CREATE INDEX blocked_prefix_group_GroupID ON blocked_prefix_group (GroupID)",
+                "SELECT GroupID, prefix FROM blocked_prefix_group", 2},
+        {"prefix_in",
+                "CREATE TABLE prefix_in (TenantID INTEGER, prefix TEXT, digit_delete INTEGER, new_prefix TEXT)",
+                "CREATE INDEX prefix_in_TenantID ON prefix_in (TenantID)",
+                "SELECT TenantID, prefix, digit_delete, new_prefix FROM prefix_in", 4},
+        {"user_dids",
+                "CREATE TABLE user_dids (UserID INTEGER, did TEXT)",
+                "CREATE INDEX user_dids_UserID ON user_dids (UserID)",
+                "SELECT didToUser.userid, did FROM dids NATURAL JOIN didToUser", 2},
+};
+
+/*! \brief Database tables and the caches they feed */
+static const struct {
+    const char *name;
+    int caches;
+} options_cache_tables[] = {
+        {"users",                OPTIONS_CACHE_ACCOUNTS},
+        {"options",              OPTIONS_CACHE_ACCOUNTS},
+        {"group_user",           OPTIONS_CACHE_ACCOUNTS},
+        {"group_agent",          OPTIONS_CACHE_ACCOUNTS},
+        {"blocked_prefix_user",  OPTIONS_CACHE_ACCOUNTS},
+        {"dids",                 OPTIONS_CACHE_ACCOUNTS},
+        {"didToUser",            OPTIONS_CACHE_ACCOUNTS},
+        {"prefix_in",            OPTIONS_CACHE_PREFIX_IN},
+        {"blocked_prefix_group", OPTIONS_CACHE_GROUP_PREFIXES},
+};
+
+/*! \brief Queries loading a tenant partition , by enum options_tenant_part */
+static const struct {
+    const char *mysql;                                                      /*< TenantID given with %d */
+    const char *sqlite;                                                     /*< TenantID bound to ? */
+} options_tenant_queries[] = {
+        {"SELECT users.UserID, options.UserID, options.cidIsAcode, options.Monitored, options.RCLI FROM users LEFT JOIN options USING(UserID) WHERE users.TenantID=%d",
+                "SELECT users.UserID, options.UserID, options.cidIsAcode, options.Monitored, options.RCLI FROM users LEFT JOIN options USING(UserID) WHERE users.TenantID=?"},
+        {"SELECT group_user.UserID, group_user.GroupID FROM group_user INNER JOIN users USING(UserID) WHERE users.TenantID=%d",
+                "SELECT group_user.UserID, group_user.GroupID FROM group_user INNER JOIN users USING(UserID) WHERE users.TenantID=?"},
+        {"SELECT group_user.UserID, COUNT(GUID) FROM group_user INNER JOIN group_agent USING(GroupID) INNER JOIN users USING(UserID) WHERE (users.TenantID=%d) AND (group_agent.monitored=1) GROUP BY group_user.UserID",
+                "SELECT group_user.UserID, COUNT(*) FROM group_user INNER JOIN group_agent USING(GroupID) INNER JOIN users USING(UserID) WHERE (users.TenantID=?) AND (group_agent.monitored=1) GROUP BY group_user.UserID"},
+        {"SELECT blocked_prefix_user.UserID, blocked_prefix_user.prefix FROM blocked_prefix_user INNER JOIN users USING(UserID) WHERE users.TenantID=%d",
+                "SELECT blocked_prefix_user.UserID, blocked_prefix_user.prefix FROM blocked_prefix_user INNER JOIN users USING(UserID) WHERE users.TenantID=?"},
+        {"SELECT didToUser.userid, dids.did FROM dids NATURAL JOIN didToUser INNER JOIN users ON users.UserID=didToUser.userid WHERE users.TenantID=%d",
+                "SELECT user_dids.UserID, user_dids.did FROM user_dids INNER JOIN users USING(UserID) WHERE users.TenantID=?"},
+};
+
+static struct options_cache optionsCache;
+
+static struct options_tenants optionsTenants = {
+        .lock = AST_MUTEX_INIT_VALUE,
+};
+
+/*! \brief Replica health checker thread */
+static struct {
+    ast_mutex_t lock;
+    ast_cond_t cond;
+    pthread_t thread;
+    int stop;
+} optionsHealth = {
+        .lock = AST_MUTEX_INIT_VALUE,
+        .thread = AST_PTHREADT_NULL,
+};
+
+static struct options_storage optionsStorage = {
+        .lock = AST_RWLOCK_INIT_VALUE,
+        .syncLock = AST_MUTEX_INIT_VALUE,
+        .jobLock = AST_MUTEX_INIT_VALUE,
+        .thread = AST_PTHREADT_NULL,
+};
+
+static struct options_limits optionsLimits;
+
+static struct options_flights optionsFlights = {
+        .lock = AST_MUTEX_INIT_VALUE,
+        .enabled = 1,
+};
+
+static struct options_refresh optionsRefresh = {
+        .lock = AST_MUTEX_INIT_VALUE,
+        .thread = AST_PTHREADT_NULL,
+};
+
+static struct options_slow_log optionsSlowLog = {
+        .lock = AST_MUTEX_INIT_VALUE,
+};
+
+static struct options_capture optionsCapture = {
+        .lock = AST_MUTEX_INIT_VALUE,
+};
+
+static struct options_shadow optionsShadow = {
+        .lock = AST_MUTEX_INIT_VALUE,
+        .thread = AST_PTHREADT_NULL,
+};
+
+static struct options_admission optionsAdmission = {
+        .lock = AST_MUTEX_INIT_VALUE,
+        .maxInflight = 8,
+        .maxQueueWait = 500,
+        .shedVerdict = OPTIONS_SHED_ALLOW,
+};
+
+AST_THREADSTORAGE(options_call_storage);
+
 /*! \brief A container that holds our global module options configuration */
 static AO2_GLOBAL_OBJ_STATIC(options_globals);
 
@@ -114,7 +775,51 @@ static void global_option_destructor(void *obj);
 
 static int loadConfiguration(void);
 
-int MYSQL_connect(struct database_configuration* dbInfo);
+int MYSQL_connect(struct database_configuration* dbInfo, struct options_endpoint *endpoint, MYSQL *conn);
+
+static MYSQL *options_db_checkout(struct database_configuration *dbInfo, struct options_endpoint **endpoint);
+
+static void options_db_checkin(struct database_configuration *dbInfo, struct options_endpoint *endpoint, MYSQL *conn,
+                               int64_t latency, unsigned int error);
+
+static int replica_handler(const struct aco_option *opt, struct ast_variable *var, void *obj);
+
+static struct options_endpoint *options_endpoint_draw(struct options_endpoint **candidates, int count,
+                                                      unsigned int totalWeight);
+
+static struct options_endpoint *options_endpoint_pick(struct database_configuration *dbInfo, unsigned int skip);
+
+static void options_health_check(struct database_configuration *dbInfo);
+
+static void *options_health_thread(void *data);
+
+static int options_health_start(void);
+
+static void options_health_stop(void);
+
+static char *handle_cli_replicas_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static int shed_verdict_handler(const struct aco_option *opt, struct ast_variable *var, void *obj);
+
+static struct options_call_state *options_call_state_get(void);
+
+static void options_admission_deadline(struct timeval start, struct timespec *deadline);
+
+static int options_admission_acquire(struct options_call_state *state);
+
+static void options_admission_release(int64_t queryTime);
+
+static void options_admission_apply(unsigned int maxInflight, unsigned int maxQueueWait, int shedVerdict);
+
+static void options_admission_configure(unsigned int maxInflight, unsigned int maxQueueWait, int shedVerdict);
+
+static int options_admission_grant(void);
+
+static int options_admission_shed(struct ast_channel *chan);
+
+static char *handle_cli_admission_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static char *handle_cli_admission_set(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
 
 MYSQL_RES *MYSQL_query(MYSQL_RES *,int *, char*, struct database_configuration*);
 
@@ -124,7 +829,15 @@ static int is_trunked_asp_account(struct ast_channel *chan, struct database_conf
 
 static int isCallMonitored(struct ast_channel *chan, struct database_configuration *dbInfo);
 
-static int is_prefix_bloqued(struct ast_channel* chan , const char* formattedNumber , struct database_configuration* dbInfo);
+static int is_prefix_bloqued(struct ast_channel* chan , const char* formattedNumber ,
+                             const struct options_channel_memo *memo , struct database_configuration* dbInfo);
+
+static void options_memo_destroy(void *data);
+
+static struct options_channel_memo *options_memo_get(struct ast_channel *chan, int create);
+
+static void options_memo_store(struct ast_channel *chan, struct options_channel_memo *memo, int tenantId,
+                               int monitored, int rcli, struct database_configuration *dbInfo);
 
 static int forceHangup(const char*  channel_name );
 
@@ -136,11 +849,335 @@ static int get_formated_time_now(char *destTime);
 
 static int isRcliOnCountryEnabled(struct ast_channel* chan , struct database_configuration* dbInfo);
 
-static void startRcliOnCountry(struct ast_channel* chan , const char* formattedNumber , struct database_configuration* dbInfo);
+static const char *startRcliOnCountry(struct ast_channel* chan , const char* formattedNumber , struct database_configuration* dbInfo);
+
+static int options_sql_international_number(const char *destNumber, char *formattedNumber,
+                                            struct database_configuration *dbInfo);
+
+static int options_sql_prefix_blocked(const char *uniqueid, const char *accountCode, const char *formattedNumber,
+                                      struct database_configuration *dbInfo);
+
+static int options_sql_call_monitored(const char *accountCode, struct database_configuration *dbInfo);
+
+static int options_sql_rcli_enabled(const char *accountCode, struct database_configuration *dbInfo);
+
+static struct options_rows *options_sql_rcli_sdas(const char *accountCode, int prefix, int *numRows,
+                                                  struct database_configuration *dbInfo);
+
+static void options_post_apply_config(void);
+
+static int options_cache_init(void);
+
+static void options_cache_destroy(void);
+
+static int options_cache_account(const char *accountCode, struct database_configuration *dbInfo,
+                                 struct options_account *account, int withExtra);
+
+static const char *options_intern(const char *str);
+
+static void options_intern_release(const char *str);
+
+static struct options_account_table *options_account_table_alloc(void);
+
+static void options_account_table_free(struct options_account_table *table);
+
+static int options_account_table_get(struct options_account_table *table, int userId, struct options_account *account,
+                                     int withExtra);
+
+static void options_account_table_put(struct options_account_table *table, const struct options_account *account,
+                                      int generation);
+
+static int options_account_table_remove(struct options_account_table *table, options_account_match_fn match, void *arg,
+                                        int **ids);
+
+static int options_account_table_count(struct options_account_table *table);
+
+static int options_account_tenant_match(const struct options_account *account, void *arg);
+
+static struct options_prefix_set *options_cache_prefix_in(int tenantId, struct database_configuration *dbInfo);
+
+static void options_cache_flush(void);
+
+static void options_cache_lifetime(time_t *expires, time_t *refresh);
+
+static int options_cache_usable(time_t expires, time_t now);
+
+static int options_account_table_claim(struct options_account_table *table, int userId, time_t refresh);
+
+static void options_refresh_queue(enum options_cache_kind kind, int id);
+
+static int options_refresh_run(const struct options_refresh_job *job, struct database_configuration *dbInfo);
+
+static void *options_refresh_thread(void *data);
+
+static int options_refresh_start(void);
+
+static void options_refresh_stop(void);
+
+static struct options_prefix_set *options_cache_group_prefixes(int groupId, struct database_configuration *dbInfo);
+
+static const struct options_prefix_rule *options_prefix_match(const struct options_prefix_rule *rules, int count, const char *number);
+
+static int options_cache_invalidate(enum options_cache_scope scope, const char *target, int refresh);
+
+static int options_cache_scope_from_str(const char *name);
+
+static const char *options_cache_scope_name(enum options_cache_scope scope);
+
+static char *options_cache_complete(struct ast_cli_args *a);
+
+static char *options_cache_cli_exec(struct ast_cli_args *a, int refresh);
+
+static int options_cache_manager_exec(struct mansession *s, const struct message *m, int refresh);
+
+static char *handle_cli_cache_invalidate(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static char *handle_cli_cache_refresh(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static char *handle_cli_cache_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static char *handle_cli_cache_benchmark(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static int manager_cache_invalidate(struct mansession *s, const struct message *m);
+
+static int manager_cache_refresh(struct mansession *s, const struct message *m);
+
+static int manager_cache_show(struct mansession *s, const struct message *m);
+
+static int options_use_cache(void);
+
+static const struct options_backend *options_storage_backend(void);
+
+static struct options_prefix_set *options_prefix_set_alloc(int id, int count);
+
+static int options_prefix_rule_init(struct options_prefix_rule *rule, const char *prefix, int digitDelete,
+                                    const char *newPrefix);
+
+static int options_prefix_set_add(struct options_prefix_set *set, const char *prefix, int digitDelete,
+                                  const char *newPrefix);
+
+static int options_mysql_account_options(int userId, struct options_account *account,
+                                         struct database_configuration *dbInfo);
+
+static int options_mysql_group_membership(int userId, struct options_account *account,
+                                          struct database_configuration *dbInfo);
+
+static int options_mysql_blocked_prefixes(int userId, struct options_account *account,
+                                          struct database_configuration *dbInfo);
+
+static int options_mysql_dids(int userId, struct options_account *account, struct database_configuration *dbInfo);
+
+static struct options_prefix_set *options_mysql_prefix_set(int id, const char *queryString,
+                                                           struct database_configuration *dbInfo);
+
+static struct options_prefix_set *options_mysql_normalization(int tenantId, struct database_configuration *dbInfo);
+
+static struct options_prefix_set *options_mysql_group_prefixes(int groupId, struct database_configuration *dbInfo);
+
+static sqlite3_stmt *options_sqlite_prepare(const char *sql, int key);
+
+static void options_sqlite_done(sqlite3_stmt *stmt);
+
+static int options_sqlite_count(sqlite3_stmt *stmt);
+
+static int options_sqlite_account_options(int userId, struct options_account *account,
+                                          struct database_configuration *dbInfo);
+
+static int options_sqlite_group_membership(int userId, struct options_account *account,
+                                           struct database_configuration *dbInfo);
+
+static int options_sqlite_blocked_prefixes(int userId, struct options_account *account,
+                                           struct database_configuration *dbInfo);
+
+static int options_sqlite_dids(int userId, struct options_account *account, struct database_configuration *dbInfo);
+
+static struct options_prefix_set *options_sqlite_prefix_set(int id, const char *sql);
+
+static struct options_prefix_set *options_sqlite_normalization(int tenantId, struct database_configuration *dbInfo);
+
+static struct options_prefix_set *options_sqlite_group_prefixes(int groupId, struct database_configuration *dbInfo);
+
+static int options_storage_open(const char *file);
+
+static void options_storage_close(void);
+
+static void options_storage_configure(struct database_configuration *dbInfo);
+
+static int options_storage_sync(struct database_configuration *dbInfo);
+
+static void *options_storage_thread(void *data);
+
+static int options_storage_start(void);
+
+static void options_storage_stop(void);
+
+static int storage_handler(const struct aco_option *opt, struct ast_variable *var, void *obj);
+
+static char *handle_cli_storage_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static char *handle_cli_storage_sync(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static uint64_t options_monotonic_us(void);
+
+static void options_slow_log_tag(const struct options_call_state *state, char *tag, size_t size);
+
+static void options_slow_log_record(const struct options_call_state *state, const char *endpoint, const char *sql,
+                                    int64_t waitTime, int64_t queryTime, int rows);
+
+static void options_slow_log_configure(unsigned int threshold, double sample, unsigned int size);
+
+static char *handle_cli_show_slowqueries(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static struct options_rows *options_rows_copy(MYSQL_RES *res);
+
+static MYSQL_ROW options_rows_fetch(struct options_rows *rows, int row);
+
+static struct options_rows *options_query(struct options_rows *previous, int *numRows, char *querystring,
+                                          struct database_configuration *dbInfo);
+
+static void options_flight_destructor(void *obj);
+
+static char *handle_cli_coalescing_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static int options_account_memory(const struct options_account *account);
+
+static struct options_tenant *options_tenant_get(int tenantId, int create);
+
+static void options_tenant_charge(int tenantId, int memory, int accounts);
+
+static void options_tenant_touch(int tenantId);
+
+static time_t options_tenant_last_used(int tenantId);
+
+static int options_tenant_row(struct options_account_table *batch, int tenantId, int part, const char **row);
+
+static int options_tenant_fetch(int tenantId, struct database_configuration *dbInfo);
+
+static int options_tenant_load(int tenantId, struct database_configuration *dbInfo);
+
+static int options_tenant_account(int userId, struct database_configuration *dbInfo, struct options_account *account,
+                                  int withExtra);
+
+static void options_tenant_reset(int tenantId);
+
+static void options_tenant_enforce(int keep);
+
+static int cache_partition_handler(const struct aco_option *opt, struct ast_variable *var, void *obj);
+
+static char *handle_cli_tenants_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static int options_mysql_tenant_accounts(int tenantId, struct options_account_table *batch,
+                                         struct database_configuration *dbInfo);
+
+static int options_sqlite_tenant_accounts(int tenantId, struct options_account_table *batch,
+                                          struct database_configuration *dbInfo);
+
+static int options_prefix_candidates(const char *number, char *list, size_t size);
+
+static MYSQL_ROW options_prefix_longest_row(struct options_rows *res, int column);
+
+static int prefix_lookup_handler(const struct aco_option *opt, struct ast_variable *var, void *obj);
+
+static struct options_limit_bucket *options_limit_bucket_get(struct options_limit_table *table, int key);
+
+static int options_limit_bucket_reclaim(struct options_limit_bucket *bucket, int current, int key, uint64_t now);
+
+static void options_limit_table_reset(struct options_limit_table *table);
+
+static int options_limit_rate(struct options_limit_bucket *bucket, unsigned int cps, uint64_t now);
+
+static int options_limit_take(struct options_limit_bucket *bucket, unsigned int calls);
+
+static void options_limit_give(struct options_limit_bucket *bucket);
+
+static int options_limit_apply(struct options_limit_table *table, int key, unsigned int cps, unsigned int calls,
+                               enum options_limit_reason rate, struct options_limit_bucket **held,
+                               enum options_limit_reason *reason);
+
+static int options_limit_enter(struct ast_channel *chan, int tenantId, enum options_limit_reason *reason);
+
+static int options_limit_reject(struct ast_channel *chan, enum options_limit_reason reason);
+
+static void options_limit_hold_destroy(void *data);
+
+static const char *options_limit_reason_name(int reason);
+
+static void options_limit_table_show(int fd, const char *title, struct options_limit_table *table);
+
+static char *handle_cli_limits_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static char *handle_cli_limits_set(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static size_t options_capture_field(unsigned char *record, size_t pos, int field, const char *value);
+
+static void options_capture_record(struct ast_channel *chan, const char *data);
+
+static void options_capture_close(void);
+
+static char *handle_cli_capture_start(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static char *handle_cli_capture_stop(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static char *handle_cli_capture_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static struct options_shadow_job *options_shadow_sample(struct ast_channel *chan, const char *data,
+                                                        const char *formattedNumber, int blocked, int monitored,
+                                                        int rcli);
+
+static void options_shadow_queue(struct options_shadow_job *job, const char *sda);
+
+static int options_shadow_run(const struct options_shadow_job *job, struct database_configuration *dbInfo);
+
+static void *options_shadow_thread(void *data);
+
+static int options_shadow_start(void);
+
+static void options_shadow_stop(void);
+
+static char *handle_cli_shadow_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+static char *handle_cli_shadow_set(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+/*! \brief Channel datastore holding an options_limit_hold */
+static const struct ast_datastore_info options_limit_info = {
+        .type = "OptionsLimit",
+        .destroy = options_limit_hold_destroy,
+};
+
+/*! \brief Channel datastore holding an options_channel_memo */
+static const struct ast_datastore_info options_memo_info = {
+        .type = "Options",
+        .destroy = options_memo_destroy,
+};
+
+/*! \brief Lookups straight from MySQL */
+static const struct options_backend options_mysql_backend = {
+        .name = "mysql",
+        .account_options = options_mysql_account_options,
+        .group_membership = options_mysql_group_membership,
+        .blocked_prefixes = options_mysql_blocked_prefixes,
+        .dids = options_mysql_dids,
+        .normalization = options_mysql_normalization,
+        .group_prefixes = options_mysql_group_prefixes,
+        .tenant_accounts = options_mysql_tenant_accounts,
+};
+
+/*! \brief Lookups from the local SQLite file */
+static const struct options_backend options_sqlite_backend = {
+        .name = "sqlite",
+        .account_options = options_sqlite_account_options,
+        .group_membership = options_sqlite_group_membership,
+        .blocked_prefixes = options_sqlite_blocked_prefixes,
+        .dids = options_sqlite_dids,
+        .normalization = options_sqlite_normalization,
+        .group_prefixes = options_sqlite_group_prefixes,
+        .tenant_accounts = options_sqlite_tenant_accounts,
+};
 
 
 CONFIG_INFO_STANDARD(cfg_info, options_globals, global_option_alloc,
-                     .files = ACO_FILES(&module_conf)
+                     .files = ACO_FILES(&module_conf),
+                     .post_apply_config = options_post_apply_config,
 );
 
 